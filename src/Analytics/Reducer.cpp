@@ -0,0 +1,67 @@
+//
+// In-situ analytics: reductions of the simulation state evaluated on the device
+//
+
+#include "Reducer.h"
+#include "General/StorageHelper.h"
+#include "General/Types.h"
+
+void Reducer::setupStorage(H5::Group analytics) {
+    std::vector<std::string> columns = getColumns();
+    hsize_t length = columns.size();
+    if(analytics.nameExists(name)) {
+        // Continued simulations append to the rows of the previous run
+        H5::Group group = analytics.openGroup(name);
+        valueStorage.reset(new H5::DataSet(group.openDataSet("Values")));
+        timeStorage.reset(new H5::DataSet(group.openDataSet("Time")));
+        hsize_t dims[2];
+        valueStorage->getSpace().getSimpleExtentDims(dims);
+        if(dims[1] != length)
+            throw H5::Exception("Reducer", "Stored results of " + name + " have a different length");
+        return;
+    }
+
+    H5::Group group = analytics.createGroup(name);
+    std::vector<const char *> names;
+    for(auto &column: columns)
+        names.push_back(column.c_str());
+    group.createAttribute("Columns", StorageHelper::H5VariableString, H5::DataSpace(1, &length))
+            .write(StorageHelper::H5VariableString, names.data());
+    group.createAttribute("Interval", H5::PredType::STD_U32LE, StorageHelper::H5Scalar)
+            .write(H5::PredType::NATIVE_UINT, &interval);
+
+    // Results are small, rows are collected in chunks of many evaluations and always stored in double precision
+    hsize_t initDims[2] = {0, length};
+    hsize_t maxDims[2] = {H5S_UNLIMITED, length};
+    hsize_t chunk[2] = {64, std::max(length, (hsize_t)1)};
+    H5::DSetCreatPropList properties;
+    properties.setChunk(2, chunk);
+    valueStorage.reset(new H5::DataSet(
+            group.createDataSet("Values", H5::PredType::IEEE_F64LE, H5::DataSpace(2, initDims, maxDims), properties)));
+    H5::DSetCreatPropList timeProperties;
+    timeProperties.setChunk(1, chunk);
+    timeStorage.reset(new H5::DataSet(
+            group.createDataSet("Time", H5::PredType::IEEE_F64LE, H5::DataSpace(1, initDims, maxDims), timeProperties)));
+}
+
+void Reducer::save(array result, double time) {
+    if(!valueStorage)
+        return;
+    StorageHelper::appendValueToDataSet<double>(time, *timeStorage, H5::PredType::NATIVE_DOUBLE);
+    StorageHelper::appendDataToDataSet<GPU_REALTYPE>(flat(result).as(AF_GPUTYPE), *valueStorage, HDF5_GPUTYPE);
+}
+
+void Reducer::closeStorage() {
+    valueStorage.reset();
+    timeStorage.reset();
+}
+
+std::vector<std::string> Reducer::getReplicaColumns(std::vector<std::string> columns, unsigned int replicas) {
+    if(replicas <= 1)
+        return columns;
+    std::vector<std::string> replicaColumns;
+    for(unsigned int r = 0; r < replicas; r++)
+        for(auto &column: columns)
+            replicaColumns.push_back(column + " (replica " + std::to_string(r) + ")");
+    return replicaColumns;
+}
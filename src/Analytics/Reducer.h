@@ -0,0 +1,52 @@
+//
+// In-situ analytics: reductions of the simulation state evaluated on the device
+//
+
+#ifndef BACTSIM_GPU_REDUCER_H
+#define BACTSIM_GPU_REDUCER_H
+
+#include <arrayfire.h>
+#include <H5Cpp.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace af;
+
+/**
+ * A reducer condenses the state of the simulation into a few values every interval timesteps, e.g. the mean position
+ * of a population. The reduction stays on the device, only its result is downloaded when it is stored as a row of
+ * "/Analytics/<name>/Values" together with the model time in "/Analytics/<name>/Time". The names of the values are
+ * stored in the "Columns" attribute of the group.
+ */
+class Reducer {
+public:
+    Reducer(std::string name, unsigned int interval) : name(name), interval(std::max(interval, 1u)) {};
+    virtual ~Reducer() {};
+
+    const std::string name;
+    // Timesteps between evaluations
+    const unsigned int interval;
+
+    // Names of the values of every result, the length of the result
+    virtual std::vector<std::string> getColumns() = 0;
+    // Reduces the current state to getColumns().size() values, time is the model time of the state
+    virtual array reduce(double time) = 0;
+
+    // Creates the group of the reducer below analytics, or reopens it when a simulation is continued
+    void setupStorage(H5::Group analytics);
+    void save(array result, double time);
+    void closeStorage();
+
+protected:
+    // Values of per replica reductions are named "<column> (replica <r>)" if there is more than one replica
+    static std::vector<std::string> getReplicaColumns(std::vector<std::string> columns, unsigned int replicas);
+
+private:
+    std::unique_ptr<H5::DataSet> valueStorage;
+    std::unique_ptr<H5::DataSet> timeStorage;
+};
+
+
+#endif //BACTSIM_GPU_REDUCER_H
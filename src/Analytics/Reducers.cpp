@@ -0,0 +1,194 @@
+//
+// Built-in reducers for populations and environments
+//
+
+#include "Reducers.h"
+#include <sstream>
+
+PopulationReducer::PopulationReducer(std::string name, unsigned int interval, shared_ptr<SimplePopulation> population) :
+        Reducer(name, interval), population(population) {
+    shared_ptr<Environment> env = population->getEnvironment();
+    replicas = env->getReplicas();
+    periodic = env->getBoundaryConditionType() == BC_PERIODIC;
+    size = env->getSize();
+}
+
+array PopulationReducer::getReplicaWeights() {
+    array weights = population->getWeights() * population->getActive().as(AF_GPUTYPE);
+    if(replicas == 1)
+        return weights;
+    dim_t bacteria = weights.elements();
+    array members = tile(population->getReplicas(), 1, replicas) ==
+                    tile(range(dim4(1, replicas), 1, af::dtype::u32), bacteria);
+    return tile(weights, 1, replicas) * members.as(AF_GPUTYPE);
+}
+
+array PopulationReducer::replicaMeans(array values) {
+    array weights = getReplicaWeights();
+    // (replicas, bacteria) x (bacteria, values), empty replicas result in NaN
+    array sums = matmul(weights, values.as(AF_GPUTYPE), AF_MAT_TRANS, AF_MAT_NONE);
+    return sums / tile(sum(weights, 0).T(), 1, values.dims(1));
+}
+
+array PopulationReducer::wrap(array displacement, double length) {
+    if(!periodic)
+        return displacement;
+    return displacement - length*round(displacement/length);
+}
+
+MeanPositionReducer::MeanPositionReducer(shared_ptr<SimplePopulation> population, unsigned int interval,
+                                         std::string name) : PopulationReducer(name, interval, population) {}
+
+std::vector<std::string> MeanPositionReducer::getColumns() {
+    return getReplicaColumns({"x", "y"}, replicas);
+}
+
+array MeanPositionReducer::reduce(double) {
+    return flat(replicaMeans(join(1, population->getXpos(), population->getYpos())).T());
+}
+
+MeanSquaredDisplacementReducer::MeanSquaredDisplacementReducer(shared_ptr<SimplePopulation> population,
+                                                               unsigned int interval, std::string name) :
+        PopulationReducer(name, interval, population) {
+    // Displacements are tracked per slot, slots of dynamic populations are reused and compacted
+    if(!population->hasFixedSlots())
+        throw exception("Mean squared displacements require a population without population dynamics");
+}
+
+std::vector<std::string> MeanSquaredDisplacementReducer::getColumns() {
+    return getReplicaColumns({"MSD"}, replicas);
+}
+
+array MeanSquaredDisplacementReducer::reduce(double) {
+    array x = population->getXpos();
+    array y = population->getYpos();
+    if(displacement.isempty()) {
+        displacement = constant(0, x.elements(), 2, AF_GPUTYPE);
+    } else {
+        displacement(span, 0) += wrap(x - previous(span, 0), size[0]);
+        displacement(span, 1) += wrap(y - previous(span, 1), size[1]);
+    }
+    previous = join(1, x, y);
+    return flat(replicaMeans(sum(displacement*displacement, 1)).T());
+}
+
+ChemotacticDriftReducer::ChemotacticDriftReducer(shared_ptr<SimplePopulation> population, double sourceX,
+                                                 double sourceY, unsigned int interval, std::string name) :
+        PopulationReducer(name, interval, population), sourceX(sourceX), sourceY(sourceY) {}
+
+std::vector<std::string> ChemotacticDriftReducer::getColumns() {
+    return getReplicaColumns({"distance", "drift velocity"}, replicas);
+}
+
+array ChemotacticDriftReducer::reduce(double time) {
+    array dx = wrap(population->getXpos() - sourceX, size[0]);
+    array dy = wrap(population->getYpos() - sourceY, size[1]);
+    array distance = replicaMeans(sqrt(dx*dx + dy*dy));
+    array drift = constant(0, replicas, AF_GPUTYPE);
+    if(!previousDistance.isempty() && time > previousTime)
+        drift = (previousDistance - distance)/(time - previousTime);
+    previousDistance = distance;
+    previousTime = time;
+    return flat(join(1, distance, drift).T());
+}
+
+SwimmingFractionReducer::SwimmingFractionReducer(shared_ptr<Matthaeus2009Population> population,
+                                                 unsigned int interval, std::string name) :
+        PopulationReducer(name, interval, population), matthaeus(population) {}
+
+std::vector<std::string> SwimmingFractionReducer::getColumns() {
+    return getReplicaColumns({"swimming"}, replicas);
+}
+
+array SwimmingFractionReducer::reduce(double) {
+    return flat(replicaMeans(matthaeus->getSwimming()).T());
+}
+
+TauHistogramReducer::TauHistogramReducer(shared_ptr<Matthaeus2009Population> population, unsigned int bins,
+                                         double min, double max, unsigned int interval, std::string name) :
+        PopulationReducer(name, interval, population), matthaeus(population), bins(std::max(bins, 1u)),
+        lower(min), upper(max) {
+    if(max <= min)
+        throw exception("The range of a tau histogram must not be empty");
+}
+
+std::vector<std::string> TauHistogramReducer::getColumns() {
+    std::vector<std::string> columns;
+    for(unsigned int b = 0; b < bins; b++) {
+        std::ostringstream column;
+        column << "tau [" << lower + b*(upper - lower)/bins << ", " << lower + (b + 1)*(upper - lower)/bins
+               << (b + 1 == bins ? "]" : ")");
+        columns.push_back(column.str());
+    }
+    return getReplicaColumns(columns, replicas);
+}
+
+array TauHistogramReducer::reduce(double) {
+    array tau = matthaeus->getTau();
+    dim_t bacteria = tau.elements();
+    // The last bin includes the upper end of the range
+    array bin = min(floor((tau - lower)/(upper - lower)*bins), (double)(bins - 1)).as(af::dtype::s32);
+    array inRange = tau >= lower && tau <= upper;
+    array members = (tile(bin, 1, bins) == tile(range(dim4(1, bins), 1, af::dtype::s32), bacteria)) &&
+                    tile(inRange, 1, bins);
+    // Weighted counts instead of means
+    array counts = matmul(getReplicaWeights(), members.as(AF_GPUTYPE), AF_MAT_TRANS, AF_MAT_NONE);
+    return flat(counts.T());
+}
+
+LigandMassReducer::LigandMassReducer(shared_ptr<Environment> env, unsigned int interval, std::string name) :
+        Reducer(name, interval), env(env) {}
+
+std::vector<std::string> LigandMassReducer::getColumns() {
+    std::vector<std::string> columns;
+    for(auto &ligand: env->getLigands())
+        columns.push_back(ligand.name);
+    return getReplicaColumns(columns, env->getReplicas());
+}
+
+array LigandMassReducer::reduce(double) {
+    // (1, 1, ligands, replicas), flattened replica by replica
+    return flat(sum(sum(env->getAllDensities(), 0), 1)) * (env->resolution*env->resolution);
+}
+
+shared_ptr<Reducer> createReducer(std::string type, std::string name, unsigned int interval,
+                                  std::vector<double> arguments, shared_ptr<Environment> env,
+                                  shared_ptr<BacterialPopulation> population) {
+    auto requireArguments = [&](size_t count) {
+        if(arguments.size() != count)
+            throw exception(("The reducer " + type + " requires " + std::to_string(count) + " arguments").c_str());
+    };
+    if(type == "LigandMass") {
+        requireArguments(0);
+        return shared_ptr<Reducer>(new LigandMassReducer(env, interval, name));
+    }
+
+    if(!population)
+        throw exception(("The reducer " + type + " requires a population").c_str());
+    shared_ptr<SimplePopulation> simple = std::dynamic_pointer_cast<SimplePopulation>(population);
+    shared_ptr<Matthaeus2009Population> matthaeus = std::dynamic_pointer_cast<Matthaeus2009Population>(population);
+    if(!simple)
+        throw exception(("The reducer " + type + " is not supported by population " + population->name).c_str());
+    if(type == "MeanPosition") {
+        requireArguments(0);
+        return shared_ptr<Reducer>(new MeanPositionReducer(simple, interval, name));
+    } else if(type == "MeanSquaredDisplacement") {
+        requireArguments(0);
+        return shared_ptr<Reducer>(new MeanSquaredDisplacementReducer(simple, interval, name));
+    } else if(type == "ChemotacticDrift") {
+        requireArguments(2);
+        return shared_ptr<Reducer>(new ChemotacticDriftReducer(simple, arguments[0], arguments[1], interval, name));
+    }
+
+    if(type != "SwimmingFraction" && type != "TauHistogram")
+        throw exception(("Unknown reducer " + type).c_str());
+    if(!matthaeus)
+        throw exception(("The reducer " + type + " requires a Matthaeus2009Population").c_str());
+    if(type == "SwimmingFraction") {
+        requireArguments(0);
+        return shared_ptr<Reducer>(new SwimmingFractionReducer(matthaeus, interval, name));
+    }
+    requireArguments(3);
+    return shared_ptr<Reducer>(new TauHistogramReducer(matthaeus, (unsigned int)arguments[0], arguments[1],
+                                                       arguments[2], interval, name));
+}
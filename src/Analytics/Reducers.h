@@ -0,0 +1,121 @@
+//
+// Built-in reducers for populations and environments
+//
+
+#ifndef BACTSIM_GPU_REDUCERS_H
+#define BACTSIM_GPU_REDUCERS_H
+
+#include "Reducer.h"
+#include "BacterialPopulations/Matthaeus2009Population.h"
+
+/**
+ * Base of reductions over the bacteria of a population. Every bacterium counts with its super individual weight, dead
+ * slots of dynamic populations are ignored. Results are computed per replica and stored replica by replica.
+ */
+class PopulationReducer : public Reducer {
+public:
+    PopulationReducer(std::string name, unsigned int interval, shared_ptr<SimplePopulation> population);
+
+protected:
+    shared_ptr<SimplePopulation> population;
+    unsigned int replicas;
+
+    // (bacteria, replicas) weights of the bacteria in every replica
+    array getReplicaWeights();
+    // Weighted means over the bacteria of every replica of the (bacteria, values) array values, (replicas, values)
+    array replicaMeans(array values);
+    // Displacements between positions, wrapped to the shortest distance across periodic boundaries
+    array wrap(array displacement, double length);
+    bool periodic;
+    std::vector<double> size;
+};
+
+// Mean x and y position
+class MeanPositionReducer : public PopulationReducer {
+public:
+    MeanPositionReducer(shared_ptr<SimplePopulation> population, unsigned int interval = 1,
+                        std::string name = "Mean position");
+    std::vector<std::string> getColumns() override;
+    array reduce(double time) override;
+};
+
+// Mean squared displacement since the first evaluation, periodic boundaries are unwrapped assuming bacteria move less
+// than half the environment between two evaluations. Requires a population without population dynamics.
+class MeanSquaredDisplacementReducer : public PopulationReducer {
+public:
+    MeanSquaredDisplacementReducer(shared_ptr<SimplePopulation> population, unsigned int interval = 1,
+                                   std::string name = "Mean squared displacement");
+    std::vector<std::string> getColumns() override;
+    array reduce(double time) override;
+
+private:
+    array previous;
+    array displacement;
+};
+
+// Mean distance to a source at (x, y) and its rate of decrease since the last evaluation, positive for bacteria
+// drifting towards the source
+class ChemotacticDriftReducer : public PopulationReducer {
+public:
+    ChemotacticDriftReducer(shared_ptr<SimplePopulation> population, double sourceX, double sourceY,
+                            unsigned int interval = 1, std::string name = "Chemotactic drift");
+    std::vector<std::string> getColumns() override;
+    array reduce(double time) override;
+
+private:
+    double sourceX;
+    double sourceY;
+    array previousDistance;
+    double previousTime = 0;
+};
+
+// Fraction of swimming (not tumbling) bacteria
+class SwimmingFractionReducer : public PopulationReducer {
+public:
+    SwimmingFractionReducer(shared_ptr<Matthaeus2009Population> population, unsigned int interval = 1,
+                            std::string name = "Swimming fraction");
+    std::vector<std::string> getColumns() override;
+    array reduce(double time) override;
+
+private:
+    shared_ptr<Matthaeus2009Population> matthaeus;
+};
+
+// Number of bacteria with tau in each of bins equally sized bins in [min, max], values outside are not counted
+class TauHistogramReducer : public PopulationReducer {
+public:
+    TauHistogramReducer(shared_ptr<Matthaeus2009Population> population, unsigned int bins, double min, double max,
+                        unsigned int interval = 1, std::string name = "Tau histogram");
+    std::vector<std::string> getColumns() override;
+    array reduce(double time) override;
+
+private:
+    shared_ptr<Matthaeus2009Population> matthaeus;
+    unsigned int bins;
+    double lower;
+    double upper;
+};
+
+// Amount of every ligand in the interior of the environment, the concentration integrated over the area
+class LigandMassReducer : public Reducer {
+public:
+    LigandMassReducer(shared_ptr<Environment> env, unsigned int interval = 1, std::string name = "Ligand mass");
+    std::vector<std::string> getColumns() override;
+    array reduce(double time) override;
+
+private:
+    shared_ptr<Environment> env;
+};
+
+/**
+ * Creates a built-in reducer from its type and numeric arguments, e.g. for sweep specifications:
+ *   MeanPosition, MeanSquaredDisplacement, SwimmingFraction, LigandMass
+ *   ChemotacticDrift <source x> <source y>
+ *   TauHistogram <bins> <min> <max>
+ */
+shared_ptr<Reducer> createReducer(std::string type, std::string name, unsigned int interval,
+                                  std::vector<double> arguments, shared_ptr<Environment> env,
+                                  shared_ptr<BacterialPopulation> population);
+
+
+#endif //BACTSIM_GPU_REDUCERS_H
@@ -6,6 +6,7 @@
 #include "General/StorageHelper.h"
 
 BacteriaFactory::map_type *BacteriaFactory::map = NULL;
+BacteriaFactory::checkpoint_map_type *BacteriaFactory::checkpointMap = NULL;
 
 shared_ptr<BacterialPopulation>
 BacteriaFactory::createInstance(std::string const &s, shared_ptr<Environment> env, H5::Group group) {
@@ -15,6 +16,15 @@ BacteriaFactory::createInstance(std::string const &s, shared_ptr<Environment> en
     return it->second(env, group);
 }
 
+shared_ptr<BacterialPopulation>
+BacteriaFactory::createInstance(std::string const &s, shared_ptr<Environment> env, const Checkpoint &checkpoint,
+                                std::string prefix) {
+    checkpoint_map_type::iterator it = getCheckpointMap()->find(s);
+    if(it == getCheckpointMap()->end())
+        return shared_ptr<BacterialPopulation>();
+    return it->second(env, checkpoint, prefix);
+}
+
 BacteriaFactory::map_type * BacteriaFactory::getMap() {
     // never delete'ed. (exist until program termination)
     // because we can't guarantee correct destruction order
@@ -22,6 +32,11 @@ BacteriaFactory::map_type * BacteriaFactory::getMap() {
     return map;
 }
 
+BacteriaFactory::checkpoint_map_type * BacteriaFactory::getCheckpointMap() {
+    if(!checkpointMap) { checkpointMap = new checkpoint_map_type; }
+    return checkpointMap;
+}
+
 
 shared_ptr<BacterialPopulation> BacterialPopulation::createFromGroup(shared_ptr<Environment> env, H5::Group group) {
     H5::Attribute popType = group.openAttribute("Type");
@@ -31,6 +46,20 @@ shared_ptr<BacterialPopulation> BacterialPopulation::createFromGroup(shared_ptr<
     return BacteriaFactory::createInstance(type, env, group);
 }
 
+shared_ptr<BacterialPopulation> BacterialPopulation::createFromCheckpoint(shared_ptr<Environment> env,
+                                                                          const Checkpoint &checkpoint, std::string prefix) {
+    return BacteriaFactory::createInstance(checkpoint.getString(prefix + "Type"), env, checkpoint, prefix);
+}
+
+BacterialPopulation::BacterialPopulation(const Checkpoint &checkpoint, std::string prefix) {
+    this->name = checkpoint.getString(prefix + "Name");
+}
+
+void BacterialPopulation::writeCheckpoint(Checkpoint &checkpoint, std::string prefix) {
+    checkpoint.setString(prefix + "Name", this->name);
+    checkpoint.setString(prefix + "Type", this->getType());
+}
+
 BacterialPopulation::BacterialPopulation(H5::Group group) {
     this->storage.reset(new H5::Group(group));
     this->storage->openAttribute("Name").read(StorageHelper::H5VariableString, this->name);
@@ -30,6 +30,8 @@ struct BacterialParameters {
 class BacterialPopulation {
 public:
     static shared_ptr<BacterialPopulation> createFromGroup(shared_ptr<Environment> env, H5::Group group);
+    static shared_ptr<BacterialPopulation> createFromCheckpoint(shared_ptr<Environment> env, const Checkpoint &checkpoint,
+                                                               std::string prefix);
     std::string name;
     virtual void interactWithEnv(int individual, double dt) = 0;
     virtual void interactWithEnv(array individuals, double dt) = 0;
@@ -40,17 +42,23 @@ public:
     virtual array getYpos() = 0;
 
     virtual void liveTimestep(double dt) = 0;
+    // Whether liveTimestep only reads the environment, it may then run during the diffusion of the same timestep
+    virtual bool isIndependentOfDiffusion() { return false; }
     virtual double getStabledt() = 0;
 
     virtual void setupStorage(H5::Group storage);
     virtual bool save() = 0;
     virtual void closeStorage() = 0;
 
+    // Complete state and parameters for restarts, entries are named below prefix
+    virtual void writeCheckpoint(Checkpoint &checkpoint, std::string prefix);
+
     array concentrations;
     virtual array getInterpolatedPositions() = 0;
     virtual void printInternals() = 0;
 protected:
     BacterialPopulation(H5::Group group);
+    BacterialPopulation(const Checkpoint &checkpoint, std::string prefix);
     BacterialPopulation(BacterialParameters params): params(params) {};
 
     BacterialParameters params;
@@ -63,14 +71,26 @@ template<typename T> shared_ptr<BacterialPopulation> createT(shared_ptr<Environm
             static_cast<BacterialPopulation *>(new T(env, group)));
 }
 
+template<typename T> shared_ptr<BacterialPopulation> createFromCheckpointT(shared_ptr<Environment> env,
+                                                                           const Checkpoint &checkpoint, std::string prefix) {
+    return shared_ptr<BacterialPopulation>(
+            static_cast<BacterialPopulation *>(new T(env, checkpoint, prefix)));
+}
+
 class BacteriaFactory {
     typedef std::map<std::string, shared_ptr<BacterialPopulation>(*)(shared_ptr<Environment> env, H5::Group group)> map_type;
+    typedef std::map<std::string, shared_ptr<BacterialPopulation>(*)(shared_ptr<Environment> env,
+                                                                     const Checkpoint &checkpoint, std::string prefix)> checkpoint_map_type;
 public:
     static shared_ptr<BacterialPopulation>
     createInstance(std::string const &s, shared_ptr<Environment> env, H5::Group group);
+    static shared_ptr<BacterialPopulation>
+    createInstance(std::string const &s, shared_ptr<Environment> env, const Checkpoint &checkpoint, std::string prefix);
 protected:
     static map_type * getMap();
     static map_type * map;
+    static checkpoint_map_type * getCheckpointMap();
+    static checkpoint_map_type * checkpointMap;
 };
 
 template<typename T>
@@ -78,6 +98,7 @@ class DerivedRegister : BacteriaFactory {
 public:
     DerivedRegister(std::string const& s) {
         getMap()->insert(std::make_pair(s, &createT<T>));
+        getCheckpointMap()->insert(std::make_pair(s, &createFromCheckpointT<T>));
     }
 };
 
@@ -0,0 +1,248 @@
+//
+// Hybrid agent / continuum population
+//
+
+#include "HybridPopulation.h"
+#include "General/StorageHelper.h"
+#include "General/SyncCounter.h"
+#include "General/Profiler.h"
+
+HybridPopulation::HybridPopulation(std::string name, shared_ptr<Environment> Env, HybridPopulationParameters parameters,
+                                   int nBacteria) :
+        SimplePopulation(name, Env, withSuperIndividuals(parameters), nBacteria), params(withSuperIndividuals(parameters)) {
+    initContinuum();
+}
+
+HybridPopulation::HybridPopulation(shared_ptr<Environment> Env, H5::Group group) : SimplePopulation(Env, group) {
+    this->params = HybridPopulationParameters(SimplePopulation::params);
+    group.openAttribute("Bacterial diffusion").read(HDF5_GPUTYPE, &params.bacterialDiffusion);
+    group.openAttribute("Chemotactic sensitivity").read(HDF5_GPUTYPE, &params.chemotacticSensitivity);
+    group.openAttribute("Density threshold").read(HDF5_GPUTYPE, &params.densityThreshold);
+    group.openAttribute("Release threshold").read(HDF5_GPUTYPE, &params.releaseThreshold);
+    initContinuum();
+
+    H5::DataSet continuumData = group.openDataSet("Continuum density");
+    this->continuum = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(continuumData, HDF5_GPUTYPE, AF_GPUTYPE);
+    this->continuumStorage.reset(new DataSet(continuumData));
+}
+
+HybridPopulation::HybridPopulation(shared_ptr<Environment> Env, const Checkpoint &checkpoint, std::string prefix) :
+        SimplePopulation(Env, checkpoint, prefix) {
+    this->params = HybridPopulationParameters(SimplePopulation::params);
+    std::string parameterPrefix = prefix + "Parameters/";
+    params.bacterialDiffusion = checkpoint.getValue(parameterPrefix + "Bacterial diffusion");
+    params.chemotacticSensitivity = checkpoint.getValue(parameterPrefix + "Chemotactic sensitivity");
+    params.densityThreshold = checkpoint.getValue(parameterPrefix + "Density threshold");
+    params.releaseThreshold = checkpoint.getValue(parameterPrefix + "Release threshold");
+    initContinuum();
+    restoreArrays(checkpoint, prefix, getCheckpointArrays(), SimplePopulation::getCheckpointArrays().size());
+}
+
+void HybridPopulation::writeCheckpoint(Checkpoint &checkpoint, std::string prefix) {
+    SimplePopulation::writeCheckpoint(checkpoint, prefix);
+    std::string parameterPrefix = prefix + "Parameters/";
+    checkpoint.setValue(parameterPrefix + "Bacterial diffusion", params.bacterialDiffusion);
+    checkpoint.setValue(parameterPrefix + "Chemotactic sensitivity", params.chemotacticSensitivity);
+    checkpoint.setValue(parameterPrefix + "Density threshold", params.densityThreshold);
+    checkpoint.setValue(parameterPrefix + "Release threshold", params.releaseThreshold);
+}
+
+std::vector<std::pair<std::string, array *>> HybridPopulation::getCheckpointArrays() {
+    std::vector<std::pair<std::string, array *>> arrays = SimplePopulation::getCheckpointArrays();
+    arrays.push_back(std::make_pair(std::string("Continuum density"), &continuum));
+    return arrays;
+}
+
+REGISTER_DEF_TYPE(HybridPopulation);
+
+HybridPopulationParameters HybridPopulation::withSuperIndividuals(HybridPopulationParameters parameters) {
+    // Released continuum cells become weighted agents, therefore the agents have to be super individuals
+    parameters.superIndividuals = true;
+    return parameters;
+}
+
+void HybridPopulation::initContinuum() {
+    // The continuum and the agent exchange operate on a single grid
+    if(env->getReplicas() > 1)
+        throw exception("HybridPopulation does not support replicated environments");
+
+    dim4 dims = env->getAllDensities().dims();
+    ny = dims[0];
+    nx = dims[1];
+    continuum = constant(0, ny, nx, AF_GPUTYPE);
+
+    GPU_REALTYPE stencil [] =
+            {0.0, 1.0, 0.0,
+             1.0, -4.0, 1.0,
+             0.0, 1.0, 0.0};
+    laplacian = array(3, 3, stencil).as(AF_GPUTYPE)/pow(env->resolution, 2);
+
+    interactionLigandIds.clear();
+    for(auto interaction: params.interactions)
+        interactionLigandIds.push_back(interaction.ligandId);
+}
+
+double HybridPopulation::getStabledt() {
+    if(params.bacterialDiffusion <= 0)
+        return SimplePopulation::getStabledt();
+    return std::min(SimplePopulation::getStabledt(), 0.98*pow(env->resolution, 2)/(4*params.bacterialDiffusion));
+}
+
+void HybridPopulation::liveTimestep(double dt) {
+    // Agents first, this includes merging and splitting of the super individuals
+    SimplePopulation::liveTimestep(dt);
+
+    interactContinuumWithEnv(dt);
+    simulateContinuum(dt);
+
+    // Exchange bacteria at the interface between both descriptions
+    absorbAgents();
+    releaseAgents();
+    updateInterpolatedPositions();
+}
+
+array HybridPopulation::getCellIndexes(array x, array y) {
+    // Densities are stored as (y, x), linear indexes are column major
+    array cellx = clamp(af::floor(x/env->resolution), 0.0, nx - 1.0);
+    array celly = clamp(af::floor(y/env->resolution), 0.0, ny - 1.0);
+    return (cellx*ny + celly).as(af::dtype::u32);
+}
+
+void HybridPopulation::absorbAgents() {
+    array members = where(active);
+    SyncCounter::record("HybridPopulation::absorbAgents");
+    if(members.elements() == 0)
+        return;
+
+    // Total number of bacteria in every occupied cell, including the continuum already present there
+    array sortedCells, order;
+    sort(sortedCells, order, getCellIndexes(xpos(members), ypos(members)));
+    members = members(order);
+    array occupiedCells, cellWeights;
+    sumByKey(occupiedCells, cellWeights, sortedCells, weight(members));
+
+    array dense = flat(continuum) > params.densityThreshold;
+    array occupiedContinuum = continuum(occupiedCells);
+    array occupiedDense = dense(occupiedCells);
+    dense(occupiedCells) = occupiedDense || (occupiedContinuum + cellWeights > params.densityThreshold);
+
+    array absorbing = where(dense(sortedCells));
+    SyncCounter::record("HybridPopulation::absorbAgents");
+    if(absorbing.elements() == 0)
+        return;
+
+    // Agents in dense cells are added to the continuum
+    array absorbedMembers = members(absorbing);
+    array absorbedCells, absorbedWeights;
+    sumByKey(absorbedCells, absorbedWeights, sortedCells(absorbing), weight(absorbedMembers));
+    continuum(absorbedCells) += absorbedWeights;
+    active(absorbedMembers) = false;
+    Profiler::countEvaluations();
+    eval(continuum, active);
+}
+
+void HybridPopulation::releaseAgents() {
+    array flatContinuum = flat(continuum);
+    // Residual densities below the weight of a single agent stay in the continuum, the diffusing continuum would
+    // otherwise release a tiny agent from almost every cell in every step
+    array releasing = where(flatContinuum >= params.initialWeight && flatContinuum < params.releaseThreshold);
+    SyncCounter::record("HybridPopulation::releaseAgents");
+    dim_t nReleasing = releasing.elements();
+    if(nReleasing == 0)
+        return;
+
+    // Every sparse cell becomes a single agent at a random position within the cell, carrying the cell's density
+    array cells = releasing.as(AF_GPUTYPE);
+    array cellx = af::floor(cells/ny);
+    array celly = cells - cellx*ny;
+    array x = (cellx + randu(nReleasing, AF_GPUTYPE))*env->resolution;
+    array y = (celly + randu(nReleasing, AF_GPUTYPE))*env->resolution;
+
+    array children = addIndividuals(x, y);
+    weight(children) = flatContinuum(releasing);
+    continuum(releasing) = 0;
+    Profiler::countEvaluations();
+    eval(continuum, weight);
+}
+
+void HybridPopulation::interactContinuumWithEnv(double) {
+    dim_t nInteractions = interactionLigandIds.size();
+    if(nInteractions == 0)
+        return;
+
+    array densities = env->getAllDensities();
+    array ligconc = array(ny, nx, nInteractions, AF_GPUTYPE);
+    for(dim_t i = 0; i < nInteractions; i++)
+        ligconc(span, span, i) = densities(span, span, env->getInternalLigandIndex(interactionLigandIds[i]));
+
+    // Per bacterium rates scaled by the number of bacteria in the cell, deposited the same way agents deposit theirs
+    array rates = modelUptakeProductionRate(moddims(ligconc, ny*nx, nInteractions));
+    array change = moddims(rates*tile(flat(continuum), 1, nInteractions), ny, nx, nInteractions);
+    env->changeLigandFieldBy(change, interactionLigandIds);
+}
+
+void HybridPopulation::simulateContinuum(double dt) {
+    // Chemotactic signal is the sum of all ligands the population interacts with, as sensed by the agents
+    array densities = env->getAllDensities();
+    array signal = constant(0, ny, nx, AF_GPUTYPE);
+    for(auto ligandId: interactionLigandIds)
+        signal += densities(span, span, env->getInternalLigandIndex(ligandId));
+    array signaly, signalx;
+    grad(signaly, signalx, signal);
+    signaly /= env->resolution;
+    signalx /= env->resolution;
+
+    // Explicit Euler substeps of db/dt = D laplace(b) - chi div(b grad(c))
+    double stabledt = getStabledt();
+    int substeps = std::max(1, (int)ceil(dt/stabledt));
+    double h = dt/substeps;
+    for(int i = 0; i < substeps; i++) {
+        array diffusion = convolve(continuum, laplacian);
+        array fluxy = continuum*signaly;
+        array fluxx = continuum*signalx;
+        array dfluxy, dfluxx, unused;
+        grad(dfluxy, unused, fluxy);
+        grad(unused, dfluxx, fluxx);
+        array divergence = (dfluxy + dfluxx)/env->resolution;
+
+        continuum += h*(params.bacterialDiffusion*diffusion - params.chemotacticSensitivity*divergence);
+        continuum = max(continuum, 0.0);
+        Profiler::countEvaluations();
+        eval(continuum);
+    }
+}
+
+void HybridPopulation::setupStorage(H5::Group storage) {
+    SimplePopulation::setupStorage(storage);
+
+    this->storage->createAttribute("Bacterial diffusion", H5::PredType::IEEE_F64LE, StorageHelper::H5Scalar)
+            .write(HDF5_GPUTYPE, &params.bacterialDiffusion);
+    this->storage->createAttribute("Chemotactic sensitivity", H5::PredType::IEEE_F64LE, StorageHelper::H5Scalar)
+            .write(HDF5_GPUTYPE, &params.chemotacticSensitivity);
+    this->storage->createAttribute("Density threshold", H5::PredType::IEEE_F64LE, StorageHelper::H5Scalar)
+            .write(HDF5_GPUTYPE, &params.densityThreshold);
+    this->storage->createAttribute("Release threshold", H5::PredType::IEEE_F64LE, StorageHelper::H5Scalar)
+            .write(HDF5_GPUTYPE, &params.releaseThreshold);
+
+    // Continuum density is stored like the environment's ligand densities
+    continuumStorage.reset(new H5::DataSet(
+            StorageHelper::createFrameDataSet(*this->storage, "Continuum density", (hsize_t)ny, (hsize_t)nx)));
+}
+
+bool HybridPopulation::save() {
+    if(SimplePopulation::save()) {
+        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(continuum, *continuumStorage, HDF5_GPUTYPE);
+        return true;
+    }
+    return false;
+}
+
+void HybridPopulation::closeStorage() {
+    continuumStorage.reset();
+    SimplePopulation::closeStorage();
+}
+
+void HybridPopulation::printInternals() {
+    SimplePopulation::printInternals();
+    af_print(continuum);
+}
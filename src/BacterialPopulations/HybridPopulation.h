@@ -0,0 +1,76 @@
+//
+// Hybrid agent / continuum population
+//
+
+#ifndef BACTSIM_GPU_HYBRIDPOPULATION_H
+#define BACTSIM_GPU_HYBRIDPOPULATION_H
+
+#include "SimplePopulation.h"
+
+struct HybridPopulationParameters : SimplePopulationParameters {
+    HybridPopulationParameters() : SimplePopulationParameters() {};
+    HybridPopulationParameters(std::vector<LigandInteraction> interactions, GPU_REALTYPE swimmSpeed):
+            SimplePopulationParameters(interactions, swimmSpeed) {};
+    HybridPopulationParameters(SimplePopulationParameters paramsBase) : SimplePopulationParameters(paramsBase) {}
+
+    // Keller-Segel parameters of the continuum description
+    GPU_REALTYPE bacterialDiffusion = 100;      // um^2/s, effective diffusion of run and tumble motion
+    GPU_REALTYPE chemotacticSensitivity = 0;    // um^2/(uM*s), drift along the gradient of the sensed ligands
+
+    // Grid cells holding more bacteria than densityThreshold are described by the continuum, cells holding less
+    // than releaseThreshold (but at least initialWeight) are converted back into agents. The gap between both avoids
+    // oscillating conversions.
+    GPU_REALTYPE densityThreshold = 50;
+    GPU_REALTYPE releaseThreshold = 10;
+};
+
+/**
+ * Population that describes bacteria as SimplePopulation agents where they are sparse and as a bacterial density
+ * following the Keller-Segel equation on the environment grid where they are dense. Agents are super individuals,
+ * a sparse continuum cell is released as a single agent carrying the cell's density as its weight.
+ */
+class HybridPopulation : public SimplePopulation {
+public:
+    HybridPopulation(std::string name, shared_ptr<Environment> Env, HybridPopulationParameters parameters, int nBacteria);
+    HybridPopulation(shared_ptr<Environment> Env, H5::Group group);
+    HybridPopulation(shared_ptr<Environment> Env, const Checkpoint &checkpoint, std::string prefix);
+
+    void liveTimestep(double dt) override;
+    // The continuum changes the ligand fields
+    bool isIndependentOfDiffusion() override { return false; }
+    virtual double getStabledt() override;
+    array getContinuumDensity() { return continuum; }
+    void printInternals() override;
+
+    // Storage
+    void setupStorage(H5::Group storage) override;
+    bool save() override;
+    void closeStorage() override;
+    void writeCheckpoint(Checkpoint &checkpoint, std::string prefix) override;
+
+    REGISTER_DEC_TYPE(HybridPopulation);
+protected:
+    void initContinuum();
+    static HybridPopulationParameters withSuperIndividuals(HybridPopulationParameters parameters);
+    std::vector<std::pair<std::string, array *>> getCheckpointArrays() override;
+
+    array getCellIndexes(array x, array y);
+    void absorbAgents();
+    void releaseAgents();
+    void simulateContinuum(double dt);
+    void interactContinuumWithEnv(double dt);
+
+    HybridPopulationParameters params;
+
+    // Bacteria per grid cell, interior dimensions of the environment (y, x)
+    array continuum;
+    array laplacian;
+    dim_t ny;
+    dim_t nx;
+    std::vector<unsigned int> interactionLigandIds;
+
+    unique_ptr<H5::DataSet> continuumStorage;
+};
+
+
+#endif //BACTSIM_GPU_HYBRIDPOPULATION_H
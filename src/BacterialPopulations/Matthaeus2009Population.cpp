@@ -4,6 +4,7 @@
 
 #include "Matthaeus2009Population.h"
 #include "General/StorageHelper.h"
+#include "General/Profiler.h"
 #include <General/ArrayFireHelper.h>
 
 /**
@@ -44,19 +45,23 @@ void Matthaeus2009Population::setupStorage(H5::Group mystorage) {
     // Store type of ode solver
     storage->createAttribute("Solver", StorageHelper::H5VariableString, StorageHelper::H5Scalar)
             .write(StorageHelper::H5VariableString, this->odesolver->getType());
-    // Store additional required fields
-    swimmingStorage.reset(
-            new H5::DataSet(this->storage->createDataSet("swimming", H5::PredType::STD_I8LE, this->storageSpace, this->storageProperties)));
+    for(auto parameter: getScalarParameters())
+        storage->createAttribute(parameter.first, H5::PredType::IEEE_F64LE, StorageHelper::H5Scalar)
+                .write(HDF5_GPUTYPE, &(this->params.*parameter.second));
+    // Store additional required fields, swimming is part of the event log
+    if(!SimplePopulation::params.eventLog)
+        swimmingStorage.reset(
+                new H5::DataSet(this->storage->createDataSet("swimming", H5::PredType::STD_I8LE, this->storageSpace, this->storageProperties, this->storageAccess)));
     YpStorage.reset(
-            new H5::DataSet(this->storage->createDataSet("Yp", H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "Yp", this->storageSpace, this->storageProperties, this->storageAccess)));
     ApStorage.reset(
-            new H5::DataSet(this->storage->createDataSet("Ap", H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "Ap", this->storageSpace, this->storageProperties, this->storageAccess)));
     BpStorage.reset(
-            new H5::DataSet(this->storage->createDataSet("Bp", H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "Bp", this->storageSpace, this->storageProperties, this->storageAccess)));
     tauStorage.reset(
-            new H5::DataSet(this->storage->createDataSet("tau", H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "tau", this->storageSpace, this->storageProperties, this->storageAccess)));
     concentrationStorage.reset(
-            new H5::DataSet(this->storage->createDataSet("Concentrations", H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "Concentrations", this->storageSpace, this->storageProperties, this->storageAccess)));
 
     // Rezeptor methylation stages and activities
     for(auto i = 0; i < 5; i++) {
@@ -64,24 +69,34 @@ void Matthaeus2009Population::setupStorage(H5::Group mystorage) {
         TmStream << "Tm[" << i << "]";
         TmaStream << "Tma[" << i << "]";
         TmStorage[i].reset(
-                new H5::DataSet(this->storage->createDataSet(TmStream.str(), H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+                new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, TmStream.str(), this->storageSpace, this->storageProperties, this->storageAccess)));
         TmaStorage[i].reset(
-                new H5::DataSet(this->storage->createDataSet(TmaStream.str(), H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+                new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, TmaStream.str(), this->storageSpace, this->storageProperties, this->storageAccess)));
     }
+    writeFieldSteps();
 }
 
 bool Matthaeus2009Population::save() {
     if(SimplePopulation::save()) {
-        StorageHelper::appendDataToDataSet<char>(swimming, *swimmingStorage, H5::PredType::NATIVE_CHAR);
-        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(Ap, *ApStorage, HDF5_GPUTYPE);
-        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(Bp, *BpStorage, HDF5_GPUTYPE);
-        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(Yp, *YpStorage, HDF5_GPUTYPE);
-        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(tau, *tauStorage, HDF5_GPUTYPE);
-        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(sensedConcentration, *concentrationStorage, HDF5_GPUTYPE);
+        // Stored as real so it is packed together with all other fields of the save step
+        if(swimmingStorage && isFieldDue("swimming"))
+            appendPopulationData<GPU_REALTYPE>(swimming.as(AF_GPUTYPE), *swimmingStorage, HDF5_GPUTYPE);
+        if(isFieldDue("Ap"))
+            appendPopulationData<GPU_REALTYPE>(Ap, *ApStorage, HDF5_GPUTYPE);
+        if(isFieldDue("Bp"))
+            appendPopulationData<GPU_REALTYPE>(Bp, *BpStorage, HDF5_GPUTYPE);
+        if(isFieldDue("Yp"))
+            appendPopulationData<GPU_REALTYPE>(Yp, *YpStorage, HDF5_GPUTYPE);
+        if(isFieldDue("tau"))
+            appendPopulationData<GPU_REALTYPE>(tau, *tauStorage, HDF5_GPUTYPE);
+        if(isFieldDue("Concentrations"))
+            appendPopulationData<GPU_REALTYPE>(sensedConcentration, *concentrationStorage, HDF5_GPUTYPE);
 
         for(auto i = 0; i < 5; i++) {
-            StorageHelper::appendDataToDataSet<GPU_REALTYPE>(Tm[i], *TmStorage[i], HDF5_GPUTYPE);
-            StorageHelper::appendDataToDataSet<GPU_REALTYPE>(Tma[i], *TmaStorage[i], HDF5_GPUTYPE);
+            if(isFieldDue("Tm"))
+                appendPopulationData<GPU_REALTYPE>(Tm[i], *TmStorage[i], HDF5_GPUTYPE);
+            if(isFieldDue("Tma"))
+                appendPopulationData<GPU_REALTYPE>(Tma[i], *TmaStorage[i], HDF5_GPUTYPE);
         }
         return true;
     }
@@ -104,47 +119,58 @@ void Matthaeus2009Population::closeStorage() {
 Matthaeus2009Population::Matthaeus2009Population(shared_ptr<Environment> Env, H5::Group group) : SimplePopulation(Env,
                                                                                                                   group) {
     this->params = Matthaeus2009Parameters(SimplePopulation::params);
+    // Files written before these parameters were stored keep the defaults
+    for(auto parameter: getScalarParameters())
+        if(group.attrExists(parameter.first))
+            group.openAttribute(parameter.first).read(HDF5_GPUTYPE, &(this->params.*parameter.second));
     init();
     std::string solverName;
     group.openAttribute("Solver").read(StorageHelper::H5VariableString, solverName);
     this->odesolver = SolverFactory::createInstance(solverName);
 
-    H5::DataSet swimming = group.openDataSet("swimming");
-    this->swimming = StorageHelper::loadLastDataToGpu<char>(swimming, H5::PredType::NATIVE_CHAR, af::dtype::b8);
-    this->swimmingStorage.reset(new DataSet(swimming));
+    // All fields are read while the previous one is uploaded
+    StorageHelper::RestartReader reader;
+    if(SimplePopulation::params.eventLog) {
+        this->swimming = restoredMoving;
+    } else {
+        H5::DataSet swimming = group.openDataSet("swimming", this->storageAccess);
+        addPopulationData(reader, swimming, this->swimming, H5::PredType::NATIVE_CHAR, af::dtype::b8);
+        this->swimmingStorage.reset(new DataSet(swimming));
+    }
 
-    H5::DataSet Ap = group.openDataSet("Ap");
-    this->Ap = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(Ap, HDF5_GPUTYPE, AF_GPUTYPE);
+    H5::DataSet Ap = group.openDataSet("Ap", this->storageAccess);
+    addPopulationData(reader, Ap, this->Ap, HDF5_GPUTYPE, AF_GPUTYPE);
     this->ApStorage.reset(new DataSet(Ap));
 
-    H5::DataSet Bp = group.openDataSet("Bp");
-    this->Bp = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(Bp, HDF5_GPUTYPE, AF_GPUTYPE);
+    H5::DataSet Bp = group.openDataSet("Bp", this->storageAccess);
+    addPopulationData(reader, Bp, this->Bp, HDF5_GPUTYPE, AF_GPUTYPE);
     this->BpStorage.reset(new DataSet(Bp));
     
-    H5::DataSet Yp = group.openDataSet("Yp");
-    this->Yp = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(Yp, HDF5_GPUTYPE, AF_GPUTYPE);
+    H5::DataSet Yp = group.openDataSet("Yp", this->storageAccess);
+    addPopulationData(reader, Yp, this->Yp, HDF5_GPUTYPE, AF_GPUTYPE);
     this->YpStorage.reset(new DataSet(Yp));
 
-    H5::DataSet tau = group.openDataSet("tau");
-    this->tau = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(tau, HDF5_GPUTYPE, AF_GPUTYPE);
+    H5::DataSet tau = group.openDataSet("tau", this->storageAccess);
+    addPopulationData(reader, tau, this->tau, HDF5_GPUTYPE, AF_GPUTYPE);
     this->tauStorage.reset(new DataSet(tau));
 
-    H5::DataSet conc = group.openDataSet("Concentrations");
-    this->sensedConcentration = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(conc, HDF5_GPUTYPE, AF_GPUTYPE);
+    H5::DataSet conc = group.openDataSet("Concentrations", this->storageAccess);
+    addPopulationData(reader, conc, this->sensedConcentration, HDF5_GPUTYPE, AF_GPUTYPE);
     this->concentrationStorage.reset(new DataSet(conc));
 
     for(auto i = 0; i < 5; i++) {
         std::ostringstream TmStream, TmaStream;
         TmStream << "Tm[" << i << "]";
-        H5::DataSet tm = this->storage->openDataSet(TmStream.str());
-        Tm[i] = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(tm, HDF5_GPUTYPE, AF_GPUTYPE);
+        H5::DataSet tm = this->storage->openDataSet(TmStream.str(), this->storageAccess);
+        addPopulationData(reader, tm, Tm[i], HDF5_GPUTYPE, AF_GPUTYPE);
         TmStorage[i].reset(new DataSet(tm));
 
         TmaStream << "Tma[" << i << "]";
-        H5::DataSet tma = this->storage->openDataSet(TmaStream.str());
-        Tma[i] = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(tma, HDF5_GPUTYPE, AF_GPUTYPE);
+        H5::DataSet tma = this->storage->openDataSet(TmaStream.str(), this->storageAccess);
+        addPopulationData(reader, tma, Tma[i], HDF5_GPUTYPE, AF_GPUTYPE);
         TmaStorage[i].reset(new DataSet(tma));
     }
+    reader.load();
 }
 
 Matthaeus2009Population::Matthaeus2009Population(std::string name, shared_ptr<Environment> Env,
@@ -154,8 +180,82 @@ Matthaeus2009Population::Matthaeus2009Population(std::string name, shared_ptr<En
     init();
 };
 
+Matthaeus2009Population::Matthaeus2009Population(shared_ptr<Environment> Env, const Checkpoint &checkpoint,
+                                                 std::string prefix) : SimplePopulation(Env, checkpoint, prefix) {
+    this->params = Matthaeus2009Parameters(SimplePopulation::params);
+    std::string parameterPrefix = prefix + "Parameters/";
+    for(auto parameter: getAllScalarParameters())
+        this->params.*parameter.second = checkpoint.getValue(parameterPrefix + parameter.first);
+    this->params.rezeptorMethylationLevels = (unsigned int)checkpoint.getValue(parameterPrefix + "rezeptorMethylationLevels");
+    std::vector<double> T_Km = checkpoint.getValues(parameterPrefix + "T_Km");
+    std::vector<double> T_V = checkpoint.getValues(parameterPrefix + "T_V");
+    std::vector<double> T = checkpoint.getValues(parameterPrefix + "T");
+    this->params.T_Km.assign(T_Km.begin(), T_Km.end());
+    this->params.T_V.assign(T_V.begin(), T_V.end());
+    this->params.T.assign(T.begin(), T.end());
+    this->odesolver = SolverFactory::createInstance(checkpoint.getString(parameterPrefix + "Solver"));
+    this->params.odesolver = this->odesolver;
+    init();
+    // The arrays of SimplePopulation were restored by its constructor
+    restoreArrays(checkpoint, prefix, getCheckpointArrays(), SimplePopulation::getCheckpointArrays().size());
+}
+
+void Matthaeus2009Population::writeCheckpoint(Checkpoint &checkpoint, std::string prefix) {
+    SimplePopulation::writeCheckpoint(checkpoint, prefix);
+    std::string parameterPrefix = prefix + "Parameters/";
+    for(auto parameter: getAllScalarParameters())
+        checkpoint.setValue(parameterPrefix + parameter.first, this->params.*parameter.second);
+    checkpoint.setValue(parameterPrefix + "rezeptorMethylationLevels", this->params.rezeptorMethylationLevels);
+    checkpoint.setValues(parameterPrefix + "T_Km", std::vector<double>(params.T_Km.begin(), params.T_Km.end()));
+    checkpoint.setValues(parameterPrefix + "T_V", std::vector<double>(params.T_V.begin(), params.T_V.end()));
+    checkpoint.setValues(parameterPrefix + "T", std::vector<double>(params.T.begin(), params.T.end()));
+    checkpoint.setString(parameterPrefix + "Solver", this->odesolver->getType());
+}
+
+std::vector<std::pair<std::string, array *>> Matthaeus2009Population::getCheckpointArrays() {
+    std::vector<std::pair<std::string, array *>> arrays = SimplePopulation::getCheckpointArrays();
+    arrays.insert(arrays.end(), {{"swimming", &swimming}, {"Ap", &Ap}, {"Bp", &Bp}, {"Yp", &Yp}, {"tau", &tau},
+                                 {"Ta", &Ta}, {"Tt", &Tt}, {"Ttdivider", &Ttdivider}, {"Tadivider", &Tadivider}});
+    for(int i = 0; i < 5; i++) {
+        arrays.push_back(std::make_pair("Tm[" + std::to_string(i) + "]", &Tm[i]));
+        arrays.push_back(std::make_pair("Tma[" + std::to_string(i) + "]", &Tma[i]));
+    }
+    return arrays;
+}
+
 REGISTER_DEF_TYPE(Matthaeus2009Population)
 
+std::vector<std::pair<std::string, GPU_REALTYPE Matthaeus2009Parameters::*>> Matthaeus2009Population::getScalarParameters() {
+    return {
+            {"T_H", &Matthaeus2009Parameters::T_H},
+            {"K_R", &Matthaeus2009Parameters::K_R},
+            {"K_B", &Matthaeus2009Parameters::K_B},
+            {"K_C", &Matthaeus2009Parameters::K_C},
+            {"H_c", &Matthaeus2009Parameters::H_c},
+            {"pwDivider", &Matthaeus2009Parameters::pwDivider},
+            {"Merge Yp resolution", &Matthaeus2009Parameters::mergeYpResolution}
+    };
+}
+
+std::vector<std::pair<std::string, GPU_REALTYPE Matthaeus2009Parameters::*>> Matthaeus2009Population::getAllScalarParameters() {
+    return {
+            {"Tt", &Matthaeus2009Parameters::Tt}, {"T_H", &Matthaeus2009Parameters::T_H},
+            {"beta", &Matthaeus2009Parameters::beta}, {"Rt_lower", &Matthaeus2009Parameters::Rt_lower},
+            {"Rt_upper", &Matthaeus2009Parameters::Rt_upper}, {"K_R", &Matthaeus2009Parameters::K_R},
+            {"K_B", &Matthaeus2009Parameters::K_B}, {"K_C", &Matthaeus2009Parameters::K_C},
+            {"H_c", &Matthaeus2009Parameters::H_c}, {"A_t", &Matthaeus2009Parameters::A_t},
+            {"Ap", &Matthaeus2009Parameters::Ap}, {"B_t", &Matthaeus2009Parameters::B_t},
+            {"Bp", &Matthaeus2009Parameters::Bp}, {"R_t", &Matthaeus2009Parameters::R_t},
+            {"Y_t", &Matthaeus2009Parameters::Y_t}, {"Yp", &Matthaeus2009Parameters::Yp},
+            {"Z_t", &Matthaeus2009Parameters::Z_t}, {"pwDivider", &Matthaeus2009Parameters::pwDivider},
+            {"mergeYpResolution", &Matthaeus2009Parameters::mergeYpResolution}, {"k_R", &Matthaeus2009Parameters::k_R},
+            {"k_B", &Matthaeus2009Parameters::k_B}, {"kp_B", &Matthaeus2009Parameters::kp_B},
+            {"k_A", &Matthaeus2009Parameters::k_A}, {"k_Y", &Matthaeus2009Parameters::k_Y},
+            {"k_Z", &Matthaeus2009Parameters::k_Z}, {"g_B", &Matthaeus2009Parameters::g_B},
+            {"g_Y", &Matthaeus2009Parameters::g_Y}
+    };
+}
+
 void Matthaeus2009Population::liveTimestep(double dt) {
     // Simulation
     senseLigandConcentration();
@@ -165,11 +265,31 @@ void Matthaeus2009Population::liveTimestep(double dt) {
 //    af_print(Yp);
     // Movement
     updateSwimming(dt);
+    if(logsEvents())
+        logEvents(dt);
     move(dt);
     validatePositions();
     updateInterpolatedPositions();
     if(spaciallyLimitedEnv)
         setBorderBacteriaTumbling();
+    if(usesActiveMask())
+        updatePopulationDynamics(dt);
+}
+
+array Matthaeus2009Population::getStateKey() {
+    // Additionally distinguish running from tumbling bacteria and the CheY-P level driving the tumble rate
+    array YpBin = min(af::floor(Yp/params.mergeYpResolution), 255.0).as(af::dtype::u32);
+    return SimplePopulation::getStateKey() + params.mergeAngleBins*(swimming.as(af::dtype::u32) + 2*YpBin);
+}
+
+std::vector<array *> Matthaeus2009Population::getPerBacteriumArrays() {
+    std::vector<array *> arrays = SimplePopulation::getPerBacteriumArrays();
+    arrays.insert(arrays.end(), {&swimming, &Ap, &Bp, &Yp, &tau});
+    for(int i = 0; i < 5; i++) {
+        arrays.push_back(&Tm[i]);
+        arrays.push_back(&Tma[i]);
+    }
+    return arrays;
 }
 
 void Matthaeus2009Population::updateSwimming(double dt) {
@@ -184,6 +304,7 @@ void Matthaeus2009Population::updateSwimming(double dt) {
 
     // Update swimming
     swimming = !subset*swimming + subset*newswimming;
+    Profiler::countEvaluations(2);
     eval(tau, angle);
     eval(swimming);
 }
@@ -191,6 +312,7 @@ void Matthaeus2009Population::updateSwimming(double dt) {
 void Matthaeus2009Population::move(double dt) {
     xpos += swimming*cos(angle)*params.swimmSpeed*dt;
     ypos += swimming*sin(angle)*params.swimmSpeed*dt;
+    Profiler::countEvaluations();
     eval(xpos,ypos);
 }
 
@@ -204,6 +326,7 @@ void Matthaeus2009Population::updateTotalConc() {
     }
     Tt = T_tot;
     Ta = T_a;
+    Profiler::countEvaluations();
     eval(Tt, T_a);
 }
 
@@ -219,6 +342,7 @@ void Matthaeus2009Population::integrateEquations(double dt) {
 void Matthaeus2009Population::calculateDividers() {
     Ttdivider = 1/(params.K_R + Tt);
     Tadivider = 1/(params.K_B + Ta);
+    Profiler::countEvaluations();
     eval(Ttdivider, Tadivider);
 }
 
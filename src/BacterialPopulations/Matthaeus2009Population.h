@@ -14,14 +14,11 @@ struct Matthaeus2009Parameters : SimplePopulationParameters {
     Matthaeus2009Parameters() : SimplePopulationParameters() {};
     Matthaeus2009Parameters(shared_ptr<Solver> odesolver, std::vector<LigandInteraction> interactions, GPU_REALTYPE swimmSpeed):
             SimplePopulationParameters(interactions, swimmSpeed), odesolver(odesolver) {};
-    Matthaeus2009Parameters(SimplePopulationParameters paramsBase) {
-        interactions = paramsBase.interactions;
-        swimmSpeed = paramsBase.swimmSpeed;
-    }
+    Matthaeus2009Parameters(SimplePopulationParameters paramsBase) : SimplePopulationParameters(paramsBase) {}
 
     shared_ptr<Solver> odesolver;
 
-    // Warning, these following parameters are not actually saved
+    // Warning, only the scalar signalling parameters listed in getScalarParameters are saved
     unsigned int rezeptorMethylationLevels = 5;
 
     // Methylation dependent parameters
@@ -62,6 +59,9 @@ struct Matthaeus2009Parameters : SimplePopulationParameters {
 
     GPU_REALTYPE pwDivider = (0.2 * 1.53);
 
+    // Resolution of CheY-P levels distinguished when merging super individuals
+    GPU_REALTYPE mergeYpResolution = 0.1; // uM
+
     // Rate constants
     GPU_REALTYPE k_R = 0.39; // 1/s
     GPU_REALTYPE k_B = 6.3; // 1/s
@@ -82,21 +82,35 @@ public:
     }
 
     Matthaeus2009Population(shared_ptr<Environment> Env, H5::Group group);
+    Matthaeus2009Population(shared_ptr<Environment> Env, const Checkpoint &checkpoint, std::string prefix);
 
     // Simulation
     void liveTimestep(double dt) override;
     virtual double getStabledt() override {return params.integrationMultiplyer*0.002; };
     void printInternals() override;
+    array getSwimming() { return swimming; }
+    array getTau() { return tau; }
 
     // Storage
+    using SimplePopulation::setupStorage;
     void setupStorage(H5::Group storage) override;
     bool save() override;
     void closeStorage() override;
+    void writeCheckpoint(Checkpoint &checkpoint, std::string prefix) override;
+
+    // Scalar parameters stored as attributes of the population group, e.g. to be varied by a parameter sweep
+    static std::vector<std::pair<std::string, GPU_REALTYPE Matthaeus2009Parameters::*>> getScalarParameters();
+    // All scalar parameters, stored in checkpoints
+    static std::vector<std::pair<std::string, GPU_REALTYPE Matthaeus2009Parameters::*>> getAllScalarParameters();
 
     REGISTER_DEC_TYPE(Matthaeus2009Population);
 protected:
     // Initialization
     void init();
+    std::vector<array *> getPerBacteriumArrays() override;
+    std::vector<std::pair<std::string, array *>> getCheckpointArrays() override;
+    array getStateKey() override;
+    array getMoving() override { return swimming; }
 
     // Simulation
 
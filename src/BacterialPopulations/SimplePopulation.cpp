@@ -4,6 +4,9 @@
 
 #include "SimplePopulation.h"
 #include "General/StorageHelper.h"
+#include "General/SyncCounter.h"
+#include "General/Profiler.h"
+#include "General/EventLog.h"
 
 SimplePopulation::SimplePopulation(std::string name, shared_ptr<Environment> env, SimplePopulationParameters params) : BacterialPopulation(params), env(env), params(params) {
     this->name = name;
@@ -25,6 +28,7 @@ void SimplePopulation::init() {
     }
 
     ligandmapping = env->getLigandMapping(ligandIds);
+    replicas = env->getReplicas();
     std::vector<double> size = env->getSize();
     maxx = size[0];
     maxy = size[1];
@@ -68,15 +72,31 @@ void SimplePopulation::interactWithEnv(array individuals, double dt) {
 void SimplePopulation::interactWithEnvPos(array pos, array w, int individual, double dt) {
     array ligconcentrations = env->getLigandConcentrations(pos, w, ligandmapping);
     array concentrationChange = modelUptakeProductionRate(ligconcentrations);
+    if(usesActiveMask()) {
+        // Dead bacteria do not interact, living ones grow proportional to their uptake
+        concentrationChange *= tile(active(individual), 1, concentrationChange.dims(1));
+        biomass(individual) += params.growthYield*dt*sum(max(-concentrationChange, 0.0), 1);
+    }
     concentrations(individual, span) = ligconcentrations+concentrationChange*dt;
-    env->changeLigandConcentrationBy(concentrationChange, pos, w, ligandmapping);
+    if(params.superIndividuals)
+        env->changeLigandConcentrationBy(concentrationChange, pos, w, ligandmapping, weight(individual));
+    else
+        env->changeLigandConcentrationBy(concentrationChange, pos, w, ligandmapping);
 }
 
 void SimplePopulation::interactWithEnvPos(array pos, array w, array individuals, double dt) {
     array ligconcentrations = env->getLigandConcentrations(pos, w, ligandmapping);
     array concentrationChange = modelUptakeProductionRate(ligconcentrations);
+    if(usesActiveMask()) {
+        // Dead bacteria do not interact, living ones grow proportional to their uptake
+        concentrationChange *= tile(active(individuals), 1, concentrationChange.dims(1));
+        biomass(individuals) += params.growthYield*dt*sum(max(-concentrationChange, 0.0), 1);
+    }
     concentrations(individuals, span) = ligconcentrations+concentrationChange*dt;
-    env->changeLigandConcentrationBy(concentrationChange, pos, w, ligandmapping);
+    if(params.superIndividuals)
+        env->changeLigandConcentrationBy(concentrationChange, pos, w, ligandmapping, weight(individuals));
+    else
+        env->changeLigandConcentrationBy(concentrationChange, pos, w, ligandmapping);
 }
 
 void SimplePopulation::applyPeriodicBoundary(double maxx, double maxy, array &xpos, array &ypos) {
@@ -85,6 +105,7 @@ void SimplePopulation::applyPeriodicBoundary(double maxx, double maxy, array &xp
     // y axis
     ypos += (ypos > maxy) * -ypos + (ypos < 0) * (-ypos + maxy);
 
+    Profiler::countEvaluations();
     eval(xpos, ypos);
 }
 
@@ -108,6 +129,7 @@ void SimplePopulation::applySolidBoundary(double maxx, double maxy, array &xpos,
 
     // Mark bacteria as at border
     atborder =  max(outofrange, 1);
+    Profiler::countEvaluations(2);
     eval(xpos, ypos);
     eval(atborder);
 }
@@ -115,9 +137,13 @@ void SimplePopulation::applySolidBoundary(double maxx, double maxy, array &xpos,
 void SimplePopulation::liveTimestep(double dt) {
     senseLigandConcentration();
     simulate(dt);
+    if(logsEvents())
+        logEvents(dt);
     move(dt);
     validatePositions();
     updateInterpolatedPositions();
+    if(usesActiveMask())
+        updatePopulationDynamics(dt);
 }
 
 void SimplePopulation::simulate(double dt) {
@@ -125,7 +151,10 @@ void SimplePopulation::simulate(double dt) {
 }
 
 void SimplePopulation::updateInterpolatedPositions() {
-    env->setInterpolatedPositions(xpos, ypos, interpolatedPositions, weights);
+    if(replicas > 1)
+        env->setInterpolatedPositions(xpos, ypos, interpolatedPositions, weights, replica);
+    else
+        env->setInterpolatedPositions(xpos, ypos, interpolatedPositions, weights);
 }
 
 void SimplePopulation::move(double dt) {
@@ -147,41 +176,335 @@ void SimplePopulation::setupStorage(H5::Group storage) {
     H5::Attribute interactions = this->storage->createAttribute("Ligand interactions", interType, interSpace);
     interactions.write(interType, this->params.interactions.data());
 
+    // Bacteria of all replicas are stored together, statically sized populations in consecutive blocks per replica
+    if(replicas > 1)
+        this->storage->createAttribute("Replicas", H5::PredType::STD_U32LE, StorageHelper::H5Scalar)
+                .write(H5::PredType::NATIVE_UINT, &replicas);
+
     // Initialize DataSets for bacterial parameters
-    hsize_t bactCount = this->size;
-    hsize_t initDims[2] = {0, bactCount};
-    hsize_t maxDims[2] = {H5S_UNLIMITED, bactCount};
-    H5::DataSpace bactSpace(2, initDims, maxDims);
-    this->storageSpace = bactSpace;
-    H5::DSetCreatPropList properties(H5::DSetCreatPropList::DEFAULT);
-    hsize_t chunk_dims[2] = {4, bactCount};
-    properties.setChunk(2, chunk_dims);
-    this->storageProperties = properties;
+    if(isTracking()) {
+        if(usesActiveMask())
+            throw exception("A tracked subset requires a population without population dynamics and super individuals");
+        for(auto slot: output.tracked)
+            if(slot >= (unsigned int)this->size)
+                throw exception("Tracked bacterium exceeds the population");
+        trackedIndex = array(output.tracked.size(), output.tracked.data());
+        hsize_t trackedCount = output.tracked.size();
+        this->storage->createDataSet("Tracked", H5::PredType::STD_U32LE, H5::DataSpace(1, &trackedCount))
+                .write(output.tracked.data(), H5::PredType::NATIVE_UINT);
+    } else
+        trackedIndex = array();
+    // Frame offsets, ids and weights of dynamic populations are stored every save, the ragged rows of a field
+    // skipped in a save would no longer match them
+    if(usesActiveMask())
+        for(auto &step: output.steps)
+            if(step.second > 1)
+                throw exception("Field steps require a population without population dynamics and super individuals");
+    saveCalls = 0;
+
+    if(usesActiveMask()) {
+        setupDynamicStorage();
+    } else {
+        // Only the tracked subset is stored in the per bacterium datasets
+        hsize_t bactCount = isTracking() ? output.tracked.size() : this->size;
+        hsize_t initDims[2] = {0, bactCount};
+        hsize_t maxDims[2] = {H5S_UNLIMITED, bactCount};
+        H5::DataSpace bactSpace(2, initDims, maxDims);
+        this->storageSpace = bactSpace;
+        this->storageProperties = StorageHelper::createPopulationProperties(bactCount);
+        this->storageAccess = StorageHelper::createPopulationAccess(this->storageProperties, bactCount);
+    }
+
+    // Positions and directions of event logging populations are only stored as events
+    if(params.eventLog) {
+        setupEventStorage();
+        return;
+    }
 
     // Store as 64 bit double independent of architecture
     this->xposStorage.reset(
-            new H5::DataSet(this->storage->createDataSet("xpos", H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "xpos", this->storageSpace, this->storageProperties, this->storageAccess)));
     this->yposStorage.reset(
-            new H5::DataSet(this->storage->createDataSet("ypos", H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "ypos", this->storageSpace, this->storageProperties, this->storageAccess)));
     this->angleStorage.reset(
-            new H5::DataSet(this->storage->createDataSet("angle", H5::PredType::IEEE_F64LE, this->storageSpace, this->storageProperties)));
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "angle", this->storageSpace, this->storageProperties, this->storageAccess)));
+    if(isTracking() && output.snapshotStep > 0)
+        setupSnapshotStorage();
+    writeFieldSteps();
+}
+
+void SimplePopulation::setupStorage(H5::Group storage, PopulationOutput output) {
+    setOutput(output);
+    setupStorage(storage);
+}
+
+void SimplePopulation::setupSnapshotStorage() {
+    // Snapshots cover all bacteria, they are chunked like the datasets of a population without a tracked subset
+    H5::Group snapshots = this->storage->createGroup("Snapshots");
+    snapshots.createAttribute("Step", H5::PredType::STD_U32LE, StorageHelper::H5Scalar)
+            .write(H5::PredType::NATIVE_UINT, &output.snapshotStep);
+    hsize_t bactCount = this->size;
+    hsize_t initDims[2] = {0, bactCount};
+    hsize_t maxDims[2] = {H5S_UNLIMITED, bactCount};
+    H5::DataSpace space(2, initDims, maxDims);
+    H5::DSetCreatPropList properties = StorageHelper::createPopulationProperties(bactCount);
+    H5::DSetAccPropList access = StorageHelper::createPopulationAccess(properties, bactCount);
+    snapshotXposStorage.reset(new H5::DataSet(StorageHelper::createRealDataSet(snapshots, "xpos", space, properties, access)));
+    snapshotYposStorage.reset(new H5::DataSet(StorageHelper::createRealDataSet(snapshots, "ypos", space, properties, access)));
+    snapshotAngleStorage.reset(new H5::DataSet(StorageHelper::createRealDataSet(snapshots, "angle", space, properties, access)));
+}
+
+void SimplePopulation::writeFieldSteps() {
+    for(hsize_t i = 0; i < this->storage->getNumObjs(); i++) {
+        if(this->storage->childObjType(i) != H5O_TYPE_DATASET)
+            continue;
+        std::string name = this->storage->getObjnameByIdx(i);
+        auto step = output.steps.find(name);
+        if(step == output.steps.end())
+            step = output.steps.find(name.substr(0, name.find('[')));
+        if(step == output.steps.end() || step->second <= 1)
+            continue;
+        H5::DataSet field = this->storage->openDataSet(name);
+        if(!field.attrExists("Step"))
+            field.createAttribute("Step", H5::PredType::STD_U32LE, StorageHelper::H5Scalar)
+                    .write(H5::PredType::NATIVE_UINT, &step->second);
+    }
+}
+
+bool SimplePopulation::isFieldDue(std::string name) {
+    auto step = output.steps.find(name);
+    // Fields of all methylation levels share the step of their base name, e.g. "Tm" for "Tm[0]"
+    if(step == output.steps.end())
+        step = output.steps.find(name.substr(0, name.find('[')));
+    return step == output.steps.end() || currentSave % std::max(step->second, 1u) == 0;
+}
+
+void SimplePopulation::setupDynamicStorage() {
+    // The number of bacteria changes between frames, store all frames back to back in one dimensional datasets
+    // and keep the first row of every frame in a separate offset dataset
+    H5::DataSpace scalar(H5S_SCALAR);
+    int dynamic = this->params.dynamicPopulation;
+    this->storage->createAttribute("Dynamic population", H5::PredType::STD_I32LE, scalar).write(H5::PredType::NATIVE_INT, &dynamic);
+    this->storage->createAttribute("Initial biomass", H5::PredType::IEEE_F64LE, scalar).write(HDF5_GPUTYPE, &this->params.initialBiomass);
+    this->storage->createAttribute("Growth yield", H5::PredType::IEEE_F64LE, scalar).write(HDF5_GPUTYPE, &this->params.growthYield);
+    this->storage->createAttribute("Maintenance rate", H5::PredType::IEEE_F64LE, scalar).write(HDF5_GPUTYPE, &this->params.maintenanceRate);
+    this->storage->createAttribute("Division threshold", H5::PredType::IEEE_F64LE, scalar).write(HDF5_GPUTYPE, &this->params.divisionThreshold);
+    this->storage->createAttribute("Death threshold", H5::PredType::IEEE_F64LE, scalar).write(HDF5_GPUTYPE, &this->params.deathThreshold);
+    this->storage->createAttribute("Compaction threshold", H5::PredType::IEEE_F64LE, scalar).write(HDF5_GPUTYPE, &this->params.compactionThreshold);
+
+    int superIndividuals = this->params.superIndividuals;
+    this->storage->createAttribute("Super individuals", H5::PredType::STD_I32LE, scalar).write(H5::PredType::NATIVE_INT, &superIndividuals);
+    this->storage->createAttribute("Initial weight", H5::PredType::IEEE_F64LE, scalar).write(HDF5_GPUTYPE, &this->params.initialWeight);
+    this->storage->createAttribute("Minimum weight", H5::PredType::IEEE_F64LE, scalar).write(HDF5_GPUTYPE, &this->params.minimumWeight);
+    this->storage->createAttribute("Split gradient", H5::PredType::IEEE_F64LE, scalar).write(HDF5_GPUTYPE, &this->params.splitGradient);
+    this->storage->createAttribute("Merge angle bins", H5::PredType::STD_U32LE, scalar).write(H5::PredType::NATIVE_UINT, &this->params.mergeAngleBins);
+    this->storage->createAttribute("Adaptation interval", H5::PredType::STD_U32LE, scalar).write(H5::PredType::NATIVE_UINT, &this->params.adaptationInterval);
+
+    hsize_t initDims = 0;
+    hsize_t maxDims = H5S_UNLIMITED;
+    this->storageSpace = H5::DataSpace(1, &initDims, &maxDims);
+    this->storageProperties = StorageHelper::createRaggedProperties(static_cast<hsize_t>(this->used));
+
+    H5::DSetCreatPropList offsetProperties(H5::DSetCreatPropList::DEFAULT);
+    hsize_t offsetChunk = 64;
+    offsetProperties.setChunk(1, &offsetChunk);
+    this->frameOffsetStorage.reset(
+            new H5::DataSet(this->storage->createDataSet("Frame offsets", H5::PredType::STD_U64LE, this->storageSpace, offsetProperties)));
+    this->idStorage.reset(
+            new H5::DataSet(this->storage->createDataSet("id", H5::PredType::STD_U32LE, this->storageSpace, this->storageProperties, this->storageAccess)));
+    this->biomassStorage.reset(
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "biomass", this->storageSpace, this->storageProperties, this->storageAccess)));
+    this->weightStorage.reset(
+            new H5::DataSet(StorageHelper::createRealDataSet(*this->storage, "weight", this->storageSpace, this->storageProperties, this->storageAccess)));
+    if(replicas > 1)
+        this->replicaStorage.reset(
+                new H5::DataSet(this->storage->createDataSet("replica", H5::PredType::STD_U32LE, this->storageSpace, this->storageProperties, this->storageAccess)));
+    this->savedOffset = 0;
 }
 
 bool SimplePopulation::save() {
     if (!this->storage)
         return false;
+    currentSave = saveCalls++;
+
+    if(usesActiveMask()) {
+        // Only living bacteria are written, record where this frame starts
+        savedIndex = where(active);
+        SyncCounter::record("SimplePopulation::save");
+        StorageHelper::appendValueToDataSet<hsize_t>(savedOffset, *frameOffsetStorage, H5::PredType::NATIVE_HSIZE);
+        savedOffset += savedIndex.elements();
+        appendPopulationData<unsigned int>(ids, *idStorage, H5::PredType::NATIVE_UINT);
+        appendPopulationData<GPU_REALTYPE>(biomass, *biomassStorage, HDF5_GPUTYPE);
+        appendPopulationData<GPU_REALTYPE>(weight, *weightStorage, HDF5_GPUTYPE);
+        if(replicaStorage)
+            appendPopulationData<unsigned int>(replica, *replicaStorage, H5::PredType::NATIVE_UINT);
+        // Ids of bacteria that died before the save must not be handed out again after a restart
+        H5::Group *group = this->storage.get();
+        unsigned int next = nextId;
+        StorageHelper::submitTask([group, next]() {
+            H5::Attribute attribute = group->attrExists("Next id") ? group->openAttribute("Next id") :
+                    group->createAttribute("Next id", H5::PredType::STD_U32LE, StorageHelper::H5Scalar);
+            attribute.write(H5::PredType::NATIVE_UINT, &next);
+        });
+    }
+
+    if(logsEvents()) {
+        flushEvents();
+        StorageHelper::appendValueToDataSet<unsigned long long>(eventStep, *saveStepStorage, H5::PredType::NATIVE_ULLONG);
+        StorageHelper::appendValueToDataSet<unsigned long long>(eventsStored, *saveOffsetStorage, H5::PredType::NATIVE_ULLONG);
+        return true;
+    }
 
-    StorageHelper::appendDataToDataSet<GPU_REALTYPE>(xpos, *xposStorage, HDF5_GPUTYPE);
-    StorageHelper::appendDataToDataSet<GPU_REALTYPE>(ypos, *yposStorage, HDF5_GPUTYPE);
-    StorageHelper::appendDataToDataSet<GPU_REALTYPE>(angle, *angleStorage, HDF5_GPUTYPE);
+    if(isFieldDue("xpos"))
+        appendPopulationData<GPU_REALTYPE>(xpos, *xposStorage, HDF5_GPUTYPE);
+    if(isFieldDue("ypos"))
+        appendPopulationData<GPU_REALTYPE>(ypos, *yposStorage, HDF5_GPUTYPE);
+    if(isFieldDue("angle"))
+        appendPopulationData<GPU_REALTYPE>(angle, *angleStorage, HDF5_GPUTYPE);
+    if(snapshotXposStorage && currentSave % output.snapshotStep == 0) {
+        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(xpos, *snapshotXposStorage, HDF5_GPUTYPE);
+        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(ypos, *snapshotYposStorage, HDF5_GPUTYPE);
+        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(angle, *snapshotAngleStorage, HDF5_GPUTYPE);
+    }
     return true;
 }
 
+void SimplePopulation::setupEventStorage() {
+    // Slots are identified with bacteria, dynamic populations reuse and compact them
+    if(usesActiveMask())
+        throw exception("Event logs require a population without population dynamics and super individuals");
+    H5::Group events = this->storage->createGroup("Events");
+    unsigned int bacteria = size;
+    events.createAttribute("Bacteria", H5::PredType::STD_U32LE, StorageHelper::H5Scalar)
+            .write(H5::PredType::NATIVE_UINT, &bacteria);
+    events.createAttribute("Tolerance", H5::PredType::IEEE_F64LE, StorageHelper::H5Scalar)
+            .write(HDF5_GPUTYPE, &params.eventTolerance);
+
+    hsize_t initDims = 0;
+    hsize_t maxDims = H5S_UNLIMITED;
+    H5::DataSpace space(1, &initDims, &maxDims);
+    H5::DSetCreatPropList properties = StorageHelper::createRaggedProperties(static_cast<hsize_t>(size));
+    events.createDataSet("id", H5::PredType::STD_U32LE, space, properties);
+    events.createDataSet("step", H5::PredType::STD_U32LE, space, properties);
+    for(std::string name: {"xpos", "ypos", "angle"})
+        StorageHelper::createRealDataSet(events, name, space, properties);
+    events.createDataSet("moving", H5::PredType::STD_I8LE, space, properties);
+
+    H5::DSetCreatPropList saveProperties(H5::DSetCreatPropList::DEFAULT);
+    hsize_t saveChunk = 64;
+    saveProperties.setChunk(1, &saveChunk);
+    events.createDataSet("Save steps", H5::PredType::STD_U64LE, space, saveProperties);
+    events.createDataSet("Save offsets", H5::PredType::STD_U64LE, space, saveProperties);
+
+    openEventStorage(events);
+    eventStep = 0;
+    eventsStored = 0;
+    initializeEventLog();
+}
+
+void SimplePopulation::openEventStorage(H5::Group events) {
+    eventFieldStorage.clear();
+    for(std::string name: {"id", "step", "xpos", "ypos", "angle", "moving"})
+        eventFieldStorage.push_back(unique_ptr<H5::DataSet>(new H5::DataSet(events.openDataSet(name))));
+    saveStepStorage.reset(new H5::DataSet(events.openDataSet("Save steps")));
+    saveOffsetStorage.reset(new H5::DataSet(events.openDataSet("Save offsets")));
+    eventStorage.reset(new H5::Group(events));
+}
+
+void SimplePopulation::initializeEventLog() {
+    // Every bacterium starts with an event, the buffer holds eventBufferSteps timesteps of events and a spare row
+    dim_t capacity = (dim_t)size*std::max(params.eventBufferSteps, 1u);
+    eventIds = constant(0, capacity + 1, af::dtype::u32);
+    eventSteps = constant(0, capacity + 1, af::dtype::u32);
+    eventValues = constant(0, capacity + 1, 4, AF_GPUTYPE);
+    eventCount = constant(0, 1, af::dtype::u32);
+    bufferedBound = 0;
+    loggedX = xpos;
+    loggedY = ypos;
+    loggedAngle = angle;
+    loggedMoving = getMoving();
+    loggedStep = constant(eventStep, size, af::dtype::u32);
+    logAll = true;
+}
+
+array SimplePopulation::getMoving() {
+    return constant(1, size, af::dtype::b8);
+}
+
+void SimplePopulation::logEvents(double dt) {
+    array moving = getMoving();
+    array changed;
+    if(logAll) {
+        changed = constant(1, size, af::dtype::b8);
+        logAll = false;
+    } else {
+        // Position on the straight line of the last event, bacteria deviate from it at boundaries
+        array distance = loggedMoving.as(AF_GPUTYPE)*(eventStep - loggedStep).as(AF_GPUTYPE)*(params.swimmSpeed*dt);
+        array deviation = max(abs(loggedX + distance*cos(loggedAngle) - xpos),
+                              abs(loggedY + distance*sin(loggedAngle) - ypos));
+        changed = moving != loggedMoving || angle != loggedAngle || deviation > params.eventTolerance;
+    }
+
+    // Stream compaction without downloading the number of events: events are scattered to consecutive rows behind
+    // the buffered ones, all other bacteria to the spare last row
+    dim_t capacity = eventIds.elements() - 1;
+    array flags = changed.as(af::dtype::u32);
+    array rows = select(changed, tile(eventCount, size) + accum(flags) - flags, (double)capacity).as(af::dtype::u32);
+    eventIds(rows) = ids;
+    eventSteps(rows) = constant(eventStep, size, af::dtype::u32);
+    eventValues(rows, 0) = xpos;
+    eventValues(rows, 1) = ypos;
+    eventValues(rows, 2) = angle;
+    eventValues(rows, 3) = moving.as(AF_GPUTYPE);
+    eventCount += sum(flags);
+
+    loggedX = select(changed, xpos, loggedX);
+    loggedY = select(changed, ypos, loggedY);
+    loggedAngle = select(changed, angle, loggedAngle);
+    loggedMoving = moving;
+    loggedStep = select(changed, constant(eventStep, size, af::dtype::u32), loggedStep);
+    Profiler::countEvaluations(2);
+    eval(eventIds, eventSteps, eventValues, eventCount);
+    eval(loggedX, loggedY, loggedAngle, loggedStep);
+
+    eventStep++;
+    bufferedBound += size;
+    if(bufferedBound + size > (size_t)capacity)
+        flushEvents();
+}
+
+void SimplePopulation::flushEvents() {
+    SyncCounter::record("SimplePopulation::flushEvents");
+    unsigned int count = eventCount.scalar<unsigned int>();
+    if(count) {
+        seq rows(count);
+        StorageHelper::appendRaggedDataToDataSet<unsigned int>(eventIds(rows), *eventFieldStorage[0], H5::PredType::NATIVE_UINT);
+        StorageHelper::appendRaggedDataToDataSet<unsigned int>(eventSteps(rows), *eventFieldStorage[1], H5::PredType::NATIVE_UINT);
+        for(int field = 0; field < 4; field++)
+            StorageHelper::appendRaggedDataToDataSet<GPU_REALTYPE>(eventValues(rows, field), *eventFieldStorage[2 + field], HDF5_GPUTYPE);
+    }
+    eventsStored += count;
+    eventCount = constant(0, 1, af::dtype::u32);
+    bufferedBound = 0;
+}
+
 void SimplePopulation::closeStorage() {
     // Call to reset also calls destructor
     this->xposStorage.reset();
     this->yposStorage.reset();
     this->angleStorage.reset();
+    this->snapshotXposStorage.reset();
+    this->snapshotYposStorage.reset();
+    this->snapshotAngleStorage.reset();
+    this->idStorage.reset();
+    this->biomassStorage.reset();
+    this->weightStorage.reset();
+    this->replicaStorage.reset();
+    this->frameOffsetStorage.reset();
+    this->eventFieldStorage.clear();
+    this->saveStepStorage.reset();
+    this->saveOffsetStorage.reset();
+    this->eventStorage.reset();
 
     // Finally close group
     this->storage.reset();
@@ -200,7 +523,10 @@ void SimplePopulation::setPositions(array x, array y) {
 
 SimplePopulation::SimplePopulation(std::string name, shared_ptr<Environment> Env, SimplePopulationParameters parameters,
                                      int nBacteria) : SimplePopulation(name, Env, parameters) {
-    size = nBacteria;
+    // nBacteria are placed into every replica
+    used = nBacteria*replicas;
+    // Dynamic populations start with slack so the first divisions do not reallocate
+    size = usesActiveMask() ? 2*used : used;
     initializeArrays();
     randomizeAngle();
 
@@ -217,10 +543,16 @@ SimplePopulation::SimplePopulation(std::string name, shared_ptr<Environment> Env
 SimplePopulation::SimplePopulation(std::string name, shared_ptr<Environment> Env, SimplePopulationParameters parameters,
                                      int nBacteria, GPU_REALTYPE *initialx, GPU_REALTYPE *initialy) :
         SimplePopulation(name, Env, parameters) {
-    size = nBacteria;
+    // Every replica starts from the same initial positions
+    used = nBacteria*replicas;
+    size = usesActiveMask() ? 2*used : used;
     initializeArrays();
     randomizeAngle();
-    setPositions(array(size, initialx), array(size, initialy));
+    array x = constant(0, size, AF_GPUTYPE);
+    array y = constant(0, size, AF_GPUTYPE);
+    x(seq(used)) = tile(array(nBacteria, initialx), replicas);
+    y(seq(used)) = tile(array(nBacteria, initialy), replicas);
+    setPositions(x, y);
     validatePositions();
     updateInterpolatedPositions();
     // Just get ligand concentrations
@@ -243,33 +575,250 @@ SimplePopulation::SimplePopulation(shared_ptr<Environment> Env, H5::Group group)
     parameters.interactions.resize(nInteractions);
     ligInteractions.read(LigandInteraction::getH5ReadType(), parameters.interactions.data());
 
+    // read population dynamics parameters, only present for dynamic populations
+    if(group.attrExists("Dynamic population")) {
+        int dynamic;
+        group.openAttribute("Dynamic population").read(H5::PredType::NATIVE_INT, &dynamic);
+        parameters.dynamicPopulation = dynamic != 0;
+        group.openAttribute("Initial biomass").read(HDF5_GPUTYPE, &parameters.initialBiomass);
+        group.openAttribute("Growth yield").read(HDF5_GPUTYPE, &parameters.growthYield);
+        group.openAttribute("Maintenance rate").read(HDF5_GPUTYPE, &parameters.maintenanceRate);
+        group.openAttribute("Division threshold").read(HDF5_GPUTYPE, &parameters.divisionThreshold);
+        group.openAttribute("Death threshold").read(HDF5_GPUTYPE, &parameters.deathThreshold);
+        group.openAttribute("Compaction threshold").read(HDF5_GPUTYPE, &parameters.compactionThreshold);
+
+        int superIndividuals;
+        group.openAttribute("Super individuals").read(H5::PredType::NATIVE_INT, &superIndividuals);
+        parameters.superIndividuals = superIndividuals != 0;
+        group.openAttribute("Initial weight").read(HDF5_GPUTYPE, &parameters.initialWeight);
+        group.openAttribute("Minimum weight").read(HDF5_GPUTYPE, &parameters.minimumWeight);
+        group.openAttribute("Split gradient").read(HDF5_GPUTYPE, &parameters.splitGradient);
+        group.openAttribute("Merge angle bins").read(H5::PredType::NATIVE_UINT, &parameters.mergeAngleBins);
+        group.openAttribute("Adaptation interval").read(H5::PredType::NATIVE_UINT, &parameters.adaptationInterval);
+    }
+
     this->env = Env;
     this->params = parameters;
 
+    // The state of untracked bacteria is not stored
+    if(group.nameExists("Tracked"))
+        throw exception("Populations with a tracked subset can only be continued from a checkpoint");
+    // Fields with a step end in different saves, their last frames do not describe one state
+    for(hsize_t i = 0; i < group.getNumObjs(); i++)
+        if(group.childObjType(i) == H5O_TYPE_DATASET && group.openDataSet(group.getObjnameByIdx(i)).attrExists("Step"))
+            throw exception("Populations with field steps can only be continued from a checkpoint");
+
+    if(group.nameExists("Events")) {
+        restoreFromEvents(group);
+        return;
+    }
+
     H5::DataSet xpos = group.openDataSet("xpos");
-    hsize_t bactDims[2];
-    xpos.getSpace().getSimpleExtentDims(bactDims);
-    this->size = bactDims[1];
+    if(usesActiveMask()) {
+        H5::DataSet offsets = group.openDataSet("Frame offsets");
+        this->frameOffsetStorage.reset(new DataSet(offsets));
+        xpos.getSpace().getSimpleExtentDims(&this->savedOffset);
+        this->saveCalls = StorageHelper::getFrameCount(offsets);
+        // Size of the last frame
+        this->size = loadPopulationData<unsigned int>(group.openDataSet("id"), H5::PredType::NATIVE_UINT, af::dtype::u32).elements();
+    } else {
+        hsize_t bactDims[2];
+        xpos.getSpace().getSimpleExtentDims(bactDims);
+        this->size = bactDims[1];
+        this->saveCalls = bactDims[0];
+        // Reopen with a chunk cache matching the tile shape of the file, sized for doubles as the fields share it
+        this->storageAccess = StorageHelper::createPopulationAccess(xpos.getCreatePlist(), this->size);
+        xpos = group.openDataSet("xpos", this->storageAccess);
+    }
+    this->used = this->size;
     this->init();
     initializeArrays();
 
-    this->xpos = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(xpos, HDF5_GPUTYPE, AF_GPUTYPE);
+    // All fields are read while the previous one is uploaded
+    StorageHelper::RestartReader reader;
+    addPopulationData(reader, xpos, this->xpos, HDF5_GPUTYPE, AF_GPUTYPE);
     this->xposStorage.reset(new DataSet(xpos));
 
-    H5::DataSet ypos = group.openDataSet("ypos");
-    this->ypos = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(ypos, HDF5_GPUTYPE, AF_GPUTYPE);
+    H5::DataSet ypos = group.openDataSet("ypos", this->storageAccess);
+    addPopulationData(reader, ypos, this->ypos, HDF5_GPUTYPE, AF_GPUTYPE);
     this->yposStorage.reset(new DataSet(ypos));
 
-    H5::DataSet angle = group.openDataSet("angle");
-    this->angle = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(angle, HDF5_GPUTYPE, AF_GPUTYPE);
+    H5::DataSet angle = group.openDataSet("angle", this->storageAccess);
+    addPopulationData(reader, angle, this->angle, HDF5_GPUTYPE, AF_GPUTYPE);
     this->angleStorage.reset(new DataSet(angle));
 
+    if(usesActiveMask()) {
+        H5::DataSet idData = group.openDataSet("id");
+        addPopulationData(reader, idData, this->ids, H5::PredType::NATIVE_UINT, af::dtype::u32);
+        this->idStorage.reset(new DataSet(idData));
+
+        H5::DataSet biomassData = group.openDataSet("biomass");
+        addPopulationData(reader, biomassData, this->biomass, HDF5_GPUTYPE, AF_GPUTYPE);
+        this->biomassStorage.reset(new DataSet(biomassData));
+
+        H5::DataSet weightData = group.openDataSet("weight");
+        addPopulationData(reader, weightData, this->weight, HDF5_GPUTYPE, AF_GPUTYPE);
+        this->weightStorage.reset(new DataSet(weightData));
+
+        if(group.nameExists("replica")) {
+            H5::DataSet replicaData = group.openDataSet("replica");
+            addPopulationData(reader, replicaData, this->replica, H5::PredType::NATIVE_UINT, af::dtype::u32);
+            this->replicaStorage.reset(new DataSet(replicaData));
+        }
+    }
+    reader.load();
+    if(usesActiveMask() && group.attrExists("Next id"))
+        group.openAttribute("Next id").read(H5::PredType::NATIVE_UINT, &this->nextId);
+    else if(usesActiveMask() && this->size)
+        // Files written before "Next id" was stored
+        this->nextId = max<unsigned int>(this->ids) + 1;
+
     validatePositions();
     updateInterpolatedPositions();
     simulate(0);
     senseLigandConcentration();
 }
 
+void SimplePopulation::restoreFromEvents(H5::Group group) {
+    // Positions and directions at the last save are reconstructed from the events, later events are dropped as
+    // their timesteps are simulated again
+    H5::Group events = group.openGroup("Events");
+    unsigned int bacteria;
+    events.openAttribute("Bacteria").read(H5::PredType::NATIVE_UINT, &bacteria);
+    events.openAttribute("Tolerance").read(HDF5_GPUTYPE, &this->params.eventTolerance);
+    this->params.eventLog = true;
+    this->size = bacteria;
+    this->used = this->size;
+    this->init();
+    initializeArrays();
+
+    unsigned long long saveStep = EventLog::truncateToLastSave(group);
+    std::vector<EventLog::State> states = EventLog(group).getStateAtStep(saveStep);
+    std::vector<GPU_REALTYPE> x(size), y(size), direction(size), moving(size);
+    for(int i = 0; i < size; i++) {
+        x[i] = states[i].x;
+        y[i] = states[i].y;
+        direction[i] = states[i].angle;
+        moving[i] = states[i].moving;
+    }
+    this->xpos = array(size, x.data());
+    this->ypos = array(size, y.data());
+    this->angle = array(size, direction.data());
+    this->restoredMoving = array(size, moving.data()) > 0;
+
+    openEventStorage(events);
+    this->eventsStored = events.openDataSet("id").getSpace().getSimpleExtentNpoints();
+    this->eventStep = (unsigned int)saveStep;
+
+    validatePositions();
+    updateInterpolatedPositions();
+    simulate(0);
+    senseLigandConcentration();
+    initializeEventLog();
+}
+
+SimplePopulation::SimplePopulation(shared_ptr<Environment> Env, const Checkpoint &checkpoint, std::string prefix) :
+        BacterialPopulation(checkpoint, prefix), env(Env), params(readParameters(checkpoint, prefix + "Parameters/")) {
+    this->size = (int)checkpoint.getValue(prefix + "Size");
+    this->used = (int)checkpoint.getValue(prefix + "Used");
+    this->init();
+    initializeArrays();
+    this->activeCount = (int)checkpoint.getValue(prefix + "Active count");
+    this->nextId = (unsigned int)checkpoint.getValue(prefix + "Next id");
+    this->stepsSinceAdaptation = (unsigned int)checkpoint.getValue(prefix + "Steps since adaptation");
+    // Derived classes restore their own arrays
+    restoreArrays(checkpoint, prefix, SimplePopulation::getCheckpointArrays());
+}
+
+void SimplePopulation::writeCheckpoint(Checkpoint &checkpoint, std::string prefix) {
+    BacterialPopulation::writeCheckpoint(checkpoint, prefix);
+    writeParameters(checkpoint, prefix + "Parameters/", this->params);
+    checkpoint.setValue(prefix + "Size", size);
+    checkpoint.setValue(prefix + "Used", used);
+    checkpoint.setValue(prefix + "Active count", activeCount);
+    checkpoint.setValue(prefix + "Next id", nextId);
+    checkpoint.setValue(prefix + "Steps since adaptation", stepsSinceAdaptation);
+    for(auto named: getCheckpointArrays())
+        checkpoint.setArray(prefix + named.first, *named.second);
+}
+
+std::vector<std::pair<std::string, array *>> SimplePopulation::getCheckpointArrays() {
+    return {
+            {"xpos", &xpos}, {"ypos", &ypos}, {"angle", &angle}, {"atborder", &atborder},
+            {"Interpolated positions", &interpolatedPositions}, {"Interpolation weights", &weights},
+            {"Concentrations", &concentrations}, {"Sensed concentration", &sensedConcentration},
+            {"active", &active}, {"id", &ids}, {"biomass", &biomass}, {"weight", &weight}, {"replica", &replica}
+    };
+}
+
+void SimplePopulation::restoreArrays(const Checkpoint &checkpoint, std::string prefix,
+                                     std::vector<std::pair<std::string, array *>> arrays, size_t first) {
+    for(size_t i = first; i < arrays.size(); i++)
+        *arrays[i].second = checkpoint.getArray(prefix + arrays[i].first);
+}
+
+void SimplePopulation::writeParameters(Checkpoint &checkpoint, std::string prefix, const SimplePopulationParameters &parameters) {
+    std::vector<double> interactions;
+    for(auto interaction: parameters.interactions)
+        interactions.insert(interactions.end(), {(double)interaction.ligandId, interaction.productionRate,
+                interaction.uptakeRate, interaction.Ku, interaction.Kon, interaction.Koff});
+    checkpoint.setValues(prefix + "Ligand interactions", interactions);
+    checkpoint.setValue(prefix + "Swimm speed", parameters.swimmSpeed);
+    checkpoint.setValue(prefix + "Integration multiplyer", parameters.integrationMultiplyer);
+    checkpoint.setValue(prefix + "Dynamic population", parameters.dynamicPopulation);
+    checkpoint.setValue(prefix + "Initial biomass", parameters.initialBiomass);
+    checkpoint.setValue(prefix + "Growth yield", parameters.growthYield);
+    checkpoint.setValue(prefix + "Maintenance rate", parameters.maintenanceRate);
+    checkpoint.setValue(prefix + "Division threshold", parameters.divisionThreshold);
+    checkpoint.setValue(prefix + "Death threshold", parameters.deathThreshold);
+    checkpoint.setValue(prefix + "Compaction threshold", parameters.compactionThreshold);
+    checkpoint.setValue(prefix + "Super individuals", parameters.superIndividuals);
+    checkpoint.setValue(prefix + "Initial weight", parameters.initialWeight);
+    checkpoint.setValue(prefix + "Minimum weight", parameters.minimumWeight);
+    checkpoint.setValue(prefix + "Split gradient", parameters.splitGradient);
+    checkpoint.setValue(prefix + "Merge angle bins", parameters.mergeAngleBins);
+    checkpoint.setValue(prefix + "Adaptation interval", parameters.adaptationInterval);
+    checkpoint.setValue(prefix + "Event log", parameters.eventLog);
+    checkpoint.setValue(prefix + "Event tolerance", parameters.eventTolerance);
+    checkpoint.setValue(prefix + "Event buffer steps", parameters.eventBufferSteps);
+}
+
+SimplePopulationParameters SimplePopulation::readParameters(const Checkpoint &checkpoint, std::string prefix) {
+    SimplePopulationParameters parameters;
+    std::vector<double> interactions = checkpoint.getValues(prefix + "Ligand interactions");
+    for(size_t i = 0; i + 6 <= interactions.size(); i += 6) {
+        LigandInteraction interaction;
+        interaction.ligandId = (unsigned int)interactions[i];
+        interaction.productionRate = interactions[i + 1];
+        interaction.uptakeRate = interactions[i + 2];
+        interaction.Ku = interactions[i + 3];
+        interaction.Kon = interactions[i + 4];
+        interaction.Koff = interactions[i + 5];
+        parameters.interactions.push_back(interaction);
+    }
+    parameters.swimmSpeed = checkpoint.getValue(prefix + "Swimm speed");
+    parameters.integrationMultiplyer = (unsigned int)checkpoint.getValue(prefix + "Integration multiplyer");
+    parameters.dynamicPopulation = checkpoint.getValue(prefix + "Dynamic population") != 0;
+    parameters.initialBiomass = checkpoint.getValue(prefix + "Initial biomass");
+    parameters.growthYield = checkpoint.getValue(prefix + "Growth yield");
+    parameters.maintenanceRate = checkpoint.getValue(prefix + "Maintenance rate");
+    parameters.divisionThreshold = checkpoint.getValue(prefix + "Division threshold");
+    parameters.deathThreshold = checkpoint.getValue(prefix + "Death threshold");
+    parameters.compactionThreshold = checkpoint.getValue(prefix + "Compaction threshold");
+    parameters.superIndividuals = checkpoint.getValue(prefix + "Super individuals") != 0;
+    parameters.initialWeight = checkpoint.getValue(prefix + "Initial weight");
+    parameters.minimumWeight = checkpoint.getValue(prefix + "Minimum weight");
+    parameters.splitGradient = checkpoint.getValue(prefix + "Split gradient");
+    parameters.mergeAngleBins = (unsigned int)checkpoint.getValue(prefix + "Merge angle bins");
+    parameters.adaptationInterval = (unsigned int)checkpoint.getValue(prefix + "Adaptation interval");
+    if(checkpoint.has(prefix + "Event log")) {
+        parameters.eventLog = checkpoint.getValue(prefix + "Event log") != 0;
+        parameters.eventTolerance = checkpoint.getValue(prefix + "Event tolerance");
+        parameters.eventBufferSteps = (unsigned int)checkpoint.getValue(prefix + "Event buffer steps");
+    }
+    return parameters;
+}
+
 REGISTER_DEF_TYPE(SimplePopulation);
 
 void SimplePopulation::printInternals() {
@@ -285,6 +834,7 @@ void SimplePopulation::printInternals() {
 
 void SimplePopulation::senseLigandConcentration() {
     sensedConcentration = sum(concentrations, 1);
+    Profiler::countEvaluations();
     eval(sensedConcentration);
 }
 
@@ -300,6 +850,194 @@ void SimplePopulation::initializeArrays() {
     concentrations = constant(0, size, params.interactions.size());
     interpolatedPositions = array(size, 4,  af::dtype::u32);
     weights = array(size, 4, AF_GPUTYPE);
+
+    // Only the first used slots contain bacteria, the remaining ones are slack for divisions
+    active = range(dim4(size), 0, af::dtype::u32) < used;
+    ids = range(dim4(size), 0, af::dtype::u32);
+    biomass = constant(params.initialBiomass, size, AF_GPUTYPE);
+    weight = constant(params.initialWeight, size, AF_GPUTYPE);
+    // Consecutive blocks of the used slots belong to the same replica
+    array slots = range(dim4(size), 0, af::dtype::u32);
+    replica = select(slots < used, slots / std::max(used/(int)replicas, 1), 0).as(af::dtype::u32);
+    activeCount = used;
+    nextId = used;
+    stepsSinceAdaptation = 0;
+    eval(active, ids, biomass, weight, replica);
+}
+
+std::vector<array *> SimplePopulation::getPerBacteriumArrays() {
+    // atborder is derived from the positions in every timestep and therefore not listed
+    return std::vector<array *> {&xpos, &ypos, &angle, &interpolatedPositions, &weights, &concentrations,
+                                 &sensedConcentration, &active, &ids, &biomass, &weight, &replica};
+}
+
+void SimplePopulation::resizeRows(array &data, dim_t rows, dim_t newRows) {
+    if(data.isempty())
+        return;
+    array resized = constant(0, newRows, data.dims(1), data.type());
+    dim_t copyRows = std::min(rows, newRows);
+    if(copyRows > 0)
+        resized(seq(copyRows), span) = data(seq(copyRows), span);
+    data = resized;
+}
+
+void SimplePopulation::reserve(int capacity) {
+    if(capacity <= size)
+        return;
+    for(auto data: getPerBacteriumArrays())
+        resizeRows(*data, size, capacity);
+    size = capacity;
+}
+
+void SimplePopulation::compact() {
+    // Stream compaction: move all living bacteria to the front while keeping the capacity
+    if(activeCount == 0) {
+        // Nothing to gather, all rows are cleared
+        for(auto data: getPerBacteriumArrays())
+            resizeRows(*data, 0, size);
+        used = 0;
+        return;
+    }
+    array keep = where(active);
+    for(auto data: getPerBacteriumArrays()) {
+        if(!data->isempty())
+            *data = (*data)(keep, span);
+    }
+    int capacity = size;
+    size = activeCount;
+    used = activeCount;
+    for(auto data: getPerBacteriumArrays())
+        resizeRows(*data, size, capacity);
+    size = capacity;
+}
+
+void SimplePopulation::divide(array parents) {
+    biomass(parents) *= 0.5;
+    cloneIndividuals(parents);
+}
+
+array SimplePopulation::cloneIndividuals(array parents) {
+    int nDividing = parents.elements();
+    // Grow geometrically so that the number of reallocations stays logarithmic in the population size
+    if(used + nDividing > size)
+        reserve(std::max(2*size, used + nDividing));
+
+    array children = range(dim4(nDividing), 0, af::dtype::u32) + used;
+    for(auto data: getPerBacteriumArrays()) {
+        if(!data->isempty())
+            (*data)(children, span) = (*data)(parents, span);
+    }
+    ids(children) = range(dim4(nDividing), 0, af::dtype::u32) + nextId;
+    angle(children) = (2 * af::Pi * randu(nDividing)).as(AF_GPUTYPE);
+
+    nextId += nDividing;
+    used += nDividing;
+    activeCount += nDividing;
+    return children;
+}
+
+array SimplePopulation::addIndividuals(array x, array y) {
+    int nNew = x.elements();
+    if(used + nNew > size)
+        reserve(std::max(2*size, used + nNew));
+
+    // Slots beyond used are always zero initialized by reserve and compact, only set what differs from zero
+    array children = range(dim4(nNew), 0, af::dtype::u32) + used;
+    xpos(children) = x.as(AF_GPUTYPE);
+    ypos(children) = y.as(AF_GPUTYPE);
+    angle(children) = (2 * af::Pi * randu(nNew)).as(AF_GPUTYPE);
+    active(children) = true;
+    ids(children) = range(dim4(nNew), 0, af::dtype::u32) + nextId;
+    biomass(children) = params.initialBiomass;
+    weight(children) = params.initialWeight;
+
+    nextId += nNew;
+    used += nNew;
+    activeCount += nNew;
+    return children;
+}
+
+void SimplePopulation::updatePopulationDynamics(double dt) {
+    if(params.dynamicPopulation) {
+        biomass -= active*(params.maintenanceRate*dt);
+        active = active && (biomass >= params.deathThreshold);
+
+        array dividing = where(active && (biomass >= params.divisionThreshold));
+        SyncCounter::record("SimplePopulation::updatePopulationDynamics");
+        if(dividing.elements()) {
+            if(params.superIndividuals) {
+                // All bacteria represented by a super individual divide at once
+                weight(dividing) *= 2.0;
+                biomass(dividing) *= 0.5;
+            } else
+                divide(dividing);
+        }
+    }
+
+    if(params.superIndividuals && ++stepsSinceAdaptation >= params.adaptationInterval) {
+        mergeSuperIndividuals();
+        splitSuperIndividuals();
+        stepsSinceAdaptation = 0;
+    }
+
+    // The only count of the living bacteria per step, compaction depends on it
+    SyncCounter::record("SimplePopulation::updatePopulationDynamics");
+    activeCount = sum<int>(active);
+    if(used - activeCount > params.compactionThreshold*used)
+        compact();
+    Profiler::countEvaluations();
+    eval(active, biomass, weight);
+}
+
+array SimplePopulation::getStateKey() {
+    // Quantize the swimming direction, bacteria heading into the same direction behave alike
+    array normalizedAngle = mod(angle, 2*af::Pi) / (2*af::Pi);
+    return min(af::floor(normalizedAngle*params.mergeAngleBins), params.mergeAngleBins - 1.0).as(af::dtype::u32);
+}
+
+void SimplePopulation::mergeSuperIndividuals() {
+    array members = where(active);
+    SyncCounter::record("SimplePopulation::mergeSuperIndividuals");
+    if(members.elements() < 2)
+        return;
+
+    // Agents in the same grid cell with the same quantized state form a group
+    array keys = interpolatedPositions(members, I_TOPLEFT).as(af::dtype::u64) * 4294967296ULL
+                 + getStateKey()(members).as(af::dtype::u64);
+    array sortedKeys, order;
+    sort(sortedKeys, order, keys);
+    members = members(order);
+
+    array groupStart = join(0, constant(1, 1, af::dtype::b8), sortedKeys(seq(1, end)) != sortedKeys(seq(0, end-1)));
+    array representatives = where(groupStart);
+    SyncCounter::record("SimplePopulation::mergeSuperIndividuals");
+    if(representatives.elements() == members.elements())
+        return;
+
+    // Sum the weights of every group and keep the weighted mean biomass so that total mass is conserved
+    array groupIds = (accum(groupStart.as(af::dtype::u32)) - 1).as(af::dtype::u32);
+    array memberWeights = weight(members);
+    array groupKeys, groupWeights, groupBiomass;
+    sumByKey(groupKeys, groupWeights, groupIds, memberWeights);
+    sumByKey(groupKeys, groupBiomass, groupIds, memberWeights*biomass(members));
+
+    array representativeMembers = members(representatives);
+    weight(representativeMembers) = groupWeights;
+    biomass(representativeMembers) = groupBiomass/groupWeights;
+    array merged = members(where(!groupStart));
+    active(merged) = false;
+}
+
+void SimplePopulation::splitSuperIndividuals() {
+    // Heavy agents in steep gradients are split so that their members can follow diverging trajectories
+    array gradients = max(env->getLigandGradients(interpolatedPositions, ligandmapping), 1);
+    array splitting = where(active && weight >= 2*params.minimumWeight && gradients > params.splitGradient);
+    SyncCounter::record("SimplePopulation::splitSuperIndividuals");
+    if(splitting.elements() == 0)
+        return;
+
+    weight(splitting) *= 0.5;
+    cloneIndividuals(splitting);
 }
 
 
@@ -6,6 +6,7 @@
 #define BACTSIM_GPU_SIMPLEPOPULATION_H
 
 #include "BacterialPopulation.h"
+#include "General/StorageHelper.h"
 
 struct SimplePopulationParameters : BacterialParameters {
     SimplePopulationParameters() {};
@@ -14,6 +15,43 @@ struct SimplePopulationParameters : BacterialParameters {
     std::vector<LigandInteraction> interactions;
     GPU_REALTYPE swimmSpeed;
     unsigned int integrationMultiplyer = 5;
+
+    // Population dynamics, disabled by default so the population keeps a constant size
+    bool dynamicPopulation = false;
+    GPU_REALTYPE initialBiomass = 1.0;
+    GPU_REALTYPE growthYield = 1.0;         // biomass gained per unit of ligand taken up
+    GPU_REALTYPE maintenanceRate = 0.0;     // biomass consumed per second
+    GPU_REALTYPE divisionThreshold = 2.0;   // bacteria divide once their biomass exceeds this value
+    GPU_REALTYPE deathThreshold = 0.0;      // bacteria die once their biomass drops below this value
+    // Storage slots are compacted once more than this fraction of the used slots belongs to dead bacteria
+    GPU_REALTYPE compactionThreshold = 0.25;
+
+    // Super individuals: every agent represents `weight` identical bacteria
+    bool superIndividuals = false;
+    GPU_REALTYPE initialWeight = 1.0;
+    GPU_REALTYPE minimumWeight = 1.0;       // agents are never split below this weight
+    GPU_REALTYPE splitGradient = 0.1;       // agents split once the sensed gradient exceeds this value (uM/um)
+    unsigned int mergeAngleBins = 16;       // agents in the same grid cell merge if their direction falls into the same bin
+    unsigned int adaptationInterval = 10;   // timesteps between merge and split passes
+
+    // Event log output instead of position frames, see EventLog. Requires a population without population dynamics
+    // and super individuals.
+    bool eventLog = false;
+    GPU_REALTYPE eventTolerance = 1e-3;     // um a bacterium may deviate from its straight line before an event is logged
+    unsigned int eventBufferSteps = 16;     // timesteps of events collected on the device between downloads
+};
+
+// Subsampled output of a population with fixed slots, e.g. the receptor states of a few thousand out of millions of
+// bacteria together with sparse position snapshots of all of them
+struct PopulationOutput {
+    // Slots of the bacteria stored in the per bacterium datasets, all bacteria if empty
+    std::vector<unsigned int> tracked;
+    // Fields stored only every step-th save, by dataset name ("Tm" and "Tma" cover all methylation levels). Fields that
+    // are not listed are stored every save.
+    std::map<std::string, unsigned int> steps;
+    // With a tracked subset, positions and directions of all bacteria are stored in the group "Snapshots" every
+    // snapshotStep-th save, 0 disables the snapshots
+    unsigned int snapshotStep = 0;
 };
 
 class SimplePopulation : public BacterialPopulation {
@@ -21,6 +59,7 @@ public:
     SimplePopulation(std::string name, shared_ptr<Environment> Env, SimplePopulationParameters parameters, int nBacteria);
     SimplePopulation(std::string name, shared_ptr<Environment> Env, SimplePopulationParameters parameters, int nBacteria, GPU_REALTYPE *initialx, GPU_REALTYPE *initialy);
     SimplePopulation(shared_ptr<Environment> Env, H5::Group group);
+    SimplePopulation(shared_ptr<Environment> Env, const Checkpoint &checkpoint, std::string prefix);
 
     virtual void printInternals() override;
 
@@ -28,16 +67,30 @@ public:
     void interactWithEnv(array individuals, double dt) override;
 
     int getSize() override { return size; }
+    int getActiveCount() { return activeCount; }
+    array getActive() { return active; }
+    array getIds() { return ids; }
+    array getWeights() { return weight; }
+    array getReplicas() { return replica; }
     array getXpos() override { return xpos; }
     array getYpos() override { return ypos; }
+    shared_ptr<Environment> getEnvironment() { return env; }
+    // Slots keep their bacterium for the whole simulation unless population dynamics or super individuals are enabled
+    bool hasFixedSlots() { return !usesActiveMask(); }
     virtual double getStabledt() override {return 0.1;};
 
     void liveTimestep(double dt) override;
+    bool isIndependentOfDiffusion() override { return true; }
     virtual void senseLigandConcentration();
 
     void setupStorage(H5::Group storage) override;
+    void setupStorage(H5::Group storage, PopulationOutput output);
+    // Tracked subset and field steps used by the next setupStorage
+    void setOutput(PopulationOutput output) { this->output = output; }
+    PopulationOutput getOutput() { return output; }
     bool save() override;
     void closeStorage() override;
+    void writeCheckpoint(Checkpoint &checkpoint, std::string prefix) override;
 
     virtual array getInterpolatedPositions() override;
 
@@ -51,10 +104,65 @@ protected:
     void init();
     void initializeArrays();
 
+    // Checkpoints, derived classes append their arrays to the ones of their base class
+    virtual std::vector<std::pair<std::string, array *>> getCheckpointArrays();
+    void restoreArrays(const Checkpoint &checkpoint, std::string prefix, std::vector<std::pair<std::string, array *>> arrays,
+                       size_t first = 0);
+    static void writeParameters(Checkpoint &checkpoint, std::string prefix, const SimplePopulationParameters &parameters);
+    static SimplePopulationParameters readParameters(const Checkpoint &checkpoint, std::string prefix);
+
+    // Population dynamics
+    virtual std::vector<array *> getPerBacteriumArrays();
+    virtual void updatePopulationDynamics(double dt);
+    void divide(array parents);
+    array cloneIndividuals(array parents);
+    array addIndividuals(array x, array y);
+    bool usesActiveMask() { return params.dynamicPopulation || params.superIndividuals; }
+
+    // Super individuals
+    virtual array getStateKey();
+    void mergeSuperIndividuals();
+    void splitSuperIndividuals();
+    unsigned int stepsSinceAdaptation;
+    void reserve(int capacity);
+    void compact();
+    void setupDynamicStorage();
+    static void resizeRows(array &data, dim_t rows, dim_t newRows);
+
     // Boundary
     static void applyPeriodicBoundary(double maxx, double maxy, array &xpos, array &ypos);
     static void applySolidBoundary(double maxx, double maxy, array &xpos, array &ypos, array &atborder);
 
+    // Event log, events are compacted into a device buffer that is downloaded at save steps or when it is full
+    virtual array getMoving();
+    bool logsEvents() { return params.eventLog && eventStorage; }
+    void logEvents(double dt);
+    void flushEvents();
+    void setupEventStorage();
+    void openEventStorage(H5::Group events);
+    void initializeEventLog();
+    void restoreFromEvents(H5::Group group);
+    unique_ptr<H5::Group> eventStorage;
+    std::vector<unique_ptr<H5::DataSet>> eventFieldStorage;
+    unique_ptr<H5::DataSet> saveStepStorage;
+    unique_ptr<H5::DataSet> saveOffsetStorage;
+    unsigned int eventStep = 0;
+    unsigned long long eventsStored = 0;
+    // Upper bound of the events in the buffer, the exact count stays on the device until the buffer is downloaded
+    size_t bufferedBound = 0;
+    bool logAll = true;
+    array loggedX;
+    array loggedY;
+    array loggedAngle;
+    array loggedMoving;
+    array loggedStep;
+    array eventIds;
+    array eventSteps;
+    array eventValues;
+    array eventCount;
+    // Motility of the bacteria reconstructed from the event log of a restart
+    array restoredMoving;
+
     // Environment
     void updateInterpolatedPositions();
     std::function<void(void)> validatePositions;
@@ -71,6 +179,19 @@ protected:
     double maxy;
     int size;
     bool spaciallyLimitedEnv = false;
+
+    // Capacity managed storage: arrays hold `size` slots of which the first `used` ones have been occupied at
+    // some point. Only slots marked in `active` contain living bacteria, `ids` are stable across compaction.
+    int used;
+    int activeCount;
+    unsigned int nextId;
+    array active;
+    array ids;
+    array biomass;
+    array weight;
+    // Replica of the environment every bacterium lives in, populations hold the same number of bacteria per replica
+    unsigned int replicas;
+    array replica;
     // Bacteria
     virtual void interactWithEnvPos(array pos, array w, int individual, double dt);
     virtual void interactWithEnvPos(array pos, array weights, array individuals, double dt);
@@ -87,9 +208,58 @@ protected:
     // Storage
     H5::DataSpace storageSpace;
     H5::DSetCreatPropList storageProperties;
+    H5::DSetAccPropList storageAccess;
     unique_ptr<H5::DataSet> xposStorage;
     unique_ptr<H5::DataSet> yposStorage;
     unique_ptr<H5::DataSet> angleStorage;
+    unique_ptr<H5::DataSet> idStorage;
+    unique_ptr<H5::DataSet> biomassStorage;
+    unique_ptr<H5::DataSet> weightStorage;
+    unique_ptr<H5::DataSet> replicaStorage;
+    unique_ptr<H5::DataSet> frameOffsetStorage;
+    // Rows written in the current save step (only active bacteria for dynamic populations)
+    array savedIndex;
+    hsize_t savedOffset;
+
+    // Subsampled output, the tracked slots are gathered on the device before the download
+    PopulationOutput output;
+    array trackedIndex;
+    unsigned long saveCalls = 0;
+    // Index of the save in progress, decides which fields are due
+    unsigned long currentSave = 0;
+    unique_ptr<H5::DataSet> snapshotXposStorage;
+    unique_ptr<H5::DataSet> snapshotYposStorage;
+    unique_ptr<H5::DataSet> snapshotAngleStorage;
+    bool isTracking() { return !output.tracked.empty(); }
+    bool isFieldDue(std::string name);
+    // Marks the datasets of fields with a step, called by setupStorage of every class that adds fields
+    void writeFieldSteps();
+    void setupSnapshotStorage();
+
+    template <class T> void appendPopulationData(array data, H5::DataSet &target, const H5::DataType &H5MemoryType) {
+        if(usesActiveMask()) {
+            if(savedIndex.elements())
+                StorageHelper::appendRaggedDataToDataSet<T>(data(savedIndex, span), target, H5MemoryType);
+        } else if(isTracking())
+            StorageHelper::appendDataToDataSet<T>(data(trackedIndex, span), target, H5MemoryType);
+        else
+            StorageHelper::appendDataToDataSet<T>(data, target, H5MemoryType);
+    }
+
+    template <class T> array loadPopulationData(H5::DataSet data, H5::DataType H5MemoryType, dtype arrayfireType) {
+        if(usesActiveMask())
+            return StorageHelper::loadLastRaggedDataToGpu<T>(data, *frameOffsetStorage, H5MemoryType, arrayfireType);
+        return StorageHelper::loadLastDataToGpu<T>(data, H5MemoryType, arrayfireType);
+    }
+
+    // Queues the last saved frame of a field, target is assigned once the reader is loaded
+    void addPopulationData(StorageHelper::RestartReader &reader, H5::DataSet data, array &target,
+                           const H5::DataType &H5MemoryType, dtype arrayfireType) {
+        if(usesActiveMask())
+            reader.addRagged(data, *frameOffsetStorage, target, H5MemoryType, arrayfireType);
+        else
+            reader.add(data, target, H5MemoryType, arrayfireType);
+    }
 
 };
 
@@ -14,13 +14,14 @@ public:
 
         for(auto& ligandDensity: constantConcentrations) {
             densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), hostLigandMapping[ligandDensity.first]) =
-                    array(dims, ligandDensity.second).as(AF_GPUTYPE);
+                    tile(array(dims, ligandDensity.second).as(AF_GPUTYPE), 1, 1, 1, internal_dimensions[3]);
         }
         eval(densities);
     }
 
     // Don't change Environment
     virtual void changeLigandConcentrationBy(array concDifferences, array positions, array weights, array ligands) override {}
+    virtual void changeLigandFieldBy(array fieldChanges, std::vector<unsigned int> ligandIds) override {}
     virtual void simulateTimestep(double dt) override {}
     virtual double getStabledt() override {return 1.0;}
 };
@@ -5,6 +5,40 @@
 #include "Environment.h"
 #include "General/StorageHelper.h"
 #include "General/ArrayFireHelper.h"
+#include "General/SyncCounter.h"
+#include "General/Profiler.h"
+#include "General/Tracer.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+namespace {
+    H5::DataSet createKeyframeStorage(H5::Group frames) {
+        hsize_t initDims = 0, maxDims = H5S_UNLIMITED, chunk = 64;
+        H5::DSetCreatPropList properties;
+        properties.setChunk(1, &chunk);
+        return frames.createDataSet("Keyframes", H5::PredType::STD_U64LE, H5::DataSpace(1, &initDims, &maxDims), properties);
+    }
+
+    std::vector<unsigned long long> readSteps(H5::Group &group, std::string name) {
+        H5::DataSet data = group.openDataSet(name);
+        std::vector<unsigned long long> steps(data.getSpace().getSimpleExtentNpoints());
+        if(!steps.empty())
+            data.read(steps.data(), H5::PredType::NATIVE_ULLONG);
+        return steps;
+    }
+
+    template <class T> std::vector<T> readRows(H5::DataSet data, const H5::DataType &type, hsize_t first, hsize_t count) {
+        std::vector<T> values(count);
+        if(count == 0)
+            return values;
+        H5::DataSpace space = data.getSpace();
+        space.selectHyperslab(H5S_SELECT_SET, &count, &first);
+        H5::DataSpace memorySpace(1, &count);
+        data.read(values.data(), type, memorySpace, space);
+        return values;
+    }
+}
 
 array Environment::getLaplacian() {
     GPU_REALTYPE data2 [] =
@@ -20,24 +54,159 @@ Environment::Environment(EnvironmentSettings settings) : EnvironmentBase(setting
 
 Environment::Environment(H5::Group group) : EnvironmentBase(group) {
     init();
-    hsize_t current_size[3], count[3], start[3];
-    for(auto ligand: this->ligands) {
-        H5::DataSet ligData = group.openDataSet(ligand.name);
-        this->densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), this->hostLigandMapping[ligand.ligandId]) =
-                StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(ligData, HDF5_GPUTYPE, AF_GPUTYPE);
+    unsigned int replicas = getReplicas();
+    ligands_storage.resize(replicas);
+    if(isDeltaEncoded())
+        deltas_storage.resize(replicas);
+    // Keyframes are read while the previous ligand is uploaded and copied into the densities once all are loaded
+    StorageHelper::RestartReader reader;
+    std::vector<array> lastFrames(replicas*this->ligands.size());
+    dim4 dims = this->densities.dims();
+    for(unsigned int r = 0; r < replicas; r++) {
+        H5::Group replicaGroup = openReplicaGroup(group, r);
+        for(auto ligand: this->ligands) {
+            H5::DataSet ligData = replicaGroup.openDataSet(ligand.name);
+            unsigned int index = this->hostLigandMapping[ligand.ligandId];
+            if(isDeltaEncoded()) {
+                // Continue from the reconstruction of the last save, exactly as a reader would see it
+                savedFrames = getSavedFrameCount(group, ligand.name, r);
+                if(savedFrames > 0) {
+                    std::vector<double> frame = readSavedFrame(group, ligand.name, savedFrames - 1, r);
+                    lastFrames[r*this->ligands.size() + index] =
+                            array(dims[1] - 2*BORDER_SIZE, dims[0] - 2*BORDER_SIZE, frame.data()).T().as(AF_GPUTYPE);
+                }
+                StorageHelper::readFrameLayout(ligData);
+                H5::DataSet deltas = replicaGroup.openGroup("Deltas").openDataSet(ligand.name);
+                StorageHelper::readFrameLayout(deltas);
+                this->deltas_storage[r][ligand.ligandId] = std::unique_ptr<H5::DataSet>(new H5::DataSet(deltas));
+            } else
+                reader.add(ligData, lastFrames[r*this->ligands.size() + index], HDF5_GPUTYPE, AF_GPUTYPE);
+
+            this->ligands_storage[r][ligand.ligandId] = std::unique_ptr<H5::DataSet>(new H5::DataSet(ligData));
+        }
+    }
+    reader.load();
+    for(unsigned int r = 0; r < replicas; r++)
+        for(unsigned int index = 0; index < this->ligands.size(); index++)
+            if(!lastFrames[r*this->ligands.size() + index].isempty())
+                this->densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), index, r) =
+                        lastFrames[r*this->ligands.size() + index];
+    if(isDeltaEncoded() || isAdaptive()) {
+        reconstructed = densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span);
+        reconstructed.eval();
+    }
+    // Files written before frame times were recorded continue without them
+    if(group.nameExists("Frames"))
+        time_storage.reset(new H5::DataSet(group.openGroup("Frames").openDataSet("Time")));
+    if(isDeltaEncoded()) {
+        std::vector<hsize_t> keyframes = readKeyframes(group, savedFrames);
+        deltasSinceKeyframe = keyframes.empty() ? 0 : (unsigned int)(savedFrames - 1 - keyframes.back());
+        H5::Group frames = group.nameExists("Frames") ? group.openGroup("Frames") : group.createGroup("Frames");
+        if(frames.nameExists("Keyframes"))
+            keyframe_storage.reset(new H5::DataSet(frames.openDataSet("Keyframes")));
+        else {
+            // Early keyframes of the continued simulation need the index, it starts with the regular keyframes
+            keyframe_storage.reset(new H5::DataSet(createKeyframeStorage(frames)));
+            hsize_t count = keyframes.size();
+            if(count) {
+                keyframe_storage->extend(&count);
+                keyframe_storage->write(keyframes.data(), H5::PredType::NATIVE_HSIZE);
+            }
+        }
+    }
+    // The densities are those of the last keyframe, see resumeFromDeposits
+    if(isRecomputed() && group.nameExists("Deposits"))
+        openDepositStorage(group.openGroup("Deposits"));
+    openOutputStorage(group);
+}
+
+Environment::Environment(const Checkpoint &checkpoint, std::string prefix) :
+        Environment(readCheckpointSettings(checkpoint, prefix)) {
+    densities = checkpoint.getArray(prefix + "Densities");
+}
 
-        this->ligands_storage[ligand.ligandId] = std::unique_ptr<H5::DataSet>(new H5::DataSet(ligData));
+H5::Group Environment::openReplicaGroup(H5::Group environment, unsigned int replica) {
+    if(!environment.attrExists("Replicas"))
+        return environment;
+    return environment.openGroup(getReplicaGroupName(replica));
+}
+
+hsize_t Environment::getSavedFrameCount(H5::Group environment, std::string ligandName, unsigned int replica) {
+    H5::Group replicaGroup = openReplicaGroup(environment, replica);
+    hsize_t frames = StorageHelper::getFrameCount(replicaGroup.openDataSet(ligandName));
+    // Deltas are stored in a group, which is ignored when ligands are enumerated
+    if(replicaGroup.nameExists("Deltas"))
+        frames += StorageHelper::getFrameCount(replicaGroup.openGroup("Deltas").openDataSet(ligandName));
+    return frames;
+}
+
+std::vector<double> Environment::readSavedFrame(H5::Group environment, std::string ligandName, hsize_t frame,
+                                                unsigned int replica) {
+    if(frame >= getSavedFrameCount(environment, ligandName, replica))
+        throw H5::Exception("Environment", "Requested frame was not saved");
+
+    unsigned int keyframeInterval = 1;
+    double deltaErrorBound = 0;
+    if(environment.attrExists("Keyframe interval")) {
+        environment.openAttribute("Keyframe interval").read(H5::PredType::NATIVE_UINT, &keyframeInterval);
+        environment.openAttribute("Delta error bound").read(H5::PredType::NATIVE_DOUBLE, &deltaErrorBound);
+    }
+
+    // Every block starts with a keyframe followed by the deltas up to the next keyframe
+    H5::Group replicaGroup = openReplicaGroup(environment, replica);
+    hsize_t block = frame/keyframeInterval;
+    hsize_t keyframe = block*keyframeInterval;
+    if(keyframeInterval > 1) {
+        std::vector<hsize_t> keyframes = readKeyframes(environment, frame + 1);
+        block = std::upper_bound(keyframes.begin(), keyframes.end(), frame) - keyframes.begin() - 1;
+        keyframe = keyframes[block];
     }
+    hsize_t position = frame - keyframe;
+    std::vector<double> values = StorageHelper::readFrameToHost(replicaGroup.openDataSet(ligandName), block);
+    if(position > 0) {
+        H5::DataSet deltas = replicaGroup.openGroup("Deltas").openDataSet(ligandName);
+        double scale = 2*deltaErrorBound;
+        // Frames before the keyframe that are not keyframes themselves are stored as deltas
+        for(hsize_t i = 0; i < position; i++) {
+            std::vector<double> delta = StorageHelper::readFrameToHost(deltas, keyframe - block + i);
+            for(size_t j = 0; j < values.size(); j++)
+                values[j] += delta[j]*scale;
+        }
+    }
+    return values;
+}
+
+std::vector<hsize_t> Environment::readKeyframes(H5::Group environment, hsize_t frames) {
+    std::vector<hsize_t> keyframes;
+    if(environment.nameExists("Frames") && environment.openGroup("Frames").nameExists("Keyframes")) {
+        H5::DataSet data = environment.openGroup("Frames").openDataSet("Keyframes");
+        keyframes.resize(data.getSpace().getSimpleExtentNpoints());
+        if(!keyframes.empty())
+            data.read(keyframes.data(), H5::PredType::NATIVE_HSIZE);
+    } else {
+        // Files written before early keyframes were stored them every keyframeInterval-th save
+        unsigned int keyframeInterval;
+        environment.openAttribute("Keyframe interval").read(H5::PredType::NATIVE_UINT, &keyframeInterval);
+        for(hsize_t frame = 0; frame < frames; frame += keyframeInterval)
+            keyframes.push_back(frame);
+    }
+    return keyframes;
+}
+
+std::string Environment::getReplicaGroupName(unsigned int replica) {
+    std::ostringstream name;
+    name << "Replica " << replica;
+    return name.str();
 }
 
 void Environment::init() {
-    densities = array(internal_dimensions[0], internal_dimensions[1], internal_dimensions[2], AF_GPUTYPE);
+    densities = array(internal_dimensions[0], internal_dimensions[1], internal_dimensions[2], internal_dimensions[3], AF_GPUTYPE);
     densityIndexer = CoordinateIndexer(densities);
     diffusion_filters = constant(0.0, LAPLACIAN_SIZE, LAPLACIAN_SIZE, (dim_t)this->ligands.size(), AF_GPUTYPE);
 //    degradationRates = array(internal_dimensions[0], internal_dimensions[1], internal_dimensions[2], AF_GPUTYPE);
 //    productionRates = array(internal_dimensions[0], internal_dimensions[1], internal_dimensions[2], AF_GPUTYPE);
     for(size_t i = 0; i < ligands.size(); i++) {
-        densities(span, span, i) = ligands[i].initialConcentration;
+        densities(span, span, i, span) = ligands[i].initialConcentration;
         diffusion_filters(span, span, i) = Environment::getLaplacian();
         diffusion_filters(span, span, i) *= this->ligands[i].diffusionCoefficient/pow(resolution, 2);
 //        degradationRates(span, span, i) = ligands[i].globalDegradationRate;
@@ -59,13 +228,13 @@ void Environment::init() {
 }
 
 array Environment::getAllDensities() {
-    return this->densities(seq(BORDER_SIZE,end-BORDER_SIZE), seq(BORDER_SIZE,end-BORDER_SIZE), span);
+    return getReadableDensities()(seq(BORDER_SIZE,end-BORDER_SIZE), seq(BORDER_SIZE,end-BORDER_SIZE), span);
 }
 
 std::vector<double> Environment::getSize() {
     std::vector<double> size;
 
-    dim4 dims = this->densities.dims();
+    dim4 dims = this->internal_dimensions;
     // x
     size.push_back((dims[1] - 2* BORDER_SIZE)*resolution);
     // y
@@ -81,6 +250,7 @@ void Environment::applyNeumannBC(array &input, double resolution, BoundaryCondit
     // X direction
     input(span, 0, span) = input(span, 1, span) - resolution*bc.xneg;
     input(span, end, span) = input(span, end-1, span) - resolution*bc.xpos;
+    Profiler::countEvaluations();
     eval(input);
 }
 
@@ -92,6 +262,7 @@ void Environment::applyDericheletBC(array &input, BoundaryCondition &bc) {
     // X direction
     input(span, 0, span) = input(span, 1, span)*-1.0 + 2.0*bc.xneg;
     input(span, end, span) = input(span, end-1, span)*-1.0 + 2.0*bc.xpos;
+    Profiler::countEvaluations();
     input.eval();
 }
 
@@ -103,15 +274,16 @@ void Environment::applyPeriodicBC(array &input) {
     // X direction
     input(span, 0, span) = input(span, end-1, span);
     input(span, end, span) = input(span, 1, span);
+    Profiler::countEvaluations();
     input.eval();
 }
 
 array Environment::getDensity(int ligandId) {
-    array pos = ligandMapping(span, LIGANDID) == ligandId;
-    if (sum<int>(pos) == 0)
+    // The host copy of the mapping avoids a reduction on the device
+    auto mapping = hostLigandMapping.find(ligandId);
+    if (mapping == hostLigandMapping.end())
         throw exception("Could not find provided ligandId in Environment.");
-    array index = ligandMapping(pos, LIGANDINTERNAL);
-    return this->densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), index);
+    return getReadableDensities()(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), (int)mapping->second);
 }
 
 void Environment::setInterpolatedPositions(array &xpos, array &ypos, array &positions, array &weights) {
@@ -127,18 +299,30 @@ void Environment::setInterpolatedPositions(array &xpos, array &ypos, array &posi
     weights(span, W_TOPRIGHT) = (right - xindex) * (yindex - top);
     weights(span, W_BOTTOMLEFT) = (xindex - left) * (bottom - yindex);
     weights(span, W_BOTTOMRIGHT) = (right - xindex) * (bottom - yindex);
+    Profiler::countEvaluations();
     weights.eval();
 
     positions(span, I_TOPLEFT) = densityIndexer(top, left);
     positions(span, I_TOPRIGHT) = densityIndexer(top, right);
     positions(span, I_BOTTOMLEFT) = densityIndexer(bottom, left);
     positions(span, I_BOTTOMRIGHT) = densityIndexer(bottom, right);
+    Profiler::countEvaluations();
+    positions.eval();
+}
+
+void Environment::setInterpolatedPositions(array &xpos, array &ypos, array &positions, array &weights, array &replicas) {
+    setInterpolatedPositions(xpos, ypos, positions, weights);
+    // Replicas are stored behind each other along the last dimension, offset the grid point indexes accordingly
+    dim4 dims = internal_dimensions;
+    positions += tile(replicas * (unsigned int)(dims[0]*dims[1]*dims[2]), 1, 4);
+    Profiler::countEvaluations();
     positions.eval();
 }
 
 array Environment::get_concentrations(array &indexes, array &ligands) {
-    array index = ArrayFireHelper::indexZAxis(densities, indexes, ligands);
-    return moddims(densities(index), indexes.dims(0), ligands.dims(0));
+    array readable = getReadableDensities();
+    array index = ArrayFireHelper::indexZAxis(readable, indexes, ligands);
+    return moddims(readable(index), indexes.dims(0), ligands.dims(0));
 }
 
 array Environment::getLigandConcentrations(array positions, array weights, array ligands) {
@@ -154,6 +338,7 @@ array Environment::getLigandConcentrations(array positions, array weights, array
             get_concentrations(topright, ligands) * tile(weights(span, W_TOPRIGHT), 1, nligands) +
             get_concentrations(bottomleft, ligands) * tile(weights(span, W_BOTTOMLEFT), 1, nligands) +
             get_concentrations(bottomright, ligands) * tile(weights(span, W_BOTTOMRIGHT), 1, nligands);
+    Profiler::countEvaluations();
     eval(ligdensities);
     return ligdensities;
 }
@@ -176,6 +361,43 @@ void Environment::changeLigandConcentrationBy(array concDifferences, array posit
     densities(alltopright)  += flat(concDifferences)*tile(weights(span, W_TOPRIGHT), nLigands);
     densities(allbottomleft)  += flat(concDifferences)*tile(weights(span, W_BOTTOMLEFT), nLigands);
     densities(allbottomright)  += flat(concDifferences)*tile(weights(span, W_BOTTOMRIGHT), nLigands);
+    Profiler::countEvaluations();
+    eval(densities);
+}
+
+void Environment::changeLigandConcentrationBy(array concDifferences, array positions, array weights, array ligands,
+                                              array agentWeights) {
+    // Super individuals represent several bacteria, scale their contribution accordingly
+    changeLigandConcentrationBy(concDifferences*tile(agentWeights, 1, concDifferences.dims(1)), positions, weights, ligands);
+}
+
+array Environment::getLigandGradients(array positions, array ligands) {
+    // Magnitude of the concentration gradient within the grid cell, estimated from the four surrounding grid points
+    array topleft = positions(span, I_TOPLEFT);
+    array topright = positions(span, I_TOPRIGHT);
+    array bottomleft = positions(span, I_BOTTOMLEFT);
+    array bottomright = positions(span, I_BOTTOMRIGHT);
+
+    array ctopleft = get_concentrations(topleft, ligands);
+    array ctopright = get_concentrations(topright, ligands);
+    array cbottomleft = get_concentrations(bottomleft, ligands);
+    array cbottomright = get_concentrations(bottomright, ligands);
+
+    array gradx = (ctopright - ctopleft + cbottomright - cbottomleft)/(2*resolution);
+    array grady = (cbottomleft - ctopleft + cbottomright - ctopright)/(2*resolution);
+    array gradient = sqrt(gradx*gradx + grady*grady);
+    Profiler::countEvaluations();
+    eval(gradient);
+    return gradient;
+}
+
+void Environment::changeLigandFieldBy(array fieldChanges, std::vector<unsigned int> ligandIds) {
+    // fieldChanges has the dimensions of the interior grid and one slice per ligand in ligandIds
+    for(size_t i = 0; i < ligandIds.size(); i++) {
+        densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), getInternalLigandIndex(ligandIds[i])) +=
+                fieldChanges(span, span, i);
+    }
+    Profiler::countEvaluations();
     eval(densities);
 }
 
@@ -187,62 +409,569 @@ void Environment::setupStorage(unique_ptr<H5::Group> storage)  {
     H5::StrType varstrtype(0, H5T_VARIABLE);
     H5::DataSpace scalar(H5S_SCALAR);
 
-    // Setup dimensions of datasets
+    // Setup dimensions of datasets, chunk shape, compression and layout follow the storage settings
     std::vector<hsize_t> dims;
     for(auto i = 0; i < internal_dimensions.ndims(); i++) {
         dims.push_back(static_cast<hsize_t>(internal_dimensions.dims[i])-2*BORDER_SIZE);
     }
 
-    hsize_t initial_dims[3] = {0, dims[0], dims[1] };
-    // Only time dimension (first) will be extended
-    hsize_t max_dims[3] = {H5S_UNLIMITED, dims[0], dims[1] };
-    H5::DataSpace dataSpace(3, initial_dims, max_dims);
+    unsigned int replicas = getReplicas();
+
+    if(isDeltaEncoded() && settings.deltaErrorBound <= 0)
+        throw exception("Delta encoding of the environment requires a positive error bound");
+
+    // Replicas write into their own groups, a single replica writes directly into the environment group
+    ligands_storage.resize(replicas);
+    if(isDeltaEncoded())
+        deltas_storage.resize(replicas);
+    for(unsigned int r = 0; r < replicas; r++) {
+        H5::Group replicaGroup = replicas > 1 ? this->storage->createGroup(getReplicaGroupName(r)) : *this->storage;
+        if(isDeltaEncoded()) {
+            // Small integer deltas compress well, they use the same chunking and filters as the keyframes
+            H5::Group deltaGroup = replicaGroup.createGroup("Deltas");
+            for(auto ligand: this->ligands) {
+                H5::DataSet deltas = StorageHelper::createFrameDataSet(deltaGroup, ligand.name, dims[0], dims[1],
+                                                                       &H5::PredType::STD_I32LE);
+                this->deltas_storage[r][ligand.ligandId] = std::unique_ptr<H5::DataSet>(new H5::DataSet(deltas));
+            }
+        }
+        for(auto ligand: this->ligands){
+            H5::DataSet liganddataset = StorageHelper::createFrameDataSet(replicaGroup, ligand.name, dims[0], dims[1]);
+            liganddataset.createAttribute("Name", varstrtype, scalar).write(varstrtype, ligand.name);
+            H5::Attribute properties = liganddataset.createAttribute("Properties", Ligand::getH5SaveType(), scalar);
+            properties.write(Ligand::getH5ReadType(), &ligand);
+
+            // Store a unique ptr to this dataset for fast storage later on
+            this->ligands_storage[r][ligand.ligandId] = std::unique_ptr<H5::DataSet>(new H5::DataSet(liganddataset));
+        }
+    }
+
+    // Frames are not stored at a fixed cadence with an adaptive save cadence, readers need their model time.
+    // The dataset lives in a group, which is ignored when ligands are enumerated.
+    hsize_t initDims = 0, maxDims = H5S_UNLIMITED, chunk = 64;
+    H5::DSetCreatPropList timeProperties;
+    timeProperties.setChunk(1, &chunk);
+    H5::Group frames = this->storage->createGroup("Frames");
+    time_storage.reset(new H5::DataSet(frames.createDataSet(
+            "Time", H5::PredType::IEEE_F64LE, H5::DataSpace(1, &initDims, &maxDims), timeProperties)));
+    keyframe_storage.reset();
+    if(isDeltaEncoded())
+        keyframe_storage.reset(new H5::DataSet(createKeyframeStorage(frames)));
+    // A new file starts with a keyframe
+    savedFrames = 0;
+    deltasSinceKeyframe = 0;
+    skippedSaves = 0;
+    reconstructed = array();
+    modelSteps = 0;
+    deposits_storage.clear();
+    if(isRecomputed())
+        setupDepositStorage();
+    setupOutputStorage();
+}
+
+void Environment::setupDepositStorage() {
+    if(isDeltaEncoded() || isAdaptive())
+        throw exception("Recompute on demand stores full keyframes, it can not be combined with delta encoding or an adaptive save cadence");
+
+    // Deposits of a timestep are few compared to the grid, they are stored as ragged rows like dynamic populations.
+    // Cells are numbered column major over (y, x, replica) of the interior grid.
+    H5::Group deposits = this->storage->createGroup("Deposits");
+    dim4 dims = densities.dims();
+    hsize_t initDims = 0, maxDims = H5S_UNLIMITED, chunk = 64;
+    H5::DataSpace space(1, &initDims, &maxDims);
+    H5::DSetCreatPropList properties = StorageHelper::createRaggedProperties((dims[0] - 2*BORDER_SIZE)*(dims[1] - 2*BORDER_SIZE));
+    deposits.createDataSet("cell", H5::PredType::STD_U32LE, space, properties);
+    deposits.createDataSet("ligand", H5::PredType::STD_U32LE, space, properties);
+    StorageHelper::createRealDataSet(deposits, "value", space, properties);
+    // First row and number of every logged model timestep, model timesteps of every save and of every keyframe
+    H5::DSetCreatPropList stepProperties;
+    stepProperties.setChunk(1, &chunk);
+    for(std::string name: {"Step offsets", "Steps", "Save steps", "Keyframe steps"})
+        deposits.createDataSet(name, H5::PredType::STD_U64LE, space, stepProperties);
+    openDepositStorage(deposits);
+}
 
-    // Enable chunking for extendable storage, 4 time points into one chunk to decrease allocation / seeking time
-    H5::DSetCreatPropList properties(H5::DSetCreatPropList::DEFAULT);
-    hsize_t chunk_dims[3] = {4, dims[0], dims[1] };
-    properties.setChunk(3, chunk_dims);
+void Environment::openDepositStorage(H5::Group deposits) {
+    deposits_storage.clear();
+    for(std::string name: {"cell", "ligand", "value", "Step offsets", "Steps", "Save steps", "Keyframe steps"})
+        deposits_storage[name] = unique_ptr<H5::DataSet>(new H5::DataSet(deposits.openDataSet(name)));
+    depositRows = deposits_storage["cell"]->getSpace().getSimpleExtentNpoints();
+    std::vector<unsigned long long> keyframeSteps = readSteps(deposits, "Keyframe steps");
+    modelSteps = keyframeSteps.empty() ? 0 : keyframeSteps.back();
+    depositReference = densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span);
+    depositReference.eval();
+}
 
+void Environment::setupStorage(unique_ptr<H5::Group> storage, EnvironmentOutputs outputs) {
+    setOutputs(outputs);
+    setupStorage(std::move(storage));
+}
 
-    for(auto ligand: this->ligands){
-        H5::DataSet liganddataset = H5::DataSet(this->storage->createDataSet(ligand.name, H5::PredType::IEEE_F64LE, dataSpace, properties));
-        liganddataset.createAttribute("Name", varstrtype, scalar).write(varstrtype, ligand.name);
-        H5::Attribute properties = liganddataset.createAttribute("Properties", Ligand::getH5SaveType(), scalar);
-        properties.write(Ligand::getH5ReadType(), &ligand);
+void Environment::setupOutputStorage() {
+    H5::DataSpace scalar(H5S_SCALAR);
+    dim4 dims = densities.dims();
+    hsize_t rows = dims[0] - 2*BORDER_SIZE, columns = dims[1] - 2*BORDER_SIZE;
+    for(auto &region: outputs.regions) {
+        if(region.rows == 0 || region.columns == 0 || region.row + region.rows > rows || region.column + region.columns > columns)
+            throw exception("Region of interest exceeds the environment");
+    }
 
-        // Store a unique ptr to this dataset for fast storage later on
-        this->ligands_storage[ligand.ligandId] = std::unique_ptr<H5::DataSet>(new H5::DataSet(liganddataset));
+    unsigned int replicas = getReplicas();
+    regions_storage.clear();
+    pyramid_storage.clear();
+    regions_storage.resize(replicas);
+    pyramid_storage.resize(replicas);
+    for(unsigned int r = 0; r < replicas; r++) {
+        H5::Group replicaGroup = openReplicaGroup(*this->storage, r);
+        // Outputs are stored in groups, which are ignored when ligands are enumerated
+        if(!outputs.regions.empty()) {
+            H5::Group regionsGroup = replicaGroup.createGroup("Regions");
+            for(auto &region: outputs.regions) {
+                H5::Group regionGroup = regionsGroup.createGroup(region.name);
+                unsigned int description[5] = {region.row, region.column, region.rows, region.columns, region.step};
+                const char *names[5] = {"Row", "Column", "Rows", "Columns", "Step"};
+                for(int i = 0; i < 5; i++)
+                    regionGroup.createAttribute(names[i], H5::PredType::STD_U32LE, scalar)
+                            .write(H5::PredType::NATIVE_UINT, &description[i]);
+
+                regions_storage[r].emplace_back();
+                for(auto ligand: this->ligands)
+                    regions_storage[r].back()[ligand.ligandId] = unique_ptr<H5::DataSet>(new H5::DataSet(
+                            StorageHelper::createFrameDataSet(regionGroup, ligand.name, region.rows, region.columns)));
+            }
+        }
+        if(!outputs.pyramid.factors.empty()) {
+            H5::Group pyramidGroup = replicaGroup.createGroup("Pyramid");
+            pyramidGroup.createAttribute("Step", H5::PredType::STD_U32LE, scalar)
+                    .write(H5::PredType::NATIVE_UINT, &outputs.pyramid.step);
+            for(unsigned int factor: outputs.pyramid.factors) {
+                if(factor < 2)
+                    throw exception("Pyramid levels require a downsampling factor of at least 2");
+                std::ostringstream name;
+                name << factor << "x";
+                H5::Group levelGroup = pyramidGroup.createGroup(name.str());
+                levelGroup.createAttribute("Factor", H5::PredType::STD_U32LE, scalar)
+                        .write(H5::PredType::NATIVE_UINT, &factor);
+
+                // Incomplete blocks at the upper borders are averaged over the grid points they contain
+                hsize_t levelRows = (rows + factor - 1)/factor, levelColumns = (columns + factor - 1)/factor;
+                pyramid_storage[r].emplace_back();
+                for(auto ligand: this->ligands)
+                    pyramid_storage[r].back()[ligand.ligandId] = unique_ptr<H5::DataSet>(new H5::DataSet(
+                            StorageHelper::createFrameDataSet(levelGroup, ligand.name, levelRows, levelColumns)));
+            }
+        }
     }
 }
 
-void Environment::save() {
+void Environment::openOutputStorage(H5::Group group) {
+    // Restores the output descriptors from the file, the step counting restarts with the continued simulation
+    unsigned int replicas = getReplicas();
+    outputs = EnvironmentOutputs();
+    regions_storage.clear();
+    pyramid_storage.clear();
+    regions_storage.resize(replicas);
+    pyramid_storage.resize(replicas);
+    for(unsigned int r = 0; r < replicas; r++) {
+        H5::Group replicaGroup = openReplicaGroup(group, r);
+        if(replicaGroup.nameExists("Regions")) {
+            H5::Group regionsGroup = replicaGroup.openGroup("Regions");
+            for(hsize_t i = 0; i < regionsGroup.getNumObjs(); i++) {
+                H5::Group regionGroup = regionsGroup.openGroup(regionsGroup.getObjnameByIdx(i));
+                if(r == 0) {
+                    RegionOutput region;
+                    region.name = regionsGroup.getObjnameByIdx(i);
+                    unsigned int *description[5] = {&region.row, &region.column, &region.rows, &region.columns, &region.step};
+                    const char *names[5] = {"Row", "Column", "Rows", "Columns", "Step"};
+                    for(int j = 0; j < 5; j++)
+                        regionGroup.openAttribute(names[j]).read(H5::PredType::NATIVE_UINT, description[j]);
+                    outputs.regions.push_back(region);
+                }
+                regions_storage[r].emplace_back();
+                for(auto ligand: this->ligands) {
+                    H5::DataSet regionData = regionGroup.openDataSet(ligand.name);
+                    StorageHelper::readFrameLayout(regionData);
+                    regions_storage[r].back()[ligand.ligandId] = unique_ptr<H5::DataSet>(new H5::DataSet(regionData));
+                }
+            }
+        }
+        if(replicaGroup.nameExists("Pyramid")) {
+            H5::Group pyramidGroup = replicaGroup.openGroup("Pyramid");
+            pyramidGroup.openAttribute("Step").read(H5::PredType::NATIVE_UINT, &outputs.pyramid.step);
+            for(hsize_t i = 0; i < pyramidGroup.getNumObjs(); i++) {
+                H5::Group levelGroup = pyramidGroup.openGroup(pyramidGroup.getObjnameByIdx(i));
+                if(r == 0) {
+                    unsigned int factor;
+                    levelGroup.openAttribute("Factor").read(H5::PredType::NATIVE_UINT, &factor);
+                    outputs.pyramid.factors.push_back(factor);
+                }
+                pyramid_storage[r].emplace_back();
+                for(auto ligand: this->ligands) {
+                    H5::DataSet levelData = levelGroup.openDataSet(ligand.name);
+                    StorageHelper::readFrameLayout(levelData);
+                    pyramid_storage[r].back()[ligand.ligandId] = unique_ptr<H5::DataSet>(new H5::DataSet(levelData));
+                }
+            }
+        }
+    }
+}
+
+array Environment::blockSum(const array &field, unsigned int factor) {
+    // Zero padding to full blocks, then summing factor consecutive rows and columns by reshaping (column major)
+    dim4 dims = field.dims();
+    dim_t rows = (dims[0] + factor - 1)/factor, columns = (dims[1] + factor - 1)/factor;
+    dim_t slices = dims[2]*dims[3];
+    array padded = constant(0, rows*factor, columns*factor, dims[2], dims[3], field.type());
+    padded(seq(0, dims[0] - 1), seq(0, dims[1] - 1), span, span) = field;
+    array summed = sum(moddims(padded, factor, rows, columns*factor, slices), 0);
+    summed = sum(moddims(summed, rows, factor, columns, slices), 1);
+    return moddims(summed, rows, columns, dims[2], dims[3]);
+}
+
+void Environment::saveOutputs() {
     if(!this->storage)
         return;
+    unsigned long call = outputCalls++;
+
+    for(size_t i = 0; i < outputs.regions.size(); i++) {
+        RegionOutput &region = outputs.regions[i];
+        if(call % std::max(region.step, 1u) != 0)
+            continue;
+        // Only the region is downloaded
+        for(auto ligand: this->ligands) {
+            unsigned int index = this->hostLigandMapping[ligand.ligandId];
+            for(unsigned int r = 0; r < regions_storage.size(); r++)
+                StorageHelper::appendDataToDataSet<GPU_REALTYPE>(
+                        densities(seq(BORDER_SIZE + region.row, BORDER_SIZE + region.row + region.rows - 1),
+                                  seq(BORDER_SIZE + region.column, BORDER_SIZE + region.column + region.columns - 1), index, r),
+                        *this->regions_storage[r][i][ligand.ligandId], HDF5_GPUTYPE);
+        }
+    }
+
+    if(outputs.pyramid.factors.empty() || call % std::max(outputs.pyramid.step, 1u) != 0)
+        return;
+    array interior = densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span);
+    dim4 dims = interior.dims();
+    array ones = constant(1, dims[0], dims[1], AF_GPUTYPE);
+    for(size_t i = 0; i < outputs.pyramid.factors.size(); i++) {
+        unsigned int factor = outputs.pyramid.factors[i];
+        array level = blockSum(interior, factor)/tile(blockSum(ones, factor), 1, 1, dims[2], dims[3]);
+        level.eval();
+        for(auto ligand: this->ligands) {
+            unsigned int index = this->hostLigandMapping[ligand.ligandId];
+            for(unsigned int r = 0; r < pyramid_storage.size(); r++)
+                StorageHelper::appendDataToDataSet<GPU_REALTYPE>(level(span, span, index, r),
+                                                                 *this->pyramid_storage[r][i][ligand.ligandId], HDF5_GPUTYPE);
+        }
+    }
+}
+
+bool Environment::isSaveDue() {
+    if(isRecomputed())
+        return savedFrames == 0 || skippedSaves + 1 >= settings.recomputeInterval;
+    if(!isAdaptive() || reconstructed.isempty())
+        return true;
+    if(settings.adaptiveSaveMaxInterval > 0 && skippedSaves + 1 >= settings.adaptiveSaveMaxInterval)
+        return true;
+    // The maximum norm of the change is reduced on the device, only a single value is downloaded
+    array interior = densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span);
+    SyncCounter::record("Environment::isSaveDue");
+    return max<double>(abs(interior - reconstructed)) > settings.adaptiveSaveThreshold;
+}
+
+void Environment::save() {
+    save(std::numeric_limits<double>::quiet_NaN());
+}
+
+bool Environment::save(double time) {
+    if(!this->storage)
+        return false;
+    // Recomputed saves are identified by their model timestep
+    if(!deposits_storage.empty())
+        StorageHelper::appendValueToDataSet<unsigned long long>(modelSteps, *deposits_storage["Save steps"], H5::PredType::NATIVE_ULLONG);
+    if(!isSaveDue()) {
+        skippedSaves++;
+        return false;
+    }
+    skippedSaves = 0;
+    if(time_storage)
+        StorageHelper::appendValueToDataSet<double>(time, *time_storage, H5::PredType::NATIVE_DOUBLE);
+    if(!deposits_storage.empty())
+        StorageHelper::appendValueToDataSet<unsigned long long>(modelSteps, *deposits_storage["Keyframe steps"], H5::PredType::NATIVE_ULLONG);
+
+    hsize_t frame = savedFrames++;
+    if(isDeltaEncoded() && frame > 0 && deltasSinceKeyframe + 1 < settings.keyframeInterval) {
+        // Quantize against the reconstruction instead of the last saved field, errors therefore do not accumulate
+        double scale = 2*settings.deltaErrorBound;
+        array interior = densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span);
+        array steps = round((interior - reconstructed)/scale);
+        // Changes beyond the range of the deltas would violate the error bound, such saves are stored as keyframes
+        SyncCounter::record("Environment::save");
+        if(!anyTrue<bool>(abs(steps) > (double)INT32_MAX)) {
+            array deltas = steps.as(s32);
+            reconstructed += deltas.as(AF_GPUTYPE)*scale;
+            eval(deltas, reconstructed);
+            for(auto ligand: this->ligands) {
+                unsigned int index = this->hostLigandMapping[ligand.ligandId];
+                for(unsigned int r = 0; r < deltas_storage.size(); r++)
+                    StorageHelper::appendDataToDataSet<int>(deltas(span, span, index, r),
+                                                            *this->deltas_storage[r][ligand.ligandId], H5::PredType::NATIVE_INT32);
+            }
+            deltasSinceKeyframe++;
+            return true;
+        }
+    }
+    if(keyframe_storage)
+        StorageHelper::appendValueToDataSet<hsize_t>(frame, *keyframe_storage, H5::PredType::NATIVE_HSIZE);
+    deltasSinceKeyframe = 0;
 
-    // TODO: Maybe replace this with one copy operation of complete array and then writing via hyperslap
-    for(auto ligand: this->ligands)
-        StorageHelper::appendDataToDataSet<GPU_REALTYPE>(this->getDensity(ligand.ligandId), *this->ligands_storage[ligand.ligandId], HDF5_GPUTYPE);
+    // Index with the host side mapping, getDensity would synchronize with the device for every ligand
+    for(auto ligand: this->ligands) {
+        unsigned int index = this->hostLigandMapping[ligand.ligandId];
+        for(unsigned int r = 0; r < ligands_storage.size(); r++)
+            StorageHelper::appendDataToDataSet<GPU_REALTYPE>(
+                    densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), index, r),
+                    *this->ligands_storage[r][ligand.ligandId], HDF5_GPUTYPE);
+    }
+    if(isDeltaEncoded() || isAdaptive()) {
+        // Readers see the keyframe in its stored precision, following deltas are relative to that
+        reconstructed = densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span);
+        for(auto ligand: this->ligands) {
+            unsigned int index = this->hostLigandMapping[ligand.ligandId];
+            reconstructed(span, span, index, span) =
+                    StorageHelper::toStoredPrecision(reconstructed(span, span, index, span), ligand.name);
+        }
+        reconstructed.eval();
+    }
+    return true;
 }
 
 void Environment::closeStorage() {
     // Calls destructor which also calls close
+    this->time_storage.reset();
+    this->keyframe_storage.reset();
+    this->deposits_storage.clear();
     this->ligands_storage.clear();
+    this->deltas_storage.clear();
+    this->regions_storage.clear();
+    this->pyramid_storage.clear();
     EnvironmentBase::closeStorage();
 }
 
 void Environment::simulateTimestep(double dt) {
-    applyBoundaryCondition();
-    array changes = convolve(densities, diffusion_filters);
+    Tracer::Scope trace("Environment timestep");
+    {
+        Profiler::Scope timer("Boundary conditions");
+        applyBoundaryCondition();
+    }
+    array changes;
+    if(getReplicas() > 1)
+        // Batched 2D convolution of every ligand slice of every replica with the filter of its ligand
+        changes = convolve2(densities, tile(diffusion_filters, 1, 1, 1, densities.dims(3)));
+    else
+        changes = convolve(densities, diffusion_filters);
     for (size_t i = 0; i < densities.dims(2); i++) {
-        changes(span, span, i) += ligands[i].globalProductionRate - ligands[i].globalDegradationRate*densities(span, span, i);
+        changes(span, span, i, span) += ligands[i].globalProductionRate - ligands[i].globalDegradationRate*densities(span, span, i, span);
     }
 
     densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span) +=
             changes(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span)*dt;
 
+    Profiler::countEvaluations();
+    eval(densities);
+}
+
+void Environment::simulateSubsteps(double modelDt, double envDt) {
+    Profiler::Scope timer("Environment substeps");
+    double ddt;
+    for(ddt = 0; ddt < modelDt; ddt += envDt)
+        simulateTimestep(envDt);
+
+    // Simulate leftover time
+    simulateTimestep(modelDt - (ddt-envDt));
+}
+
+void Environment::simulateModelStep(double modelDt, double envDt) {
+    beginModelStep();
+    diffuseModelStep(modelDt, envDt);
+}
+
+void Environment::beginModelStep() {
+    modelSteps++;
+    if(!deposits_storage.empty())
+        logDeposits();
+}
+
+void Environment::freezeDensities() {
+    // Shares the buffer, the next change of the densities copies it
+    frozenDensities = densities;
+}
+
+void Environment::diffuseModelStep(double modelDt, double envDt) {
+    simulateSubsteps(modelDt, envDt);
+    if(!deposits_storage.empty()) {
+        depositReference = densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span);
+        depositReference.eval();
+    }
+}
+
+void Environment::logDeposits() {
+    // Everything that changed the densities since the last diffusion, compacted on the device
+    array interior = densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span);
+    dim4 dims = interior.dims();
+    array deposit = flat(interior - depositReference);
+    array index = where(deposit != 0);
+    SyncCounter::record("Environment::logDeposits");
+    StorageHelper::appendValueToDataSet<unsigned long long>(depositRows, *deposits_storage["Step offsets"], H5::PredType::NATIVE_ULLONG);
+    StorageHelper::appendValueToDataSet<unsigned long long>(modelSteps, *deposits_storage["Steps"], H5::PredType::NATIVE_ULLONG);
+    depositRows += index.elements();
+    if(index.isempty())
+        return;
+
+    // Ligands are stored by id, the internal order is not preserved by a restart
+    unsigned int cells = dims[0]*dims[1];
+    array ligand = (index/cells) % (unsigned int)dims[2];
+    array cell = index % cells + cells*(index/(cells*(unsigned int)dims[2]));
+    array ligandIds = ligandMapping(ligand, LIGANDID).as(u32);
+    StorageHelper::appendRaggedDataToDataSet<unsigned int>(cell.as(u32), *deposits_storage["cell"], H5::PredType::NATIVE_UINT);
+    StorageHelper::appendRaggedDataToDataSet<unsigned int>(ligandIds, *deposits_storage["ligand"], H5::PredType::NATIVE_UINT);
+    StorageHelper::appendRaggedDataToDataSet<GPU_REALTYPE>(deposit(index), *deposits_storage["value"], HDF5_GPUTYPE);
+}
+
+void Environment::applyDeposits(H5::Group deposits, hsize_t firstRow, hsize_t rows) {
+    if(rows == 0)
+        return;
+    std::vector<unsigned int> cell = readRows<unsigned int>(deposits.openDataSet("cell"), H5::PredType::NATIVE_UINT, firstRow, rows);
+    std::vector<unsigned int> ligand = readRows<unsigned int>(deposits.openDataSet("ligand"), H5::PredType::NATIVE_UINT, firstRow, rows);
+    std::vector<GPU_REALTYPE> value = readRows<GPU_REALTYPE>(deposits.openDataSet("value"), HDF5_GPUTYPE, firstRow, rows);
+
+    dim4 dims = densities.dims();
+    unsigned int cells = (dims[0] - 2*BORDER_SIZE)*(dims[1] - 2*BORDER_SIZE);
+    unsigned int nLigands = dims[2];
+    std::vector<unsigned int> index(rows);
+    for(hsize_t i = 0; i < rows; i++)
+        index[i] = cell[i] % cells + cells*(this->hostLigandMapping[ligand[i]] + nLigands*(cell[i]/cells));
+
+    // Every element is deposited at most once per timestep
+    array interior = flat(densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span));
+    interior(array(rows, index.data())) += array(rows, value.data());
+    densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span) =
+            moddims(interior, dims[0] - 2*BORDER_SIZE, dims[1] - 2*BORDER_SIZE, dims[2], dims[3]);
+    eval(densities);
+}
+
+void Environment::replayDeposits(H5::Group environment, unsigned long long step, double modelDt, double envDt) {
+    H5::Group deposits = environment.openGroup("Deposits");
+    std::vector<unsigned long long> steps = readSteps(deposits, "Steps");
+    std::vector<unsigned long long> offsets = readSteps(deposits, "Step offsets");
+    hsize_t rows = deposits.openDataSet("cell").getSpace().getSimpleExtentNpoints();
+    auto next = std::upper_bound(steps.begin(), steps.end(), modelSteps);
+    for(size_t i = next - steps.begin(); i < steps.size() && modelSteps < step; i++) {
+        if(steps[i] != modelSteps + 1)
+            throw H5::Exception("Environment", "The deposits of a timestep were not logged");
+        applyDeposits(deposits, offsets[i], (i + 1 < steps.size() ? offsets[i + 1] : rows) - offsets[i]);
+        simulateSubsteps(modelDt, envDt);
+        modelSteps++;
+    }
+    if(modelSteps < step)
+        throw H5::Exception("Environment", "The deposits of a timestep were not logged");
+}
+
+void Environment::loadSavedFrame(H5::Group environment, hsize_t frame) {
+    dim4 dims = densities.dims();
+    for(unsigned int r = 0; r < getReplicas(); r++)
+        for(auto ligand: this->ligands) {
+            std::vector<double> values = readSavedFrame(environment, ligand.name, frame, r);
+            densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), this->hostLigandMapping[ligand.ligandId], r) =
+                    array(dims[1] - 2*BORDER_SIZE, dims[0] - 2*BORDER_SIZE, values.data()).T().as(AF_GPUTYPE);
+        }
     eval(densities);
 }
 
+void Environment::resumeFromDeposits(double modelDt, double envDt) {
+    if(deposits_storage.empty())
+        return;
+    H5::Group deposits = this->storage->openGroup("Deposits");
+    std::vector<unsigned long long> saveSteps = readSteps(deposits, "Save steps");
+    if(saveSteps.empty())
+        return;
+    replayDeposits(*this->storage, saveSteps.back(), modelDt, envDt);
+
+    // Deposits logged after the last save are repeated by the continued simulation
+    std::vector<unsigned long long> steps = readSteps(deposits, "Steps");
+    std::vector<unsigned long long> offsets = readSteps(deposits, "Step offsets");
+    hsize_t kept = std::upper_bound(steps.begin(), steps.end(), saveSteps.back()) - steps.begin();
+    if(kept < steps.size()) {
+        depositRows = offsets[kept];
+        deposits_storage["Steps"]->extend(&kept);
+        deposits_storage["Step offsets"]->extend(&kept);
+        for(std::string name: {"cell", "ligand", "value"})
+            deposits_storage[name]->extend(&depositRows);
+    }
+    depositReference = densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), span, span);
+    depositReference.eval();
+}
+
+void Environment::recompute(H5::Group environment, H5::Group output, double modelDt, double envDt,
+                            unsigned long long firstStep, unsigned long long lastStep) {
+    Environment env(environment);
+    if(env.deposits_storage.empty())
+        throw H5::Exception("Environment", "The environment was not saved for recompute on demand");
+    H5::Group deposits = environment.openGroup("Deposits");
+    std::vector<unsigned long long> saveSteps = readSteps(deposits, "Save steps");
+    std::vector<unsigned long long> keyframeSteps = readSteps(deposits, "Keyframe steps");
+
+    // Full fields of every replica and ligand, laid out like the keyframes
+    dim4 dims = env.densities.dims();
+    hsize_t rows = dims[0] - 2*BORDER_SIZE, columns = dims[1] - 2*BORDER_SIZE;
+    unsigned int replicas = env.getReplicas();
+    if(replicas > 1)
+        output.createAttribute("Replicas", H5::PredType::STD_U32LE, StorageHelper::H5Scalar)
+                .write(H5::PredType::NATIVE_UINT, &replicas);
+    std::vector<std::map<unsigned int, unique_ptr<H5::DataSet>>> frames(replicas);
+    for(unsigned int r = 0; r < replicas; r++) {
+        H5::Group replicaGroup = replicas > 1 ? output.createGroup(getReplicaGroupName(r)) : output;
+        for(auto ligand: env.ligands) {
+            H5::DataSet frameData = StorageHelper::createFrameDataSet(replicaGroup, ligand.name, rows, columns);
+            frameData.createAttribute("Name", StorageHelper::H5VariableString, StorageHelper::H5Scalar)
+                    .write(StorageHelper::H5VariableString, ligand.name);
+            frameData.createAttribute("Properties", Ligand::getH5SaveType(), StorageHelper::H5Scalar)
+                    .write(Ligand::getH5ReadType(), &ligand);
+            frames[r][ligand.ligandId] = unique_ptr<H5::DataSet>(new H5::DataSet(frameData));
+        }
+    }
+    hsize_t initDims = 0, maxDims = H5S_UNLIMITED, chunk = 64;
+    H5::DSetCreatPropList stepProperties;
+    stepProperties.setChunk(1, &chunk);
+    H5::DataSet stepStorage = output.createGroup("Frames").createDataSet(
+            "Step", H5::PredType::STD_U64LE, H5::DataSpace(1, &initDims, &maxDims), stepProperties);
+
+    bool loaded = false;
+    for(auto step: saveSteps) {
+        if(step < firstStep || step > lastStep)
+            continue;
+        auto keyframe = std::upper_bound(keyframeSteps.begin(), keyframeSteps.end(), step);
+        if(keyframe == keyframeSteps.begin())
+            throw H5::Exception("Environment", "There is no keyframe before a requested save");
+        keyframe--;
+        // Saves are visited in order, the re-simulation only restarts from a keyframe that lies ahead of it
+        if(!loaded || env.modelSteps > step || *keyframe > env.modelSteps) {
+            env.loadSavedFrame(environment, keyframe - keyframeSteps.begin());
+            env.modelSteps = *keyframe;
+            loaded = true;
+        }
+        env.replayDeposits(environment, step, modelDt, envDt);
+        for(auto ligand: env.ligands) {
+            unsigned int index = env.hostLigandMapping[ligand.ligandId];
+            for(unsigned int r = 0; r < replicas; r++)
+                StorageHelper::appendDataToDataSet<GPU_REALTYPE>(
+                        env.densities(seq(BORDER_SIZE, end-BORDER_SIZE), seq(BORDER_SIZE, end-BORDER_SIZE), index, r),
+                        *frames[r][ligand.ligandId], HDF5_GPUTYPE);
+        }
+        StorageHelper::appendValueToDataSet<unsigned long long>(step, stepStorage, H5::PredType::NATIVE_ULLONG);
+    }
+}
+
 double Environment::getStabledt() {
     double largest_D = 0;
     double largest_kd = 0;
@@ -20,6 +20,24 @@
 #define W_BOTTOMLEFT 2
 #define W_BOTTOMRIGHT 3
 
+// Rectangular part of the interior grid saved at full resolution, in grid points along y (rows) and x (columns)
+struct RegionOutput {
+    std::string name;
+    unsigned int row, column, rows, columns;
+    // Saved every step-th call of Environment::saveOutputs, independent of the save step of the full fields
+    unsigned int step = 1;
+};
+
+// Block averages of the interior grid, one dataset per downsampling factor (e.g. 2, 4 and 8)
+struct PyramidOutput {
+    std::vector<unsigned int> factors;
+    unsigned int step = 1;
+};
+
+struct EnvironmentOutputs {
+    std::vector<RegionOutput> regions;
+    PyramidOutput pyramid;
+};
 
 class Environment : public EnvironmentBase {
     void init();
@@ -35,10 +53,59 @@ class Environment : public EnvironmentBase {
 
     array get_concentrations(array &indexes, array &ligands);
 
-    std::map<unsigned int, unique_ptr<H5::DataSet>> ligands_storage;
+    // One map of ligand datasets per replica
+    std::vector<std::map<unsigned int, unique_ptr<H5::DataSet>>> ligands_storage;
+    // Quantized changes between keyframes, only used with delta encoding
+    std::vector<std::map<unsigned int, unique_ptr<H5::DataSet>>> deltas_storage;
+    // Interior densities as reconstructed by a reader from the saved frames, the reference for the next delta and for
+    // the change measured by the adaptive save cadence
+    array reconstructed;
+    hsize_t savedFrames = 0;
+    unsigned int deltasSinceKeyframe = 0;
+    // Frame index of every keyframe, saves whose change exceeds the range of the deltas are stored as keyframes
+    unique_ptr<H5::DataSet> keyframe_storage;
+    static std::vector<hsize_t> readKeyframes(H5::Group environment, hsize_t frames);
+    bool isDeltaEncoded() { return settings.keyframeInterval > 1; }
+    bool isAdaptive() { return settings.adaptiveSaveThreshold > 0; }
+    // Saves skipped since the last stored frame
+    unsigned int skippedSaves = 0;
+    // Model time of every stored frame
+    unique_ptr<H5::DataSet> time_storage;
+    bool isSaveDue();
+
+    // Recompute on demand, deposits are stored as ragged rows (cell, ligand id, value) of the group "Deposits"
+    bool isRecomputed() { return settings.recomputeInterval > 0; }
+    std::map<std::string, unique_ptr<H5::DataSet>> deposits_storage;
+    // Interior densities after the diffusion of the last model timestep
+    array depositReference;
+    // Model timesteps simulated since the storage was set up, deposits and saves are numbered by them
+    unsigned long long modelSteps = 0;
+    hsize_t depositRows = 0;
+    void setupDepositStorage();
+    void openDepositStorage(H5::Group deposits);
+    void logDeposits();
+    void applyDeposits(H5::Group deposits, hsize_t firstRow, hsize_t rows);
+    void simulateSubsteps(double modelDt, double envDt);
+    // Re-simulates the model timesteps after the current one up to step from the deposits of environment
+    void replayDeposits(H5::Group environment, unsigned long long step, double modelDt, double envDt);
+    void loadSavedFrame(H5::Group environment, hsize_t frame);
+    static H5::Group openReplicaGroup(H5::Group environment, unsigned int replica);
+
+    // Reduced outputs, datasets are indexed by replica, region or pyramid level and ligand id
+    EnvironmentOutputs outputs;
+    unsigned long outputCalls = 0;
+    std::vector<std::vector<std::map<unsigned int, unique_ptr<H5::DataSet>>>> regions_storage;
+    std::vector<std::vector<std::map<unsigned int, unique_ptr<H5::DataSet>>>> pyramid_storage;
+    void setupOutputStorage();
+    void openOutputStorage(H5::Group group);
+    static array blockSum(const array &field, unsigned int factor);
 
     CoordinateIndexer densityIndexer;
 
+    // Densities read by populations while the diffusion runs concurrently, empty unless frozen
+    array frozenDensities;
+    array getReadableDensities() { return frozenDensities.isempty() ? densities : frozenDensities; }
+
 public:
     Environment(EnvironmentSettings settings);
     array getAllDensities() override;
@@ -48,20 +115,66 @@ public:
     virtual double getStabledt() override;
 
     void setInterpolatedPositions(array &xpos, array &ypos, array &pos, array &weights);
+    void setInterpolatedPositions(array &xpos, array &ypos, array &pos, array &weights, array &replicas);
 
     virtual void changeLigandConcentrationBy(array concDifferences, array positions, array weights, array ligands);
+    void changeLigandConcentrationBy(array concDifferences, array positions, array weights, array ligands, array agentWeights);
 
     virtual array getLigandConcentrations(array positions, array weights, array ligands);
 
+    array getLigandGradients(array positions, array ligands);
+
+    virtual void changeLigandFieldBy(array fieldChanges, std::vector<unsigned int> ligandIds);
+
     virtual void simulateTimestep(double dt) override;
+    // Sets the border of the densities from the boundary condition, done by simulateTimestep before every step
+    void applyBoundaryConditions() { applyBoundaryCondition(); }
+    // Simulates a model timestep of length modelDt in substeps of envDt. With recompute on demand, the changes made to
+    // the densities since the previous model timestep are logged first.
+    void simulateModelStep(double modelDt, double envDt);
+    // simulateModelStep in two parts for callers that run other work during the diffusion. Only beginModelStep uses
+    // the storage.
+    void beginModelStep();
+    void diffuseModelStep(double modelDt, double envDt);
+    // Until releaseDensities, all reads of the densities (concentrations, gradients, getAllDensities) see the current
+    // densities and may be issued from another thread while simulateTimestep changes them
+    void freezeDensities();
+    void releaseDensities() { frozenDensities = array(); }
 
     virtual void closeStorage() override;
 
     virtual void setupStorage(unique_ptr<H5::Group> storage) override;
+    void setupStorage(unique_ptr<H5::Group> storage, EnvironmentOutputs outputs);
+    // Regions and pyramid levels created by the next setupStorage
+    void setOutputs(EnvironmentOutputs outputs) { this->outputs = outputs; }
+    EnvironmentOutputs getOutputs() { return outputs; }
 
+    // Stores the densities without a model time, the time of the frame is NaN
     virtual void save() override;
+    // Stores the densities of model time time, with an adaptive cadence only if they changed enough. Returns whether
+    // a frame was stored.
+    bool save(double time);
+    // Saves the regions and pyramid levels that are due, to be called once per simulation step
+    void saveOutputs();
 
     Environment(H5::Group group);
+    Environment(const Checkpoint &checkpoint, std::string prefix);
+
+    // Reader side reconstruction of saved densities, independent of the output mode. Frames are returned on the host
+    // in row major (y, x) order.
+    static hsize_t getSavedFrameCount(H5::Group environment, std::string ligandName, unsigned int replica = 0);
+    static std::vector<double> readSavedFrame(H5::Group environment, std::string ligandName, hsize_t frame,
+                                              unsigned int replica = 0);
+    // Name of the group of a replica, replicas are stored in their own groups if the "Replicas" attribute exists
+    static std::string getReplicaGroupName(unsigned int replica);
+
+    // Recompute on demand: continues a restarted environment at the last save of the model instead of its last keyframe
+    void resumeFromDeposits(double modelDt, double envDt);
+    // Writes the densities of every save between firstStep and lastStep (model timesteps) of a recomputed environment
+    // into output, re-simulated from the closest keyframe and the logged deposits. The output is laid out like an
+    // environment group, "Frames/Step" holds the model timestep of every frame.
+    static void recompute(H5::Group environment, H5::Group output, double modelDt, double envDt,
+                          unsigned long long firstStep = 0, unsigned long long lastStep = ~0ull);
 };
 
 #endif //CHEMOHYBRID_GPU_ENVIRONMENT2D_H
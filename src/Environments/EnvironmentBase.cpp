@@ -17,6 +17,23 @@ EnvironmentBase::EnvironmentBase(H5::Group group) {
     group.openAttribute("Resolution").read(H5::PredType::NATIVE_DOUBLE, &envSettings.resolution);
     group.openAttribute("Boundary condition").read(BoundaryCondition::getH5ReadType(), &envSettings.boundaryCondition);
 
+    // Replicated environments store the ligands of every replica in its own group
+    H5::Group ligandGroup = group;
+    if(group.attrExists("Replicas")) {
+        group.openAttribute("Replicas").read(H5::PredType::NATIVE_UINT, &envSettings.replicas);
+        ligandGroup = group.openGroup("Replica 0");
+    }
+    if(group.attrExists("Keyframe interval")) {
+        group.openAttribute("Keyframe interval").read(H5::PredType::NATIVE_UINT, &envSettings.keyframeInterval);
+        group.openAttribute("Delta error bound").read(H5::PredType::NATIVE_DOUBLE, &envSettings.deltaErrorBound);
+    }
+    if(group.attrExists("Adaptive save threshold")) {
+        group.openAttribute("Adaptive save threshold").read(H5::PredType::NATIVE_DOUBLE, &envSettings.adaptiveSaveThreshold);
+        group.openAttribute("Adaptive save max interval").read(H5::PredType::NATIVE_UINT, &envSettings.adaptiveSaveMaxInterval);
+    }
+    if(group.attrExists("Recompute interval"))
+        group.openAttribute("Recompute interval").read(H5::PredType::NATIVE_UINT, &envSettings.recomputeInterval);
+
     // Get original dimensions
     H5::Attribute dimsAttr = group.openAttribute("Dimensions");
     hsize_t ndim = 0;
@@ -26,11 +43,14 @@ EnvironmentBase::EnvironmentBase(H5::Group group) {
     dimsAttr.read(H5::PredType::NATIVE_DOUBLE, envSettings.dimensions.data());
 
     // Get ligand properties
-    int nLigands = group.getNumObjs();
-    envSettings.ligands.reserve(nLigands);
-    for(int i = 0; i < nLigands; i++) {
-        std::string name = group.getObjnameByIdx(i);
-        H5::DataSet ligandData = group.openDataSet(name);
+    int nObjects = ligandGroup.getNumObjs();
+    envSettings.ligands.reserve(nObjects);
+    for(int i = 0; i < nObjects; i++) {
+        // Only datasets describe ligands
+        if(ligandGroup.childObjType(i) != H5O_TYPE_DATASET)
+            continue;
+        std::string name = ligandGroup.getObjnameByIdx(i);
+        H5::DataSet ligandData = ligandGroup.openDataSet(name);
         Ligand lig;
         ligandData.openAttribute("Name").read(varstrtype, lig.name);
         ligandData.openAttribute("Properties").read(Ligand::getH5ReadType(), &lig);
@@ -51,17 +71,19 @@ void EnvironmentBase::setupVisualizationWindow(Window &win) {
     }
 }
 
-void EnvironmentBase::visualize(double normalizer) {
+void EnvironmentBase::visualize(array normalizer) {
     if(numLigands > 1) {
         for(size_t i = 0; i < rows; i++) {
             for (size_t j = 0; j < 2 && 2*i + j < numLigands; j++) {
-                array ligandDensity = this->getDensity(this->ligands[2*i + j].ligandId);
-                visualizationWin->operator()(i, j).image((ligandDensity/normalizer).as(af::dtype::f32), this->ligands[2*i + j].name.c_str());
+                // Only the first replica is shown
+                array ligandDensity = this->getDensity(this->ligands[2*i + j].ligandId)(span, span, 0, 0);
+                visualizationWin->operator()(i, j).image((ligandDensity/tile(normalizer, ligandDensity.dims())).as(af::dtype::f32), this->ligands[2*i + j].name.c_str());
             }
         }
+    } else {
+        array density = densities(span, span, 0, 0);
+        visualizationWin->image((density/tile(normalizer, density.dims())).as(af::dtype::f32), this->ligands[0].name.c_str());
     }
-    else
-        visualizationWin->image((densities/normalizer).as(af::dtype::f32), this->ligands[0].name.c_str());
 
     visualizationWin->show();
 }
@@ -77,6 +99,14 @@ array EnvironmentBase::getLigandMapping(std::vector<int> ligandIds) {
 
 }
 
+unsigned int EnvironmentBase::getInternalLigandIndex(unsigned int ligandId) {
+    // Host side lookup, does not require any synchronisation with the device
+    auto it = hostLigandMapping.find(ligandId);
+    if(it == hostLigandMapping.end())
+        throw exception("Could not find provided ligandId in Environment.");
+    return it->second;
+}
+
 void EnvironmentBase::init(EnvironmentSettings settings) {
     this->settings = settings;
     this->ligands = settings.ligands;
@@ -84,7 +114,7 @@ void EnvironmentBase::init(EnvironmentSettings settings) {
     this->resolution = settings.resolution;
     this->boundaryCondition = settings.boundaryCondition;
 
-    std::vector<dim_t> internalDim(settings.dimensions.size() + 1);
+    std::vector<dim_t> internalDim(settings.dimensions.size() + 2);
 
     // Calculate dimensions of internal representations
     for (auto i = 0; i < settings.dimensions.size(); i++) {
@@ -93,8 +123,9 @@ void EnvironmentBase::init(EnvironmentSettings settings) {
         internalDim[settings.dimensions.size() - i - 1] = (dim_t) 2 * BORDER_SIZE + ceil(settings.dimensions[i]/settings.resolution);
     }
 
-    // Last dimension is the number of ligands
-    internalDim[internalDim.size() - 1] = settings.ligands.size();
+    // Followed by the number of ligands and the number of replicas
+    internalDim[internalDim.size() - 2] = settings.ligands.size();
+    internalDim[internalDim.size() - 1] = settings.replicas;
 
     this->internal_dimensions = af::dim4(internalDim.size(), internalDim.data());
 
@@ -127,6 +158,78 @@ void EnvironmentBase::setupStorage(unique_ptr<H5::Group> storage) {
     H5::DataSpace dimSpace(1, &ndims);
     this->storage->createAttribute("Dimensions", H5::PredType::IEEE_F64LE, dimSpace)
             .write(H5::PredType::NATIVE_DOUBLE, this->settings.dimensions.data());
+    if(this->settings.replicas > 1)
+        this->storage->createAttribute("Replicas", H5::PredType::STD_U32LE, scalar)
+                .write(H5::PredType::NATIVE_UINT, &this->settings.replicas);
+    if(this->settings.keyframeInterval > 1) {
+        this->storage->createAttribute("Keyframe interval", H5::PredType::STD_U32LE, scalar)
+                .write(H5::PredType::NATIVE_UINT, &this->settings.keyframeInterval);
+        this->storage->createAttribute("Delta error bound", H5::PredType::IEEE_F64LE, scalar)
+                .write(H5::PredType::NATIVE_DOUBLE, &this->settings.deltaErrorBound);
+    }
+    if(this->settings.adaptiveSaveThreshold > 0) {
+        this->storage->createAttribute("Adaptive save threshold", H5::PredType::IEEE_F64LE, scalar)
+                .write(H5::PredType::NATIVE_DOUBLE, &this->settings.adaptiveSaveThreshold);
+        this->storage->createAttribute("Adaptive save max interval", H5::PredType::STD_U32LE, scalar)
+                .write(H5::PredType::NATIVE_UINT, &this->settings.adaptiveSaveMaxInterval);
+    }
+    if(this->settings.recomputeInterval > 0)
+        this->storage->createAttribute("Recompute interval", H5::PredType::STD_U32LE, scalar)
+                .write(H5::PredType::NATIVE_UINT, &this->settings.recomputeInterval);
+}
+
+void EnvironmentBase::writeCheckpoint(Checkpoint &checkpoint, std::string prefix) {
+    checkpoint.setValue(prefix + "Resolution", resolution);
+    checkpoint.setValues(prefix + "Dimensions", settings.dimensions);
+    checkpoint.setValues(prefix + "Boundary condition", {(double)boundaryCondition.type, boundaryCondition.xneg,
+            boundaryCondition.xpos, boundaryCondition.yneg, boundaryCondition.ypos, boundaryCondition.zneg, boundaryCondition.zpos});
+    checkpoint.setValue(prefix + "Replicas", settings.replicas);
+    checkpoint.setValue(prefix + "Keyframe interval", settings.keyframeInterval);
+    checkpoint.setValue(prefix + "Delta error bound", settings.deltaErrorBound);
+    checkpoint.setValue(prefix + "Adaptive save threshold", settings.adaptiveSaveThreshold);
+    checkpoint.setValue(prefix + "Adaptive save max interval", settings.adaptiveSaveMaxInterval);
+    checkpoint.setValue(prefix + "Recompute interval", settings.recomputeInterval);
+    for(size_t i = 0; i < ligands.size(); i++) {
+        std::string ligandPrefix = prefix + "Ligands/" + std::to_string(i) + "/";
+        checkpoint.setString(ligandPrefix + "Name", ligands[i].name);
+        checkpoint.setValues(ligandPrefix + "Properties", {(double)ligands[i].ligandId, ligands[i].initialConcentration,
+                ligands[i].globalProductionRate, ligands[i].globalDegradationRate, ligands[i].diffusionCoefficient});
+    }
+    // Including the border, the boundary condition is applied before it is read
+    checkpoint.setArray(prefix + "Densities", densities);
+}
+
+EnvironmentSettings EnvironmentBase::readCheckpointSettings(const Checkpoint &checkpoint, std::string prefix) {
+    EnvironmentSettings envSettings;
+    envSettings.resolution = checkpoint.getValue(prefix + "Resolution");
+    envSettings.dimensions = checkpoint.getValues(prefix + "Dimensions");
+    std::vector<double> bc = checkpoint.getValues(prefix + "Boundary condition");
+    envSettings.boundaryCondition = BoundaryCondition((BoundaryConditionType)(int)bc[0], bc[2], bc[1], bc[4], bc[3], bc[6], bc[5]);
+    envSettings.replicas = (unsigned int)checkpoint.getValue(prefix + "Replicas");
+    envSettings.keyframeInterval = (unsigned int)checkpoint.getValue(prefix + "Keyframe interval");
+    envSettings.deltaErrorBound = checkpoint.getValue(prefix + "Delta error bound");
+    if(checkpoint.has(prefix + "Adaptive save threshold")) {
+        envSettings.adaptiveSaveThreshold = checkpoint.getValue(prefix + "Adaptive save threshold");
+        envSettings.adaptiveSaveMaxInterval = (unsigned int)checkpoint.getValue(prefix + "Adaptive save max interval");
+    }
+    if(checkpoint.has(prefix + "Recompute interval"))
+        envSettings.recomputeInterval = (unsigned int)checkpoint.getValue(prefix + "Recompute interval");
+
+    // Ligands are numbered in their internal order
+    size_t nLigands = checkpoint.getChildren(prefix + "Ligands").size();
+    for(size_t i = 0; i < nLigands; i++) {
+        std::string ligandPrefix = prefix + "Ligands/" + std::to_string(i) + "/";
+        std::vector<double> properties = checkpoint.getValues(ligandPrefix + "Properties");
+        Ligand ligand;
+        ligand.name = checkpoint.getString(ligandPrefix + "Name");
+        ligand.ligandId = (unsigned int)properties[0];
+        ligand.initialConcentration = properties[1];
+        ligand.globalProductionRate = properties[2];
+        ligand.globalDegradationRate = properties[3];
+        ligand.diffusionCoefficient = properties[4];
+        envSettings.ligands.push_back(ligand);
+    }
+    return envSettings;
 }
 
 void EnvironmentBase::closeStorage() {
@@ -21,6 +21,7 @@
 #include <General/Ligand.h>
 #include "Solvers/Solver.h"
 #include "BoundaryCondition.h"
+#include "General/Checkpoint.h"
 
 using namespace af;
 using std::unique_ptr;
@@ -35,6 +36,26 @@ struct EnvironmentSettings {
 
     // Definition of ligands
     std::vector<Ligand> ligands;
+
+    // Number of independent replicas simulated side by side, stored along the last dimension of the densities
+    unsigned int replicas = 1;
+
+    // Temporal delta encoding of the saved densities: every keyframeInterval-th save stores the full field, the saves
+    // in between only the change since the previous save, quantized with an absolute error of at most deltaErrorBound.
+    // A change too large for the 32 bit deltas starts a new keyframe early. An interval of 1 stores every save in full.
+    unsigned int keyframeInterval = 1;
+    double deltaErrorBound = 0;
+
+    // Adaptive save cadence: a save only stores the densities if the largest absolute change of a grid point since the
+    // last stored frame exceeds adaptiveSaveThreshold, and at least every adaptiveSaveMaxInterval-th save (0 for no
+    // limit). A threshold of 0 stores every save. The model time of every stored frame is kept in "Frames/Time".
+    double adaptiveSaveThreshold = 0;
+    unsigned int adaptiveSaveMaxInterval = 0;
+
+    // Recompute on demand: only every recomputeInterval-th save stores the densities as a keyframe, the changes made to
+    // the densities between the diffusion of two model timesteps (uptake and production of bacteria, changed fields)
+    // are logged as sparse deposits instead. Environment::recompute re-simulates the saves in between. 0 disables it.
+    unsigned int recomputeInterval = 0;
 };
 
 
@@ -70,17 +91,25 @@ public:
     virtual double getStabledt() = 0;
     virtual void simulateTimestep(double dt) = 0;
 #ifndef NO_GRAPHICS
-    void visualize(double normalizer);
+    // normalizer is a single element array, it stays on the device
+    void visualize(array normalizer);
 #endif
     virtual std::vector<double> getSize() = 0;
     virtual array getDensity(int) = 0;
     virtual array getAllDensities() = 0;
     array getLigandMapping(std::vector<int> ligands);
+    unsigned int getInternalLigandIndex(unsigned int ligandId);
     void setupVisualizationWindow(Window &win);
     virtual BoundaryConditionType getBoundaryConditionType() { return boundaryCondition.type; }
+    unsigned int getReplicas() { return settings.replicas; }
+    const std::vector<Ligand> &getLigands() { return ligands; }
     virtual void save() = 0;
     virtual void setupStorage(unique_ptr<H5::Group> unique_ptr);
     virtual void closeStorage();
+
+    // Settings and densities for restarts, entries are named below prefix
+    virtual void writeCheckpoint(Checkpoint &checkpoint, std::string prefix);
+    static EnvironmentSettings readCheckpointSettings(const Checkpoint &checkpoint, std::string prefix);
 };
 
 #endif //PROJECT_NAME_ENVIRONMENT_H
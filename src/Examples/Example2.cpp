@@ -13,13 +13,18 @@ public:
     }
 
     ExamplePopulation(shared_ptr<Environment> Env, H5::Group group) : SimplePopulation(Env, group) {
-        auto newParameter = group.openDataSet("newParameter");
-        theNewParameter = StorageHelper::loadLastDataToGpu<int>(newParameter, H5::PredType::NATIVE_INT, af::dtype::s32);
+        auto newParameter = group.openDataSet("newParameter", this->storageAccess);
+        theNewParameter = loadPopulationData<int>(newParameter, H5::PredType::NATIVE_INT, af::dtype::s32);
+    }
+
+    ExamplePopulation(shared_ptr<Environment> Env, const Checkpoint &checkpoint, std::string prefix) :
+            SimplePopulation(Env, checkpoint, prefix) {
+        restoreArrays(checkpoint, prefix, getCheckpointArrays(), SimplePopulation::getCheckpointArrays().size());
     }
 
     void setupStorage(H5::Group storage) override {
         SimplePopulation::setupStorage(storage);
-        newStorage.reset(new H5::DataSet(this->storage->createDataSet("newParameter", H5::PredType::INTEL_I32, this->storageSpace, this->storageProperties)));
+        newStorage.reset(new H5::DataSet(this->storage->createDataSet("newParameter", H5::PredType::INTEL_I32, this->storageSpace, this->storageProperties, this->storageAccess)));
     }
 
     void closeStorage() override {
@@ -29,7 +34,21 @@ public:
 
     bool save() override {
         if(SimplePopulation::save())
-            StorageHelper::appendDataToDataSet<int>(theNewParameter, *newStorage, H5::PredType::NATIVE_INT);
+            appendPopulationData<int>(theNewParameter, *newStorage, H5::PredType::NATIVE_INT);
+    }
+
+    // Per bacterium arrays have to be registered so they follow divisions, deaths and compaction
+    std::vector<array *> getPerBacteriumArrays() override {
+        std::vector<array *> arrays = SimplePopulation::getPerBacteriumArrays();
+        arrays.push_back(&theNewParameter);
+        return arrays;
+    }
+
+    // Arrays listed here are saved in checkpoints
+    std::vector<std::pair<std::string, array *>> getCheckpointArrays() override {
+        std::vector<std::pair<std::string, array *>> arrays = SimplePopulation::getCheckpointArrays();
+        arrays.push_back(std::make_pair(std::string("newParameter"), &theNewParameter));
+        return arrays;
     }
 
     REGISTER_DEC_TYPE(ExamplePopulation);
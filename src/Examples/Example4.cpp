@@ -41,6 +41,9 @@ int main(int argc, char** argv)
     EnvironmentSettings ESettings;
     ESettings.resolution = 1;
     ESettings.dimensions = std::vector<double> {1000, 1000};
+    // Optionally simulate several independent replicas of the scenario at once
+    if(argc > 1)
+        ESettings.replicas = std::max(atoi(argv[1]), 1);
 
     BoundaryCondition boundaryCondition(BC_PERIODIC);
     boundaryCondition.xpos = 0;
@@ -67,6 +70,17 @@ int main(int argc, char** argv)
     Matthaeus2009Parameters bactParams = {BactSolver, ligandInteractions1, 30};
     populations.push_back(shared_ptr<BacterialPopulation>(static_cast<BacterialPopulation *>(new Matthaeus2009Population("Population 1", simEnv, bactParams, 5000))));
 
+    // Compress the large environment frames in 250x250 chunks, the concentrations are stored with an absolute error
+    // of at most 1e-6 and all other fields in the simulation precision
+    StorageSettings storageSettings;
+    storageSettings.deflateLevel = 4;
+    storageSettings.chunkRows = 250;
+    storageSettings.chunkColumns = 250;
+    storageSettings.defaultStorage.precision = PRECISION_NATIVE;
+    storageSettings.fieldStorage["Attractor"].precision = PRECISION_QUANTIZED;
+    storageSettings.fieldStorage["Attractor"].errorBound = 1e-6;
+    StorageHelper::setStorageSettings(storageSettings);
+
     // Setup model
     Model2D mymodel(simEnv, populations, bactdt);
     mymodel.setupStorage("Example4.h5", 200);
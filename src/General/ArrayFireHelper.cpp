@@ -4,6 +4,7 @@
 
 #include "ArrayFireHelper.h"
 #include "Types.h"
+#include "SyncCounter.h"
 array ArrayFireHelper::coordinateIndexing(array &A, array &x, array &y, array &z) {
     dim4 dim = A.dims();
     return dim[0]*dim[1]*z + dim[0]*y + x;
@@ -24,6 +25,7 @@ array ArrayFireHelper::coordinateIndexing(array &A, array &x, array &y) {
 
 array ArrayFireHelper::isUnique(array A) {
     array uniqueValues = setUnique(A);
+    SyncCounter::record("ArrayFireHelper::isUnique");
     auto nUniques = uniqueValues.elements();
     auto nElements = A.elements();
     // TODO: Alternative? Requires a lot of memory and probably is not efficient
@@ -0,0 +1,101 @@
+//
+// Background thread performing all HDF5 writes of a running simulation
+//
+
+#include "AsyncWriter.h"
+#include "StorageHelper.h"
+#include "Tracer.h"
+
+AsyncWriter::AsyncWriter(size_t maxQueued) : maxQueued(std::max(maxQueued, (size_t)1)) {
+    writer = std::thread(&AsyncWriter::run, this);
+}
+
+AsyncWriter::~AsyncWriter() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobAvailable.notify_all();
+    writer.join();
+}
+
+std::shared_ptr<std::vector<char>> AsyncWriter::acquireBuffer(size_t bytes) {
+    auto buffer = std::make_shared<std::vector<char>>();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(!freeBuffers.empty()) {
+            buffer->swap(freeBuffers.back());
+            freeBuffers.pop_back();
+        }
+    }
+    // Keeps the capacity of recycled buffers, frames of the same dataset therefore do not reallocate
+    buffer->resize(bytes);
+    return buffer;
+}
+
+void AsyncWriter::enqueue(WriteJob job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobDone.wait(lock, [this] { return queue.size() < maxQueued || error; });
+    rethrowError();
+    queue.push_back(std::move(job));
+    lock.unlock();
+    jobAvailable.notify_one();
+}
+
+void AsyncWriter::enqueueTask(std::function<void()> task) {
+    WriteJob job {nullptr, nullptr, nullptr, 0, false, 0, task};
+    enqueue(std::move(job));
+}
+
+void AsyncWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobDone.wait(lock, [this] { return (queue.empty() && !writing) || error; });
+    rethrowError();
+}
+
+void AsyncWriter::rethrowError() {
+    // Called with the lock held
+    if(error) {
+        std::exception_ptr jobError = error;
+        error = nullptr;
+        queue.clear();
+        std::rethrow_exception(jobError);
+    }
+}
+
+void AsyncWriter::run() {
+    Tracer::setThreadName("Storage writer");
+    while(true) {
+        std::unique_lock<std::mutex> lock(mutex);
+        jobAvailable.wait(lock, [this] { return !queue.empty() || stopping; });
+        if(queue.empty())
+            return;
+        WriteJob job = std::move(queue.front());
+        queue.pop_front();
+        writing = true;
+        lock.unlock();
+
+        // Any error, e.g. std::bad_alloc or a failed checkpoint write, is rethrown on the simulation thread
+        std::exception_ptr jobError;
+        try {
+            if(job.task) {
+                job.task();
+            } else if(job.ragged)
+                StorageHelper::writeRows(*job.target, *job.memoryType, job.buffer->data() + job.offset, job.count);
+            else
+                StorageHelper::writeFrame(*job.target, *job.memoryType, job.buffer->data() + job.offset);
+        } catch(...) {
+            jobError = std::current_exception();
+        }
+
+        lock.lock();
+        writing = false;
+        if(jobError)
+            error = jobError;
+        // Recycle the buffer once the last job using it is written, keep at most one buffer per queue slot
+        if(job.buffer && job.buffer.use_count() == 1 && freeBuffers.size() <= maxQueued)
+            freeBuffers.push_back(std::move(*job.buffer));
+        lock.unlock();
+        jobDone.notify_all();
+    }
+}
@@ -0,0 +1,68 @@
+//
+// Background thread performing all HDF5 writes of a running simulation
+//
+
+#ifndef BACTSIM_GPU_ASYNCWRITER_H
+#define BACTSIM_GPU_ASYNCWRITER_H
+
+#include <H5Cpp.h>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+struct WriteJob {
+    // Datasets and memory types are owned by the caller and have to outlive the job (until flush)
+    H5::DataSet *target;
+    const H5::DataType *memoryType;
+    // Several jobs may share one staging buffer, each one writes the data starting at offset
+    std::shared_ptr<std::vector<char>> buffer;
+    size_t offset;
+    // Ragged jobs append count rows to a one dimensional dataset, all others append one frame
+    bool ragged;
+    hsize_t count;
+    // Other HDF5 work, e.g. writing a checkpoint, runs task instead of appending to target
+    std::function<void()> task;
+};
+
+/**
+ * The HDF5 library is not thread safe, therefore once an AsyncWriter is registered with StorageHelper the simulation
+ * thread must not issue HDF5 calls itself. It only copies the data into host staging buffers and enqueues them, the
+ * writer thread extends the datasets and writes in submission order. Staging buffers are recycled and the queue is
+ * bounded, enqueue blocks while the writer is maxQueued jobs behind.
+ */
+class AsyncWriter {
+public:
+    AsyncWriter(size_t maxQueued = 64);
+    ~AsyncWriter();
+
+    std::shared_ptr<std::vector<char>> acquireBuffer(size_t bytes);
+    void enqueue(WriteJob job);
+    void enqueueTask(std::function<void()> task);
+    // Blocks until all enqueued jobs are written, rethrows errors of the writer thread
+    void flush();
+
+private:
+    void run();
+    void rethrowError();
+
+    size_t maxQueued;
+    std::deque<WriteJob> queue;
+    std::vector<std::vector<char>> freeBuffers;
+    bool writing = false;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    std::mutex mutex;
+    std::condition_variable jobAvailable;
+    std::condition_variable jobDone;
+    std::thread writer;
+};
+
+
+#endif //BACTSIM_GPU_ASYNCWRITER_H
@@ -0,0 +1,226 @@
+//
+// Complete simulation state in a single file, used to restart simulations without reading trajectories
+//
+
+#include "Checkpoint.h"
+#include <cstdio>
+#include <cstring>
+
+#define CHECKPOINT_VERSION 1
+
+Checkpoint::Checkpoint(std::string path) {
+    H5::H5File file(path, H5F_ACC_RDONLY);
+    if(!file.attrExists("Checkpoint"))
+        throw H5::Exception("Checkpoint", "File is not a checkpoint: " + path);
+    readGroup(file, "");
+}
+
+bool Checkpoint::isCheckpoint(std::string path) {
+    try {
+        H5::Exception::dontPrint();
+        if(!H5::H5File::isHdf5(path))
+            return false;
+        H5::H5File file(path, H5F_ACC_RDONLY);
+        return file.attrExists("Checkpoint");
+    } catch(H5::Exception &e) {
+        return false;
+    }
+}
+
+const H5::PredType &Checkpoint::getFileType(af::dtype type) {
+    switch(type) {
+        case af::dtype::f32: return H5::PredType::IEEE_F32LE;
+        case af::dtype::f64: return H5::PredType::IEEE_F64LE;
+        case af::dtype::b8:
+        case af::dtype::u8: return H5::PredType::STD_U8LE;
+        case af::dtype::s16: return H5::PredType::STD_I16LE;
+        case af::dtype::u16: return H5::PredType::STD_U16LE;
+        case af::dtype::s32: return H5::PredType::STD_I32LE;
+        case af::dtype::u32: return H5::PredType::STD_U32LE;
+        case af::dtype::s64: return H5::PredType::STD_I64LE;
+        case af::dtype::u64: return H5::PredType::STD_U64LE;
+        default:
+            throw H5::Exception("Checkpoint", "Unsupported array type");
+    }
+}
+
+const H5::PredType &Checkpoint::getMemoryType(af::dtype type) {
+    switch(type) {
+        case af::dtype::f32: return H5::PredType::NATIVE_FLOAT;
+        case af::dtype::f64: return H5::PredType::NATIVE_DOUBLE;
+        case af::dtype::b8:
+        case af::dtype::u8: return H5::PredType::NATIVE_UINT8;
+        case af::dtype::s16: return H5::PredType::NATIVE_INT16;
+        case af::dtype::u16: return H5::PredType::NATIVE_UINT16;
+        case af::dtype::s32: return H5::PredType::NATIVE_INT32;
+        case af::dtype::u32: return H5::PredType::NATIVE_UINT32;
+        case af::dtype::s64: return H5::PredType::NATIVE_INT64;
+        case af::dtype::u64: return H5::PredType::NATIVE_UINT64;
+        default:
+            throw H5::Exception("Checkpoint", "Unsupported array type");
+    }
+}
+
+void Checkpoint::setArray(std::string name, const af::array &data) {
+    Entry entry;
+    entry.kind = ENTRY_ARRAY;
+    entry.type = data.type();
+    // Validates the type before copying
+    getFileType(entry.type);
+    af::dim4 dims = data.dims();
+    for(unsigned int i = 0; i < std::max(data.numdims(), 1u); i++)
+        entry.dims.push_back(data.isempty() && i == 0 ? 0 : dims[i]);
+    entry.data.resize(data.bytes());
+    if(!data.isempty())
+        data.host(entry.data.data());
+    entries[name] = entry;
+}
+
+af::array Checkpoint::getArray(std::string name) const {
+    const Entry &entry = getEntry(name, ENTRY_ARRAY);
+    if(entry.data.empty())
+        return af::array();
+    std::vector<dim_t> dims(entry.dims.begin(), entry.dims.end());
+    af::array data(af::dim4((unsigned)dims.size(), dims.data()), entry.type);
+    data.write(entry.data.data(), entry.data.size());
+    return data;
+}
+
+double Checkpoint::getValue(std::string name) const {
+    std::vector<double> values = getValues(name);
+    if(values.size() != 1)
+        throw H5::Exception("Checkpoint", "Entry does not hold a single value: " + name);
+    return values[0];
+}
+
+void Checkpoint::setValues(std::string name, std::vector<double> values) {
+    Entry entry;
+    entry.kind = ENTRY_VALUES;
+    entry.type = af::dtype::f64;
+    entry.dims.push_back(values.size());
+    entry.data.resize(values.size()*sizeof(double));
+    if(!values.empty())
+        memcpy(entry.data.data(), values.data(), entry.data.size());
+    entries[name] = entry;
+}
+
+std::vector<double> Checkpoint::getValues(std::string name) const {
+    const Entry &entry = getEntry(name, ENTRY_VALUES);
+    std::vector<double> values(entry.data.size()/sizeof(double));
+    if(!values.empty())
+        memcpy(values.data(), entry.data.data(), entry.data.size());
+    return values;
+}
+
+void Checkpoint::setString(std::string name, std::string value) {
+    Entry entry;
+    entry.kind = ENTRY_STRING;
+    entry.type = af::dtype::u8;
+    entry.text = value;
+    entries[name] = entry;
+}
+
+std::string Checkpoint::getString(std::string name) const {
+    return getEntry(name, ENTRY_STRING).text;
+}
+
+std::vector<std::string> Checkpoint::getChildren(std::string prefix) const {
+    if(!prefix.empty() && prefix.back() != '/')
+        prefix += '/';
+    std::vector<std::string> children;
+    for(auto it = entries.lower_bound(prefix); it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0; it++) {
+        std::string child = it->first.substr(prefix.size());
+        child = child.substr(0, child.find('/'));
+        if(children.empty() || children.back() != child)
+            children.push_back(child);
+    }
+    return children;
+}
+
+const Checkpoint::Entry &Checkpoint::getEntry(std::string name, EntryKind kind) const {
+    auto entry = entries.find(name);
+    if(entry == entries.end())
+        throw H5::Exception("Checkpoint", "Missing checkpoint entry: " + name);
+    if(entry->second.kind != kind)
+        throw H5::Exception("Checkpoint", "Checkpoint entry has an unexpected kind: " + name);
+    return entry->second;
+}
+
+void Checkpoint::write(std::string path) const {
+    std::string temporaryPath = path + ".tmp";
+    {
+        H5::H5File file(temporaryPath, H5F_ACC_TRUNC);
+        H5::DataSpace scalar(H5S_SCALAR);
+        int version = CHECKPOINT_VERSION;
+        file.createAttribute("Checkpoint", H5::PredType::STD_I32LE, scalar).write(H5::PredType::NATIVE_INT, &version);
+
+        H5::StrType varstrtype(0, H5T_VARIABLE);
+        for(auto &named: entries) {
+            // Create the groups along the path
+            size_t separator = 0;
+            while((separator = named.first.find('/', separator + 1)) != std::string::npos) {
+                std::string group = named.first.substr(0, separator);
+                if(!file.nameExists(group))
+                    file.createGroup(group);
+            }
+
+            const Entry &entry = named.second;
+            if(entry.kind == ENTRY_STRING) {
+                file.createDataSet(named.first, varstrtype, scalar).write(entry.text, varstrtype);
+                continue;
+            }
+            // HDF5 is row major, reversing the dimensions keeps the column major memory order of ArrayFire
+            std::vector<hsize_t> dims(entry.dims.rbegin(), entry.dims.rend());
+            H5::DataSpace space((int)dims.size(), dims.data());
+            H5::DataSet dataset = file.createDataSet(named.first, getFileType(entry.type), space);
+            if(!entry.data.empty())
+                dataset.write(entry.data.data(), getMemoryType(entry.type));
+            if(entry.kind == ENTRY_ARRAY) {
+                int type = entry.type;
+                dataset.createAttribute("ArrayFire type", H5::PredType::STD_I32LE, scalar).write(H5::PredType::NATIVE_INT, &type);
+            }
+        }
+    }
+    if(std::rename(temporaryPath.c_str(), path.c_str()) != 0)
+        throw H5::Exception("Checkpoint", "Could not replace checkpoint " + path);
+}
+
+void Checkpoint::readGroup(H5::Group group, std::string prefix) {
+    H5::StrType varstrtype(0, H5T_VARIABLE);
+    for(hsize_t i = 0; i < group.getNumObjs(); i++) {
+        std::string name = group.getObjnameByIdx(i);
+        if(group.childObjType(i) == H5O_TYPE_GROUP) {
+            readGroup(group.openGroup(name), prefix + name + "/");
+            continue;
+        }
+
+        H5::DataSet dataset = group.openDataSet(name);
+        Entry entry;
+        if(dataset.getTypeClass() == H5T_STRING) {
+            entry.kind = ENTRY_STRING;
+            entry.type = af::dtype::u8;
+            dataset.read(entry.text, varstrtype);
+            entries[prefix + name] = entry;
+            continue;
+        }
+
+        H5::DataSpace space = dataset.getSpace();
+        std::vector<hsize_t> dims(space.getSimpleExtentNdims());
+        space.getSimpleExtentDims(dims.data());
+        entry.dims.assign(dims.rbegin(), dims.rend());
+        if(dataset.attrExists("ArrayFire type")) {
+            int type;
+            dataset.openAttribute("ArrayFire type").read(H5::PredType::NATIVE_INT, &type);
+            entry.kind = ENTRY_ARRAY;
+            entry.type = (af::dtype)type;
+        } else {
+            entry.kind = ENTRY_VALUES;
+            entry.type = af::dtype::f64;
+        }
+        const H5::PredType &memoryType = getMemoryType(entry.type);
+        entry.data.resize(space.getSimpleExtentNpoints()*memoryType.getSize());
+        if(!entry.data.empty())
+            dataset.read(entry.data.data(), memoryType);
+        entries[prefix + name] = entry;
+    }
+}
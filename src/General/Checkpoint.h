@@ -0,0 +1,65 @@
+//
+// Complete simulation state in a single file, used to restart simulations without reading trajectories
+//
+
+#ifndef BACTSIM_GPU_CHECKPOINT_H
+#define BACTSIM_GPU_CHECKPOINT_H
+
+#include <H5Cpp.h>
+#include <arrayfire.h>
+#include <string>
+#include <vector>
+#include <map>
+
+/**
+ * A checkpoint is a host side collection of named entries: device arrays, numeric values and strings. Entry names
+ * are paths ("Populations/Population 1/xpos"), the components of the simulation add their state below their own
+ * prefix. Arrays are copied to the host when they are added, the checkpoint can therefore be written by another
+ * thread while the simulation continues.
+ *
+ * The file is a HDF5 file with one contiguous dataset per entry. Arrays keep the memory order of ArrayFire, their
+ * HDF5 dimensions are the reversed ArrayFire dimensions, so no transposes are required on either side.
+ */
+class Checkpoint {
+public:
+    Checkpoint() {}
+    // Reads all entries of a checkpoint file into host memory
+    Checkpoint(std::string path);
+    static bool isCheckpoint(std::string path);
+
+    void setArray(std::string name, const af::array &data);
+    af::array getArray(std::string name) const;
+    void setValue(std::string name, double value) { setValues(name, std::vector<double> {value}); }
+    double getValue(std::string name) const;
+    void setValues(std::string name, std::vector<double> values);
+    std::vector<double> getValues(std::string name) const;
+    void setString(std::string name, std::string value);
+    std::string getString(std::string name) const;
+
+    bool has(std::string name) const { return entries.find(name) != entries.end(); }
+    // Names of the entries and groups directly below prefix
+    std::vector<std::string> getChildren(std::string prefix) const;
+
+    // Writes to a temporary file first and replaces path once complete, an interrupted write keeps the last checkpoint
+    void write(std::string path) const;
+
+private:
+    enum EntryKind { ENTRY_ARRAY, ENTRY_VALUES, ENTRY_STRING };
+    struct Entry {
+        EntryKind kind;
+        // Dimensions in ArrayFire order
+        std::vector<hsize_t> dims;
+        af::dtype type;
+        std::vector<char> data;
+        std::string text;
+    };
+    const Entry &getEntry(std::string name, EntryKind kind) const;
+    void readGroup(H5::Group group, std::string prefix);
+    static const H5::PredType &getFileType(af::dtype type);
+    static const H5::PredType &getMemoryType(af::dtype type);
+
+    std::map<std::string, Entry> entries;
+};
+
+
+#endif //BACTSIM_GPU_CHECKPOINT_H
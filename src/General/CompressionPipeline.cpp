@@ -0,0 +1,222 @@
+//
+// Compresses chunks of frame datasets on a thread pool and writes them with direct chunk writes
+//
+
+#include "CompressionPipeline.h"
+#include "Tracer.h"
+#include <cstring>
+#include <zlib.h>
+
+CompressionPipeline::CompressionPipeline(unsigned int threads) {
+    if(threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for(unsigned int i = 0; i < threads; i++)
+        workers.push_back(std::thread(&CompressionPipeline::work, this));
+}
+
+CompressionPipeline::~CompressionPipeline() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    taskAvailable.notify_all();
+    for(auto &worker: workers)
+        worker.join();
+}
+
+void CompressionPipeline::work() {
+    Tracer::setThreadName("Compression");
+    while(true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            taskAvailable.wait(lock, [this] { return !tasks.empty() || stopping; });
+            if(tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        Tracer::Scope trace("Compress chunks");
+        task();
+    }
+}
+
+std::future<std::vector<char>> CompressionPipeline::schedule(std::function<std::vector<char>()> task) {
+    auto packaged = std::make_shared<std::packaged_task<std::vector<char>()>>(task);
+    std::future<std::vector<char>> result = packaged->get_future();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        tasks.push_back([packaged] { (*packaged)(); });
+    }
+    taskAvailable.notify_one();
+    return result;
+}
+
+CompressionPipeline::FrameChunker &CompressionPipeline::getChunker(H5::DataSet &target) {
+    auto existing = chunkers.find(target.getId());
+    if(existing != chunkers.end())
+        return existing->second;
+
+    FrameChunker &chunker = chunkers[target.getId()];
+    chunker.dataset = target;
+    H5::DSetCreatPropList properties = target.getCreatePlist();
+    H5::DataSpace space = target.getSpace();
+    int ndims = space.getSimpleExtentNdims();
+    if(properties.getLayout() != H5D_CHUNKED || properties.getNfilters() == 0 || ndims < 2 || ndims > 3)
+        return chunker;
+
+    // Only shuffle and deflate can be reproduced outside of HDF5
+    for(int i = 0; i < properties.getNfilters(); i++) {
+        unsigned int flags, config;
+        size_t nValues = 1;
+        unsigned int values[1] = {0};
+        char name[32];
+        H5Z_filter_t filter = properties.getFilter(i, flags, nValues, values, sizeof(name), name, config);
+        if(filter == H5Z_FILTER_SHUFFLE && chunker.deflateLevel < 0)
+            chunker.shuffle = true;
+        else if(filter == H5Z_FILTER_DEFLATE && chunker.deflateLevel < 0)
+            chunker.deflateLevel = values[0];
+        else
+            return chunker;
+    }
+
+    std::vector<hsize_t> dims(ndims), chunk(ndims);
+    space.getSimpleExtentDims(dims.data());
+    properties.getChunk(ndims, chunk.data());
+    chunker.fileType = target.getDataType();
+    chunker.elementSize = chunker.fileType.getSize();
+    chunker.ndims = ndims;
+    chunker.chunkFrames = chunk[0];
+    if(ndims == 3) {
+        chunker.rows = dims[1];
+        chunker.columns = dims[2];
+        chunker.chunkRows = chunk[1];
+        chunker.chunkColumns = chunk[2];
+    } else {
+        chunker.columns = dims[1];
+        chunker.chunkColumns = chunk[1];
+    }
+
+    // Continue an incomplete chunk of a previous run, it is rewritten completely once full
+    hsize_t frameBytes = chunker.rows*chunker.columns*chunker.elementSize;
+    chunker.pending.assign(chunker.chunkFrames*frameBytes, 0);
+    chunker.totalFrames = dims[0];
+    chunker.pendingFrames = dims[0] % chunker.chunkFrames;
+    chunker.firstFrame = dims[0] - chunker.pendingFrames;
+    if(chunker.pendingFrames) {
+        std::vector<hsize_t> start(ndims, 0), count(dims);
+        start[0] = chunker.firstFrame;
+        count[0] = chunker.pendingFrames;
+        space.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+        hsize_t elements = chunker.pendingFrames*chunker.rows*chunker.columns;
+        H5::DataSpace memSpace(1, &elements);
+        target.read(chunker.pending.data(), chunker.fileType, memSpace, space);
+    }
+    chunker.supported = true;
+    return chunker;
+}
+
+bool CompressionPipeline::appendFrame(H5::DataSet &target, const H5::DataType &H5MemoryType, const void *hostMem) {
+    FrameChunker &chunker = getChunker(target);
+    if(!chunker.supported)
+        return false;
+
+    // Direct chunk writes bypass the type conversion of HDF5, convert into the file type here
+    hsize_t elements = chunker.rows*chunker.columns;
+    size_t bufferSize = elements*std::max(chunker.elementSize, H5MemoryType.getSize());
+    std::vector<char> converted(bufferSize);
+    memcpy(converted.data(), hostMem, elements*H5MemoryType.getSize());
+    if(H5Tconvert(H5MemoryType.getId(), chunker.fileType.getId(), elements, converted.data(), NULL, H5P_DEFAULT) < 0)
+        throw H5::Exception("CompressionPipeline", "Could not convert frame to the file type");
+    memcpy(chunker.pending.data() + chunker.pendingFrames*elements*chunker.elementSize, converted.data(),
+           elements*chunker.elementSize);
+
+    chunker.totalFrames++;
+    chunker.pendingFrames++;
+    hsize_t dims[3] = {chunker.totalFrames, chunker.rows, chunker.columns};
+    if(chunker.ndims == 2)
+        dims[1] = chunker.columns;
+    target.extend(dims);
+
+    if(chunker.pendingFrames == chunker.chunkFrames)
+        writeChunks(chunker);
+    return true;
+}
+
+std::vector<char> CompressionPipeline::compressChunk(const FrameChunker &chunker, hsize_t chunkRow, hsize_t chunkColumn) {
+    // Gather the chunk in row major order, regions outside of the dataset are zero
+    size_t elementSize = chunker.elementSize;
+    hsize_t chunkElements = chunker.chunkFrames*chunker.chunkRows*chunker.chunkColumns;
+    std::vector<char> chunk(chunkElements*elementSize, 0);
+    hsize_t rowStart = chunkRow*chunker.chunkRows;
+    hsize_t columnStart = chunkColumn*chunker.chunkColumns;
+    hsize_t copyColumns = std::min(chunker.chunkColumns, chunker.columns - columnStart);
+    for(hsize_t t = 0; t < chunker.pendingFrames; t++) {
+        for(hsize_t r = 0; r < chunker.chunkRows && rowStart + r < chunker.rows; r++) {
+            const char *source = chunker.pending.data() +
+                    ((t*chunker.rows + rowStart + r)*chunker.columns + columnStart)*elementSize;
+            char *target = chunk.data() + ((t*chunker.chunkRows + r)*chunker.chunkColumns)*elementSize;
+            memcpy(target, source, copyColumns*elementSize);
+        }
+    }
+
+    // Same byte order as the HDF5 shuffle filter: all first bytes, then all second bytes, ...
+    if(chunker.shuffle && elementSize > 1) {
+        std::vector<char> shuffled(chunk.size());
+        for(hsize_t i = 0; i < chunkElements; i++)
+            for(size_t b = 0; b < elementSize; b++)
+                shuffled[b*chunkElements + i] = chunk[i*elementSize + b];
+        chunk.swap(shuffled);
+    }
+
+    if(chunker.deflateLevel >= 0) {
+        uLongf compressedSize = compressBound(chunk.size());
+        std::vector<char> compressed(compressedSize);
+        if(compress2((Bytef *)compressed.data(), &compressedSize, (const Bytef *)chunk.data(), chunk.size(),
+                     chunker.deflateLevel) != Z_OK)
+            throw H5::Exception("CompressionPipeline", "Deflate failed");
+        compressed.resize(compressedSize);
+        chunk.swap(compressed);
+    }
+    return chunk;
+}
+
+void CompressionPipeline::writeChunks(FrameChunker &chunker) {
+    Tracer::Scope trace("Write chunks");
+    hsize_t chunksPerRow = (chunker.columns + chunker.chunkColumns - 1)/chunker.chunkColumns;
+    hsize_t chunksPerColumn = (chunker.rows + chunker.chunkRows - 1)/chunker.chunkRows;
+
+    std::vector<std::future<std::vector<char>>> results;
+    for(hsize_t r = 0; r < chunksPerColumn; r++)
+        for(hsize_t c = 0; c < chunksPerRow; c++)
+            results.push_back(schedule([this, &chunker, r, c] { return compressChunk(chunker, r, c); }));
+    // The tasks read the pending frames, wait for all of them before anything can throw
+    for(auto &result: results)
+        result.wait();
+
+    for(hsize_t r = 0; r < chunksPerColumn; r++) {
+        for(hsize_t c = 0; c < chunksPerRow; c++) {
+            std::vector<char> data = results[r*chunksPerRow + c].get();
+            hsize_t offset[3];
+            offset[0] = chunker.firstFrame;
+            if(chunker.ndims == 3) {
+                offset[1] = r*chunker.chunkRows;
+                offset[2] = c*chunker.chunkColumns;
+            } else
+                offset[1] = c*chunker.chunkColumns;
+            if(H5Dwrite_chunk(chunker.dataset.getId(), H5P_DEFAULT, 0, offset, data.size(), data.data()) < 0)
+                throw H5::Exception("CompressionPipeline", "Direct chunk write failed");
+        }
+    }
+
+    chunker.firstFrame += chunker.chunkFrames;
+    chunker.pendingFrames = 0;
+    std::fill(chunker.pending.begin(), chunker.pending.end(), 0);
+}
+
+void CompressionPipeline::flush() {
+    for(auto &chunker: chunkers)
+        if(chunker.second.supported && chunker.second.pendingFrames)
+            writeChunks(chunker.second);
+    chunkers.clear();
+}
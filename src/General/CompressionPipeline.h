@@ -0,0 +1,72 @@
+//
+// Compresses chunks of frame datasets on a thread pool and writes them with direct chunk writes
+//
+
+#ifndef BACTSIM_GPU_COMPRESSIONPIPELINE_H
+#define BACTSIM_GPU_COMPRESSIONPIPELINE_H
+
+#include <H5Cpp.h>
+#include <vector>
+#include <map>
+#include <deque>
+#include <future>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * HDF5 runs its filters in the thread issuing the write, one chunk after another. For datasets whose creation
+ * properties only contain the shuffle and/or deflate filter, this pipeline collects frames until a chunk is complete
+ * along the time axis, compresses all spatial chunks of these frames in parallel and writes the results with
+ * H5Dwrite_chunk. The resulting files are identical in layout to ones written through the regular filter pipeline.
+ *
+ * All HDF5 calls happen in the thread calling appendFrame and flush, the pool threads only shuffle and deflate.
+ * Frames of an incomplete chunk are held in memory until flush is called, the dataset extent already contains them.
+ */
+class CompressionPipeline {
+public:
+    CompressionPipeline(unsigned int threads = 0);
+    ~CompressionPipeline();
+
+    // Returns false if the dataset is not compressed with supported filters, it then has to be written regularly
+    bool appendFrame(H5::DataSet &target, const H5::DataType &H5MemoryType, const void *hostMem);
+    // Writes all incomplete chunks and forgets all datasets, to be called before closing the datasets
+    void flush();
+
+private:
+    struct FrameChunker {
+        bool supported = false;
+        H5::DataSet dataset;
+        H5::DataType fileType;
+        size_t elementSize = 0;
+        int ndims = 0;
+        // Spatial extent of a frame and of a chunk, one dimensional frames use a single row
+        hsize_t rows = 1, columns = 1;
+        hsize_t chunkFrames = 1, chunkRows = 1, chunkColumns = 1;
+        bool shuffle = false;
+        int deflateLevel = -1;
+        // Frames of the current chunk in the file type, starting at frame firstFrame
+        std::vector<char> pending;
+        hsize_t firstFrame = 0;
+        hsize_t pendingFrames = 0;
+        hsize_t totalFrames = 0;
+    };
+
+    FrameChunker &getChunker(H5::DataSet &target);
+    void writeChunks(FrameChunker &chunker);
+    std::vector<char> compressChunk(const FrameChunker &chunker, hsize_t chunkRow, hsize_t chunkColumn);
+    std::future<std::vector<char>> schedule(std::function<std::vector<char>()> task);
+    void work();
+
+    std::map<hid_t, FrameChunker> chunkers;
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+};
+
+
+#endif //BACTSIM_GPU_COMPRESSIONPIPELINE_H
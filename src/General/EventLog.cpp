@@ -0,0 +1,83 @@
+//
+// Trajectories of run and tumble bacteria stored as the events that change their straight line motion
+//
+
+#include "EventLog.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+    template <class T> std::vector<T> readAll(H5::Group &group, std::string name, const H5::DataType &type) {
+        H5::DataSet data = group.openDataSet(name);
+        std::vector<T> values(data.getSpace().getSimpleExtentNpoints());
+        if(!values.empty())
+            data.read(values.data(), type);
+        return values;
+    }
+}
+
+EventLog::EventLog(H5::Group population) {
+    H5::Group events = population.openGroup("Events");
+    unsigned int count;
+    events.openAttribute("Bacteria").read(H5::PredType::NATIVE_UINT, &count);
+    bacteria = count;
+    population.openAttribute("Swimm speed").read(H5::PredType::NATIVE_DOUBLE, &speed);
+    H5::Group root = population.openGroup("/");
+    if(!root.attrExists("dt"))
+        throw H5::Exception("EventLog", "The timestep of the model is not stored in the file");
+    root.openAttribute("dt").read(H5::PredType::NATIVE_DOUBLE, &dt);
+
+    ids = readAll<unsigned int>(events, "id", H5::PredType::NATIVE_UINT);
+    steps = readAll<unsigned int>(events, "step", H5::PredType::NATIVE_UINT);
+    xpos = readAll<double>(events, "xpos", H5::PredType::NATIVE_DOUBLE);
+    ypos = readAll<double>(events, "ypos", H5::PredType::NATIVE_DOUBLE);
+    angles = readAll<double>(events, "angle", H5::PredType::NATIVE_DOUBLE);
+    moving = readAll<signed char>(events, "moving", H5::PredType::NATIVE_SCHAR);
+    saveSteps = readAll<unsigned long long>(events, "Save steps", H5::PredType::NATIVE_ULLONG);
+    size_t rows = ids.size();
+    if(steps.size() != rows || xpos.size() != rows || ypos.size() != rows || angles.size() != rows || moving.size() != rows)
+        throw H5::Exception("EventLog", "The event datasets have different lengths");
+}
+
+std::vector<EventLog::State> EventLog::getState(double time) const {
+    double step = std::floor(time/dt);
+    return advance((unsigned long long)std::max(step, 0.0), time - step*dt);
+}
+
+std::vector<EventLog::State> EventLog::getStateAtStep(unsigned long long step) const {
+    return advance(step, 0);
+}
+
+std::vector<EventLog::State> EventLog::advance(unsigned long long step, double elapsed) const {
+    // Events are stored in the order of their timesteps, the last one up to step describes the motion of a bacterium
+    double nan = std::numeric_limits<double>::quiet_NaN();
+    std::vector<State> states(bacteria, State {nan, nan, nan, false});
+    std::vector<unsigned int> eventSteps(bacteria, 0);
+    for(size_t i = 0; i < ids.size() && steps[i] <= step; i++) {
+        if(ids[i] >= bacteria)
+            continue;
+        states[ids[i]] = State {xpos[i], ypos[i], angles[i], moving[i] != 0};
+        eventSteps[ids[i]] = steps[i];
+    }
+    for(hsize_t b = 0; b < bacteria; b++) {
+        if(!states[b].moving)
+            continue;
+        double distance = speed*((step - eventSteps[b])*dt + elapsed);
+        states[b].x += distance*std::cos(states[b].angle);
+        states[b].y += distance*std::sin(states[b].angle);
+    }
+    return states;
+}
+
+unsigned long long EventLog::truncateToLastSave(H5::Group population) {
+    H5::Group events = population.openGroup("Events");
+    std::vector<unsigned long long> saveSteps = readAll<unsigned long long>(events, "Save steps", H5::PredType::NATIVE_ULLONG);
+    std::vector<unsigned long long> saveOffsets = readAll<unsigned long long>(events, "Save offsets", H5::PredType::NATIVE_ULLONG);
+    if(saveSteps.empty() || saveOffsets.size() != saveSteps.size())
+        throw H5::Exception("EventLog", "The event log does not contain a save");
+    hsize_t rows = saveOffsets.back();
+    for(std::string name: {"id", "step", "xpos", "ypos", "angle", "moving"})
+        events.openDataSet(name).extend(&rows);
+    return saveSteps.back();
+}
@@ -0,0 +1,63 @@
+//
+// Trajectories of run and tumble bacteria stored as the events that change their straight line motion
+//
+
+#ifndef BACTSIM_GPU_EVENTLOG_H
+#define BACTSIM_GPU_EVENTLOG_H
+
+#include <H5Cpp.h>
+#include <string>
+#include <vector>
+
+/**
+ * Populations with an event log store the group "Events" instead of position frames. Every event is a row of the
+ * ragged datasets "id", "step", "xpos", "ypos", "angle" and "moving": from the beginning of timestep step the
+ * bacterium moves from (xpos, ypos) in direction angle with the swimming speed of the population, or stays if it is
+ * not moving. Every bacterium has an event at the first timestep after the storage was set up. "Save steps" and
+ * "Save offsets" hold the timestep and the number of stored events of every save.
+ *
+ * Reconstructed positions follow straight lines between events, boundaries are taken into account by events of the
+ * bacteria whose position deviates from their line by more than the "Tolerance" attribute of the group.
+ */
+class EventLog {
+public:
+    struct State {
+        double x;
+        double y;
+        double angle;
+        bool moving;
+    };
+
+    // Reads all events of a population group, the timestep is the "dt" attribute of the file
+    EventLog(H5::Group population);
+
+    hsize_t getBacteria() const { return bacteria; }
+    double getDt() const { return dt; }
+    const std::vector<unsigned long long> &getSaveSteps() const { return saveSteps; }
+
+    // State of all bacteria at a model time, relative to the setup of the storage
+    std::vector<State> getState(double time) const;
+    // State of all bacteria at the beginning of a timestep
+    std::vector<State> getStateAtStep(unsigned long long step) const;
+
+    // Removes the events recorded after the last save, a continued simulation repeats these timesteps.
+    // Returns the timestep of the last save.
+    static unsigned long long truncateToLastSave(H5::Group population);
+
+private:
+    std::vector<State> advance(unsigned long long step, double elapsed) const;
+
+    hsize_t bacteria;
+    double dt;
+    double speed;
+    std::vector<unsigned int> ids;
+    std::vector<unsigned int> steps;
+    std::vector<double> xpos;
+    std::vector<double> ypos;
+    std::vector<double> angles;
+    std::vector<signed char> moving;
+    std::vector<unsigned long long> saveSteps;
+};
+
+
+#endif //BACTSIM_GPU_EVENTLOG_H
@@ -0,0 +1,161 @@
+//
+// Per phase timers and counters of a running simulation, written as a run report
+//
+
+#include "Profiler.h"
+#include "StorageHelper.h"
+#include "Tracer.h"
+#include <arrayfire.h>
+#include <algorithm>
+#include <fstream>
+
+bool Profiler::enabled = false;
+bool Profiler::synchronized = false;
+std::atomic<unsigned long long> Profiler::evaluations(0);
+std::atomic<unsigned long long> Profiler::bytesWritten(0);
+std::atomic<unsigned long long> Profiler::steps(0);
+std::chrono::steady_clock::time_point Profiler::enabledSince;
+std::mutex Profiler::mutex;
+std::map<std::string, Profiler::Phase> Profiler::phases;
+
+namespace {
+    std::string escapeJson(const std::string &value) {
+        std::string escaped;
+        for(char c: value) {
+            if(c == '"' || c == '\\')
+                escaped += '\\';
+            if((unsigned char)c < 0x20)
+                continue;
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    void writeAttribute(H5::H5Object &object, std::string name, double value) {
+        object.createAttribute(name, H5::PredType::IEEE_F64LE, StorageHelper::H5Scalar).write(H5::PredType::NATIVE_DOUBLE, &value);
+    }
+
+    void writeAttribute(H5::H5Object &object, std::string name, unsigned long long value) {
+        object.createAttribute(name, H5::PredType::STD_U64LE, StorageHelper::H5Scalar).write(H5::PredType::NATIVE_ULLONG, &value);
+    }
+}
+
+void Profiler::setEnabled(bool enabled) {
+    if(enabled && !Profiler::enabled)
+        reset();
+    Profiler::enabled = enabled;
+}
+
+void Profiler::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    phases.clear();
+    evaluations = 0;
+    bytesWritten = 0;
+    steps = 0;
+    enabledSince = std::chrono::steady_clock::now();
+}
+
+double Profiler::getWallSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - enabledSince).count();
+}
+
+void Profiler::record(const std::string &name, double seconds) {
+    // Pipelined populations record from their worker thread
+    std::lock_guard<std::mutex> lock(mutex);
+    auto phase = phases.find(name);
+    if(phase == phases.end())
+        phases[name] = Phase {1, seconds, seconds, seconds};
+    else {
+        phase->second.calls++;
+        phase->second.total += seconds;
+        phase->second.min = std::min(phase->second.min, seconds);
+        phase->second.max = std::max(phase->second.max, seconds);
+    }
+}
+
+void Profiler::writeJson(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    double wall = getWallSeconds();
+    out << "{" << std::endl;
+    out << "  \"synchronized\": " << (synchronized ? "true" : "false") << "," << std::endl;
+    out << "  \"wallSeconds\": " << wall << "," << std::endl;
+    out << "  \"steps\": " << steps << "," << std::endl;
+    out << "  \"stepsPerSecond\": " << (wall > 0 ? steps/wall : 0) << "," << std::endl;
+    out << "  \"kernelEvaluations\": " << evaluations << "," << std::endl;
+    out << "  \"bytesWritten\": " << bytesWritten << "," << std::endl;
+    out << "  \"phases\": {";
+    bool first = true;
+    for(auto &phase: phases) {
+        out << (first ? "" : ",") << std::endl;
+        out << "    \"" << escapeJson(phase.first) << "\": {\"calls\": " << phase.second.calls
+            << ", \"totalSeconds\": " << phase.second.total
+            << ", \"meanSeconds\": " << phase.second.total/phase.second.calls
+            << ", \"minSeconds\": " << phase.second.min
+            << ", \"maxSeconds\": " << phase.second.max << "}";
+        first = false;
+    }
+    out << std::endl << "  }" << std::endl << "}" << std::endl;
+}
+
+void Profiler::writeJson(std::string path) {
+    std::ofstream out(path);
+    if(!out)
+        throw H5::Exception("Profiler", "Could not open the performance report " + path);
+    writeJson(out);
+}
+
+void Profiler::writeStorage(H5::Group parent) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(parent.nameExists("Performance"))
+        parent.unlink("Performance");
+    H5::Group performance = parent.createGroup("Performance");
+    double wall = getWallSeconds();
+    writeAttribute(performance, "Synchronized", (unsigned long long)synchronized);
+    writeAttribute(performance, "Wall seconds", wall);
+    writeAttribute(performance, "Steps", (unsigned long long)steps);
+    writeAttribute(performance, "Steps per second", wall > 0 ? steps/wall : 0.0);
+    writeAttribute(performance, "Kernel evaluations", (unsigned long long)evaluations);
+    writeAttribute(performance, "Bytes written", (unsigned long long)bytesWritten);
+    for(auto &phase: phases) {
+        H5::Group group = performance.createGroup(phase.first);
+        writeAttribute(group, "Calls", phase.second.calls);
+        writeAttribute(group, "Total seconds", phase.second.total);
+        writeAttribute(group, "Min seconds", phase.second.min);
+        writeAttribute(group, "Max seconds", phase.second.max);
+    }
+}
+
+Profiler::Scope::Scope(const char *name) : active(enabled), traced(Tracer::isEnabled()) {
+    if(traced)
+        Tracer::begin(name);
+    if(active) {
+        this->name = name;
+        begin();
+    }
+}
+
+Profiler::Scope::Scope(const std::string &name) : active(enabled), traced(Tracer::isEnabled()) {
+    if(traced)
+        Tracer::begin(name);
+    if(active) {
+        this->name = name;
+        begin();
+    }
+}
+
+void Profiler::Scope::begin() {
+    // Work issued before belongs to the previous phase
+    if(synchronized)
+        af::sync();
+    start = std::chrono::steady_clock::now();
+}
+
+Profiler::Scope::~Scope() {
+    if(active) {
+        if(synchronized)
+            af::sync();
+        record(name, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    if(traced)
+        Tracer::end();
+}
@@ -0,0 +1,92 @@
+//
+// Per phase timers and counters of a running simulation, written as a run report
+//
+
+#ifndef BACTSIM_GPU_PROFILER_H
+#define BACTSIM_GPU_PROFILER_H
+
+#include <H5Cpp.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+/**
+ * Phases, e.g. "Interaction" or "Environment substeps", are timed by a Scope with a steady clock. Phases nest, the
+ * time of "Boundary conditions" is part of "Environment substeps". ArrayFire runs asynchronously, unsynchronised
+ * timings therefore measure the time to issue the work of a phase. Synchronised profiling waits for the device at
+ * the beginning and the end of every phase, the work is attributed to the phase that issued it at the price of a
+ * slower simulation.
+ *
+ * Kernel evaluations count the explicit evaluations of the simulation, every evaluation launches at least one kernel
+ * for the pending JIT tree. Bytes written are the bytes handed to HDF5 or the raw trajectory writer.
+ *
+ * The report holds calls, total, minimum and maximum seconds of every phase, the counters, the number of model steps
+ * and the wall time since profiling was enabled. Disabled profiling costs a single branch per scope and counter.
+ * Every scope is also a span of the Tracer if tracing is enabled.
+ */
+class Profiler {
+public:
+    static void setEnabled(bool enabled);
+    static bool isEnabled() { return enabled; }
+    static void setSynchronized(bool synchronized) { Profiler::synchronized = synchronized; }
+    static bool isSynchronized() { return synchronized; }
+
+    static void countEvaluations(unsigned long long evaluations = 1) {
+        if(enabled)
+            Profiler::evaluations += evaluations;
+    }
+    static void countBytesWritten(unsigned long long bytes) {
+        if(enabled)
+            bytesWritten += bytes;
+    }
+    static void countStep() {
+        if(enabled)
+            steps++;
+    }
+    static void reset();
+
+    // JSON summary of all phases and counters
+    static void writeJson(std::ostream &out);
+    static void writeJson(std::string path);
+    // Writes the report as the group "Performance" of parent, a previous report is replaced
+    static void writeStorage(H5::Group parent);
+
+    class Scope {
+    public:
+        Scope(const char *name);
+        Scope(const std::string &name);
+        ~Scope();
+    private:
+        void begin();
+        std::string name;
+        bool active;
+        bool traced;
+        std::chrono::steady_clock::time_point start;
+    };
+
+private:
+    struct Phase {
+        unsigned long long calls;
+        double total;
+        double min;
+        double max;
+    };
+
+    static void record(const std::string &name, double seconds);
+    static double getWallSeconds();
+
+    static bool enabled;
+    static bool synchronized;
+    static std::atomic<unsigned long long> evaluations;
+    static std::atomic<unsigned long long> bytesWritten;
+    static std::atomic<unsigned long long> steps;
+    static std::chrono::steady_clock::time_point enabledSince;
+    static std::mutex mutex;
+    static std::map<std::string, Phase> phases;
+};
+
+
+#endif //BACTSIM_GPU_PROFILER_H
@@ -0,0 +1,342 @@
+//
+// Self-describing binary trajectory format, written instead of HDF5 frames and read through mmap
+//
+
+#include "RawTrajectory.h"
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RAW_MAGIC "BSIMRAW1"
+#define RAW_VERSION 1
+#define RAW_HEADER_SIZE 24
+#define RAW_ALIGNMENT 8
+
+RawDataSetInfo RawDataSetInfo::fromHdf5(H5::DataSet &data, bool ragged) {
+    RawDataSetInfo info;
+    info.name = data.getObjName();
+    info.ragged = ragged;
+    H5::DataType type = data.getDataType();
+    switch(type.getClass()) {
+        case H5T_FLOAT:
+            info.typeClass = RAW_FLOAT;
+            break;
+        case H5T_INTEGER:
+            info.typeClass = data.getIntType().getSign() == H5T_SGN_NONE ? RAW_UNSIGNED : RAW_SIGNED;
+            break;
+        default:
+            throw H5::Exception("RawTrajectory", "Only numeric datasets can be stored: " + info.name);
+    }
+    info.elementSize = (uint8_t)type.getSize();
+
+    if(!ragged) {
+        H5::DataSpace space = data.getSpace();
+        std::vector<hsize_t> dims(space.getSimpleExtentNdims());
+        space.getSimpleExtentDims(dims.data());
+        info.frameDims.assign(dims.begin() + 1, dims.end());
+    }
+    if(data.attrExists("Layout")) {
+        H5::StrType varstrtype(0, H5T_VARIABLE);
+        std::string layout;
+        data.openAttribute("Layout").read(varstrtype, layout);
+        info.columnMajor = layout == "Column major";
+    }
+    if(data.attrExists("Quantization scale")) {
+        data.openAttribute("Quantization scale").read(H5::PredType::NATIVE_DOUBLE, &info.scale);
+        data.openAttribute("Quantization offset").read(H5::PredType::NATIVE_DOUBLE, &info.offset);
+    }
+    return info;
+}
+
+RawTrajectoryWriter::RawTrajectoryWriter(std::string path) {
+    file = std::fopen(path.c_str(), "wb");
+    if(!file)
+        throw H5::Exception("RawTrajectory", "Could not create " + path);
+    // The header is completed by close
+    char header[RAW_HEADER_SIZE] = {0};
+    write(header, sizeof(header));
+}
+
+RawTrajectoryWriter::~RawTrajectoryWriter() {
+    try {
+        close();
+    } catch(H5::Exception &e) {
+        if(file)
+            std::fclose(file);
+    }
+}
+
+void RawTrajectoryWriter::write(const void *data, size_t bytes) {
+    if(bytes && std::fwrite(data, 1, bytes, file) != bytes)
+        throw H5::Exception("RawTrajectory", "Write failed");
+    position += bytes;
+}
+
+size_t RawTrajectoryWriter::addDataSet(RawDataSetInfo info) {
+    info.frames.clear();
+    datasets.push_back(info);
+    return datasets.size() - 1;
+}
+
+void RawTrajectoryWriter::appendFrame(size_t dataset, const void *data, uint64_t elements) {
+    RawDataSetInfo &info = datasets.at(dataset);
+    if(!info.ragged) {
+        elements = 1;
+        for(auto dim: info.frameDims)
+            elements *= dim;
+    }
+    // Aligned frames can be accessed in place once mapped
+    static const char padding[RAW_ALIGNMENT] = {0};
+    write(padding, (RAW_ALIGNMENT - position % RAW_ALIGNMENT) % RAW_ALIGNMENT);
+    info.frames.push_back(RawDataSetInfo::Frame {position, elements});
+    write(data, elements*info.elementSize);
+}
+
+void RawTrajectoryWriter::close() {
+    if(!file)
+        return;
+    uint64_t indexOffset = position;
+    for(auto &info: datasets) {
+        uint32_t nameLength = (uint32_t)info.name.size();
+        write(&nameLength, sizeof(nameLength));
+        write(info.name.data(), nameLength);
+        uint8_t flags[4] = {info.typeClass, info.elementSize, info.ragged, info.columnMajor};
+        write(flags, sizeof(flags));
+        uint32_t ndims = (uint32_t)info.frameDims.size();
+        write(&ndims, sizeof(ndims));
+        write(info.frameDims.data(), ndims*sizeof(uint64_t));
+        write(&info.scale, sizeof(double));
+        write(&info.offset, sizeof(double));
+        uint64_t frames = info.frames.size();
+        write(&frames, sizeof(frames));
+        write(info.frames.data(), frames*sizeof(RawDataSetInfo::Frame));
+    }
+
+    char header[RAW_HEADER_SIZE] = {0};
+    memcpy(header, RAW_MAGIC, 8);
+    uint32_t version = RAW_VERSION, count = (uint32_t)datasets.size();
+    memcpy(header + 8, &version, 4);
+    memcpy(header + 12, &count, 4);
+    memcpy(header + 16, &indexOffset, 8);
+    std::fseek(file, 0, SEEK_SET);
+    write(header, sizeof(header));
+    int result = std::fclose(file);
+    file = nullptr;
+    if(result != 0)
+        throw H5::Exception("RawTrajectory", "Could not close the raw trajectory");
+}
+
+RawTrajectory::RawTrajectory(std::string path) {
+    int descriptor = open(path.c_str(), O_RDONLY);
+    if(descriptor < 0)
+        throw H5::Exception("RawTrajectory", "Could not open " + path);
+    struct stat status;
+    if(fstat(descriptor, &status) != 0 || status.st_size < RAW_HEADER_SIZE) {
+        ::close(descriptor);
+        throw H5::Exception("RawTrajectory", "Not a raw trajectory: " + path);
+    }
+    length = status.st_size;
+    void *mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, descriptor, 0);
+    ::close(descriptor);
+    if(mapped == MAP_FAILED)
+        throw H5::Exception("RawTrajectory", "Could not map " + path);
+    mapping = static_cast<const char *>(mapped);
+
+    try {
+        uint32_t version, count;
+        uint64_t position;
+        memcpy(&version, mapping + 8, 4);
+        memcpy(&count, mapping + 12, 4);
+        memcpy(&position, mapping + 16, 8);
+        if(memcmp(mapping, RAW_MAGIC, 8) != 0 || version != RAW_VERSION || position < RAW_HEADER_SIZE)
+            throw H5::Exception("RawTrajectory", "Not a complete raw trajectory: " + path);
+
+        auto read = [this, &position, &path](void *target, uint64_t bytes) {
+            if(position + bytes > length)
+                throw H5::Exception("RawTrajectory", "Truncated index: " + path);
+            memcpy(target, mapping + position, bytes);
+            position += bytes;
+        };
+        for(uint32_t i = 0; i < count; i++) {
+            RawDataSetInfo info;
+            uint32_t nameLength, ndims;
+            read(&nameLength, sizeof(nameLength));
+            info.name.resize(nameLength);
+            read(&info.name[0], nameLength);
+            uint8_t flags[4];
+            read(flags, sizeof(flags));
+            info.typeClass = (RawTypeClass)flags[0];
+            info.elementSize = flags[1];
+            info.ragged = flags[2] != 0;
+            info.columnMajor = flags[3] != 0;
+            read(&ndims, sizeof(ndims));
+            info.frameDims.resize(ndims);
+            read(info.frameDims.data(), ndims*sizeof(uint64_t));
+            read(&info.scale, sizeof(double));
+            read(&info.offset, sizeof(double));
+            uint64_t frames;
+            read(&frames, sizeof(frames));
+            if(frames > (length - position)/sizeof(RawDataSetInfo::Frame))
+                throw H5::Exception("RawTrajectory", "Truncated index: " + path);
+            info.frames.resize(frames);
+            read(info.frames.data(), frames*sizeof(RawDataSetInfo::Frame));
+            for(auto &frame: info.frames)
+                if(frame.offset + frame.elements*info.elementSize > length)
+                    throw H5::Exception("RawTrajectory", "Frame exceeds the file: " + info.name);
+            names[info.name] = datasets.size();
+            datasets.push_back(info);
+        }
+    } catch(...) {
+        munmap(const_cast<char *>(mapping), length);
+        throw;
+    }
+}
+
+RawTrajectory::~RawTrajectory() {
+    munmap(const_cast<char *>(mapping), length);
+}
+
+const RawDataSetInfo &RawTrajectory::getDataSet(std::string name) const {
+    auto index = names.find(name);
+    if(index == names.end())
+        throw H5::Exception("RawTrajectory", "No such dataset: " + name);
+    return datasets[index->second];
+}
+
+const RawDataSetInfo::Frame &RawTrajectory::getFrameLocation(const RawDataSetInfo &info, uint64_t frame) const {
+    if(frame >= info.frames.size())
+        throw H5::Exception("RawTrajectory", "Frame index exceeds the stored frames of " + info.name);
+    return info.frames[frame];
+}
+
+const char *RawTrajectory::getFrameBytes(std::string name, uint64_t frame) const {
+    return mapping + getFrameLocation(getDataSet(name), frame).offset;
+}
+
+namespace {
+    // All datasets with an extendable first dimension are frame datasets
+    void collectFrameDataSets(H5::Group group, std::vector<H5::DataSet> &found) {
+        for(hsize_t i = 0; i < group.getNumObjs(); i++) {
+            std::string name = group.getObjnameByIdx(i);
+            if(group.childObjType(i) == H5O_TYPE_GROUP) {
+                collectFrameDataSets(group.openGroup(name), found);
+                continue;
+            }
+            if(group.childObjType(i) != H5O_TYPE_DATASET)
+                continue;
+            H5::DataSet data = group.openDataSet(name);
+            H5::DataSpace space = data.getSpace();
+            if(space.getSimpleExtentType() != H5S_SIMPLE)
+                continue;
+            int ndims = space.getSimpleExtentNdims();
+            std::vector<hsize_t> dims(ndims), maxDims(ndims);
+            space.getSimpleExtentDims(dims.data(), maxDims.data());
+            H5T_class_t typeClass = data.getTypeClass();
+            if(maxDims[0] == H5S_UNLIMITED && (typeClass == H5T_FLOAT || typeClass == H5T_INTEGER))
+                found.push_back(data);
+        }
+    }
+}
+
+void RawTrajectory::fromHdf5(std::string hdf5Path, std::string rawPath) {
+    H5::H5File input(hdf5Path, H5F_ACC_RDONLY);
+    std::vector<H5::DataSet> frameDataSets;
+    collectFrameDataSets(input.openGroup("/"), frameDataSets);
+
+    RawTrajectoryWriter writer(rawPath);
+    for(auto &data: frameDataSets) {
+        H5::DataSpace space = data.getSpace();
+        int ndims = space.getSimpleExtentNdims();
+        std::vector<hsize_t> dims(ndims);
+        space.getSimpleExtentDims(dims.data());
+        // Elements are copied in the file type, no conversion happens
+        H5::DataType type = data.getDataType();
+
+        RawDataSetInfo info = RawDataSetInfo::fromHdf5(data, ndims == 1);
+        size_t index = writer.addDataSet(info);
+        if(ndims > 1) {
+            std::vector<hsize_t> start(ndims, 0), count(dims);
+            count[0] = 1;
+            hsize_t elements = space.getSelectNpoints()/dims[0];
+            H5::DataSpace memorySpace(1, &elements);
+            std::vector<char> frame(elements*type.getSize());
+            for(hsize_t t = 0; t < dims[0]; t++) {
+                start[0] = t;
+                space.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+                data.read(frame.data(), type, memorySpace, space);
+                writer.appendFrame(index, frame.data(), elements);
+            }
+            continue;
+        }
+
+        // Rows of dynamic populations are split at the frame offsets stored next to them, all other one
+        // dimensional datasets hold one value per frame
+        std::vector<unsigned long long> offsets;
+        std::string name = info.name.substr(info.name.rfind('/') + 1);
+        std::string groupPath = info.name.substr(0, info.name.rfind('/') + 1);
+        if(name != "Frame offsets" && input.nameExists(groupPath + "Frame offsets")) {
+            H5::DataSet offsetData = input.openDataSet(groupPath + "Frame offsets");
+            offsets.resize(offsetData.getSpace().getSimpleExtentNpoints());
+            if(!offsets.empty())
+                offsetData.read(offsets.data(), H5::PredType::NATIVE_ULLONG);
+        } else {
+            for(hsize_t row = 0; row < dims[0]; row++)
+                offsets.push_back(row);
+        }
+        std::vector<char> rows(dims[0]*type.getSize());
+        if(!rows.empty())
+            data.read(rows.data(), type);
+        for(size_t f = 0; f < offsets.size(); f++) {
+            unsigned long long end = f + 1 < offsets.size() ? offsets[f + 1] : dims[0];
+            writer.appendFrame(index, rows.data() + offsets[f]*type.getSize(), end - offsets[f]);
+        }
+    }
+    writer.close();
+}
+
+void RawTrajectory::toHdf5(std::string rawPath, std::string parametersPath, std::string hdf5Path) {
+    RawTrajectory trajectory(rawPath);
+    {
+        std::ifstream source(parametersPath, std::ios::binary);
+        std::ofstream target(hdf5Path, std::ios::binary | std::ios::trunc);
+        if(!source || !target)
+            throw H5::Exception("RawTrajectory", "Could not copy " + parametersPath + " to " + hdf5Path);
+        target << source.rdbuf();
+    }
+
+    H5::H5File output(hdf5Path, H5F_ACC_RDWR);
+    for(auto &info: trajectory.getDataSets()) {
+        H5::DataSet data = output.openDataSet(info.name);
+        H5::DataType type = data.getDataType();
+        if(type.getSize() != info.elementSize)
+            throw H5::Exception("RawTrajectory", "Stored type does not match the dataset " + info.name);
+        H5::DataSpace space = data.getSpace();
+        int ndims = space.getSimpleExtentNdims();
+        std::vector<hsize_t> dims(ndims);
+        space.getSimpleExtentDims(dims.data());
+        if(dims[0] != 0)
+            throw H5::Exception("RawTrajectory", "Dataset already contains frames: " + info.name);
+
+        hsize_t total = 0;
+        for(auto &frame: info.frames)
+            total += info.ragged ? frame.elements : 1;
+        dims[0] = total;
+        data.extend(dims.data());
+        space = data.getSpace();
+
+        std::vector<hsize_t> start(ndims, 0), count(dims);
+        for(auto &frame: info.frames) {
+            count[0] = info.ragged ? frame.elements : 1;
+            if(count[0] == 0)
+                continue;
+            space.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+            hsize_t elements = frame.elements;
+            H5::DataSpace memorySpace(1, &elements);
+            data.write(trajectory.mapping + frame.offset, type, memorySpace, space);
+            start[0] += count[0];
+        }
+    }
+}
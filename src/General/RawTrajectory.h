@@ -0,0 +1,132 @@
+//
+// Self-describing binary trajectory format, written instead of HDF5 frames and read through mmap
+//
+
+#ifndef BACTSIM_GPU_RAWTRAJECTORY_H
+#define BACTSIM_GPU_RAWTRAJECTORY_H
+
+#include <H5Cpp.h>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+
+/**
+ * File layout (little endian):
+ *   header      magic "BSIMRAW1", uint32 version, uint32 number of datasets, uint64 offset of the index
+ *   frames      the frames of all datasets in the order they were saved, every frame starts 8 byte aligned
+ *   index       per dataset: uint32 name length, name, uint8 type class, uint8 element size, uint8 ragged,
+ *               uint8 column major, uint32 ndims, uint64 frame dims[ndims], double quantization scale and offset,
+ *               uint64 number of frames, and (uint64 offset, uint64 elements) for every frame
+ *
+ * Dataset names are the paths of the corresponding HDF5 datasets, e.g. "/Populations/Population 1/xpos". Elements
+ * are stored exactly as in the HDF5 file type of the dataset (including half precision and quantized fields), frames
+ * of fixed size datasets have a fixed stride, ragged datasets store a variable number of rows per frame. The index
+ * is written when the file is closed, an interrupted simulation leaves an unreadable file.
+ */
+enum RawTypeClass : uint8_t {
+    RAW_FLOAT = 0,
+    RAW_SIGNED = 1,
+    RAW_UNSIGNED = 2
+};
+
+struct RawDataSetInfo {
+    std::string name;
+    RawTypeClass typeClass = RAW_FLOAT;
+    uint8_t elementSize = 8;
+    bool ragged = false;
+    // Two dimensional frames stored as (columns, rows), see StorageSettings::columnMajorFrames
+    bool columnMajor = false;
+    // Shape of a single frame, empty for ragged datasets
+    std::vector<uint64_t> frameDims;
+    // Quantized fields store round((value - offset)/scale), a scale of 0 marks regular fields
+    double scale = 0;
+    double offset = 0;
+
+    struct Frame {
+        uint64_t offset;
+        uint64_t elements;
+    };
+    std::vector<Frame> frames;
+
+    // Description of a frame dataset of a HDF5 file, ragged datasets are one dimensional
+    static RawDataSetInfo fromHdf5(H5::DataSet &data, bool ragged);
+};
+
+class RawTrajectoryWriter {
+public:
+    RawTrajectoryWriter(std::string path);
+    // Closes the file if close was not called
+    ~RawTrajectoryWriter();
+
+    // Datasets are identified by the returned index
+    size_t addDataSet(RawDataSetInfo info);
+    // Appends a frame in the element type of the dataset, fixed size datasets ignore elements
+    void appendFrame(size_t dataset, const void *data, uint64_t elements);
+    // Writes the index, the file is complete afterwards
+    void close();
+
+private:
+    void write(const void *data, size_t bytes);
+
+    std::FILE *file = nullptr;
+    uint64_t position = 0;
+    std::vector<RawDataSetInfo> datasets;
+};
+
+template <class T> struct RawSpan {
+    const T *data = nullptr;
+    size_t size = 0;
+    const T *begin() const { return data; }
+    const T *end() const { return data + size; }
+    const T &operator[](size_t i) const { return data[i]; }
+};
+
+/**
+ * Read only view of a raw trajectory file. The file is mapped into memory, frames are returned as spans pointing
+ * into the mapping without copies. They stay valid as long as the RawTrajectory exists.
+ */
+class RawTrajectory {
+public:
+    RawTrajectory(std::string path);
+    ~RawTrajectory();
+    RawTrajectory(const RawTrajectory &) = delete;
+    RawTrajectory &operator=(const RawTrajectory &) = delete;
+
+    const std::vector<RawDataSetInfo> &getDataSets() const { return datasets; }
+    bool has(std::string name) const { return names.find(name) != names.end(); }
+    const RawDataSetInfo &getDataSet(std::string name) const;
+
+    // T has to match the size of the stored elements, e.g. double for default precision fields
+    template <class T> RawSpan<T> getFrame(std::string name, uint64_t frame) const {
+        const RawDataSetInfo &info = getDataSet(name);
+        if(sizeof(T) != info.elementSize)
+            throw H5::Exception("RawTrajectory", "Element size does not match the stored type of " + name);
+        RawSpan<T> span;
+        const RawDataSetInfo::Frame &location = getFrameLocation(info, frame);
+        span.data = reinterpret_cast<const T *>(mapping + location.offset);
+        span.size = location.elements;
+        return span;
+    }
+    template <class T> RawSpan<T> getPopulationFrame(std::string population, std::string field, uint64_t frame) const {
+        return getFrame<T>("/Populations/" + population + "/" + field, frame);
+    }
+    const char *getFrameBytes(std::string name, uint64_t frame) const;
+
+    // Converters between the formats. Raw trajectories do not contain parameters, converting back fills the frame
+    // datasets of a copy of the HDF5 file written alongside the raw trajectory.
+    static void fromHdf5(std::string hdf5Path, std::string rawPath);
+    static void toHdf5(std::string rawPath, std::string parametersPath, std::string hdf5Path);
+
+private:
+    const RawDataSetInfo::Frame &getFrameLocation(const RawDataSetInfo &info, uint64_t frame) const;
+
+    const char *mapping = nullptr;
+    size_t length = 0;
+    std::vector<RawDataSetInfo> datasets;
+    std::map<std::string, size_t> names;
+};
+
+
+#endif //BACTSIM_GPU_RAWTRAJECTORY_H
@@ -3,8 +3,623 @@
 //
 
 #include "StorageHelper.h"
+#include "Types.h"
+#include "SyncCounter.h"
+#include "Profiler.h"
+#include "Tracer.h"
+#include <map>
+#include <cmath>
+#include <cstdint>
+#include <future>
 
 H5::DataSpace StorageHelper::H5Scalar = {H5S_SCALAR};
 
 H5::StrType StorageHelper::H5VariableString = {0, H5T_VARIABLE};
 
+
+AsyncWriter *StorageHelper::asyncWriter = nullptr;
+
+RawTrajectoryWriter *StorageHelper::rawWriter = nullptr;
+
+std::map<hid_t, StorageHelper::RawTarget> StorageHelper::rawTargets;
+
+std::unique_ptr<StorageHelper::StorageBatch> StorageHelper::activeBatch;
+
+StorageSettings StorageHelper::storageSettings;
+
+std::unique_ptr<CompressionPipeline> StorageHelper::compression;
+
+DSetCreatPropList StorageHelper::createFrameProperties(int ndims, const hsize_t *dims) {
+    std::vector<hsize_t> chunk(dims, dims + ndims);
+    chunk[0] = std::max(storageSettings.chunkFrames, (hsize_t)1);
+    hsize_t spatial[2] = {storageSettings.chunkRows, storageSettings.chunkColumns};
+    // One dimensional frames are chunked like a single row
+    for(int i = 1; i < ndims; i++) {
+        hsize_t requested = spatial[2 - ndims + i];
+        if(requested > 0)
+            chunk[i] = std::min(requested, dims[i]);
+        chunk[i] = std::max(chunk[i], (hsize_t)1);
+    }
+
+    DSetCreatPropList properties(DSetCreatPropList::DEFAULT);
+    properties.setChunk(ndims, chunk.data());
+    setFilters(properties);
+    return properties;
+}
+
+DSetCreatPropList StorageHelper::createRaggedProperties(hsize_t rowsPerFrame) {
+    // Ragged rows do not align with chunks, these datasets are compressed by the HDF5 filter pipeline
+    hsize_t chunk = std::max(storageSettings.raggedChunkFrames, (hsize_t)1)*std::max(rowsPerFrame, (hsize_t)1);
+    DSetCreatPropList properties(DSetCreatPropList::DEFAULT);
+    properties.setChunk(1, &chunk);
+    setFilters(properties);
+    return properties;
+}
+
+DSetCreatPropList StorageHelper::createPopulationProperties(hsize_t bacteria) {
+    hsize_t dims[2] = {H5S_UNLIMITED, bacteria};
+    DSetCreatPropList properties = createFrameProperties(2, dims);
+    hsize_t chunk[2];
+    properties.getChunk(2, chunk);
+    if(storageSettings.populationChunkFrames > 0)
+        chunk[0] = storageSettings.populationChunkFrames;
+    if(storageSettings.populationChunkBacteria > 0)
+        chunk[1] = std::max(std::min(storageSettings.populationChunkBacteria, bacteria), (hsize_t)1);
+    // All frames of a row of tiles are buffered uncompressed, the fields of a population share these properties
+    // and may be stored as doubles
+    hsize_t frameBytes = std::max(bacteria, (hsize_t)1)*sizeof(double);
+    chunk[0] = std::max(std::min(chunk[0], storageSettings.populationBufferBytes/frameBytes), (hsize_t)1);
+    properties.setChunk(2, chunk);
+    return properties;
+}
+
+DSetAccPropList StorageHelper::createPopulationAccess(const DSetCreatPropList &properties, hsize_t bacteria,
+                                                      size_t elementSize) {
+    DSetAccPropList access;
+    if(properties.getLayout() != H5D_CHUNKED || properties.getChunk(0, nullptr) != 2)
+        return access;
+    hsize_t chunk[2];
+    properties.getChunk(2, chunk);
+    hsize_t tiles = (bacteria + chunk[1] - 1)/std::max(chunk[1], (hsize_t)1);
+    if(tiles <= 1)
+        return access;
+    // Every save writes one frame into each tile of a row, evicting them before the row is complete would rewrite
+    // (and for compressed datasets recompress) the tiles for every frame
+    access.setChunkCache(tiles*10 + 1, tiles*chunk[0]*chunk[1]*elementSize, 1.0);
+    return access;
+}
+
+void StorageHelper::setFilters(DSetCreatPropList &properties) {
+    if(storageSettings.deflateLevel > 0) {
+        if(storageSettings.shuffle)
+            properties.setShuffle();
+        properties.setDeflate(storageSettings.deflateLevel);
+    }
+}
+
+void StorageHelper::flushCompression() {
+    if(compression)
+        compression->flush();
+}
+
+std::map<hid_t, StorageHelper::CachedQuantization> StorageHelper::quantizationCache;
+
+std::set<hid_t> StorageHelper::columnMajorDataSets;
+
+void StorageHelper::releaseDataSets() {
+    quantizationCache.clear();
+    columnMajorDataSets.clear();
+    rawTargets.clear();
+}
+
+hsize_t StorageHelper::getFrameCount(DataSet data) {
+    DataSpace space = data.getSpace();
+    std::vector<hsize_t> dims(space.getSimpleExtentNdims());
+    space.getSimpleExtentDims(dims.data());
+    return dims[0];
+}
+
+std::vector<double> StorageHelper::readFrameToHost(DataSet data, hsize_t frame) {
+    DataSpace space = data.getSpace();
+    int ndims = space.getSimpleExtentNdims();
+    std::vector<hsize_t> dims(ndims);
+    space.getSimpleExtentDims(dims.data());
+    if(frame >= dims[0])
+        throw Exception("StorageHelper", "Frame index exceeds the stored frames (readFrameToHost)");
+
+    std::vector<hsize_t> start(ndims, 0), count(dims);
+    start[0] = frame;
+    count[0] = 1;
+    space.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+    hsize_t elements = space.getSelectNpoints();
+    DataSpace memorySpace(1, &elements);
+    std::vector<double> values(elements);
+    data.read(values.data(), PredType::NATIVE_DOUBLE, memorySpace, space);
+    double scale, offset;
+    if(getQuantization(data, scale, offset))
+        for(auto &value: values)
+            value = value*scale + offset;
+
+    // Column major frames are stored as (columns, rows)
+    if(ndims == 3 && isColumnMajor(data)) {
+        std::vector<double> rowMajor(elements);
+        for(hsize_t c = 0; c < dims[1]; c++)
+            for(hsize_t r = 0; r < dims[2]; r++)
+                rowMajor[r*dims[1] + c] = values[c*dims[2] + r];
+        values.swap(rowMajor);
+    }
+    return values;
+}
+
+FieldStorage StorageHelper::getFieldStorage(std::string name) {
+    auto specific = storageSettings.fieldStorage.find(name);
+    if(specific != storageSettings.fieldStorage.end())
+        return specific->second;
+    return storageSettings.defaultStorage;
+}
+
+DataSet StorageHelper::createRealDataSet(Group &group, std::string name, const DataSpace &space,
+                                         const DSetCreatPropList &properties, const DSetAccPropList &access) {
+    FieldStorage field = getFieldStorage(name);
+
+    DataType type;
+    switch(field.precision) {
+        case PRECISION_NATIVE:
+            type = sizeof(GPU_REALTYPE) == 4 ? PredType::IEEE_F32LE : PredType::IEEE_F64LE;
+            break;
+        case PRECISION_HALF: {
+            // 1 sign bit, 5 exponent bits and 10 mantissa bits, HDF5 converts from and to native floats
+            FloatType half(PredType::IEEE_F32LE);
+            half.setFields(15, 10, 5, 0, 10);
+            half.setOffset(0);
+            half.setPrecision(16);
+            half.setSize(2);
+            half.setEbias(15);
+            type = half;
+            break;
+        }
+        case PRECISION_QUANTIZED:
+            if(field.errorBound <= 0)
+                throw Exception("StorageHelper", "Quantized storage requires a positive error bound");
+            type = PredType::STD_I32LE;
+            break;
+        default:
+        case PRECISION_DOUBLE:
+            type = PredType::IEEE_F64LE;
+            break;
+    }
+
+    // Chunk caches of population tiles hold one row of tiles in the element size of this field, they are the only
+    // caches configured by the callers
+    DSetAccPropList fieldAccess = access;
+    size_t slots, bytes, defaultSlots, defaultBytes;
+    double preemption, defaultPreemption;
+    access.getChunkCache(slots, bytes, preemption);
+    DSetAccPropList::DEFAULT.getChunkCache(defaultSlots, defaultBytes, defaultPreemption);
+    bool cacheConfigured = slots != defaultSlots || bytes != defaultBytes || preemption != defaultPreemption;
+    if(cacheConfigured && space.getSimpleExtentNdims() == 2) {
+        hsize_t dims[2];
+        space.getSimpleExtentDims(dims);
+        fieldAccess = createPopulationAccess(properties, dims[1], type.getSize());
+    }
+
+    DataSet dataset = group.createDataSet(name, type, space, properties, fieldAccess);
+    if(field.precision == PRECISION_QUANTIZED) {
+        double scale = 2*field.errorBound;
+        dataset.createAttribute("Quantization scale", PredType::IEEE_F64LE, H5Scalar).write(PredType::NATIVE_DOUBLE, &scale);
+        dataset.createAttribute("Quantization offset", PredType::IEEE_F64LE, H5Scalar).write(PredType::NATIVE_DOUBLE, &field.offset);
+    }
+    return dataset;
+}
+
+array StorageHelper::toStoredPrecision(const array &values, std::string name) {
+    FieldStorage field = getFieldStorage(name);
+    switch(field.precision) {
+        case PRECISION_HALF: {
+            // 11 significant bits, below the smallest normal half float 2^-14 the step is fixed at 2^-24
+            array exponent = max(floor(log2(abs(values))), -14.0);
+            array step = pow(2.0, exponent - 10);
+            return round(values/step)*step;
+        }
+        case PRECISION_QUANTIZED: {
+            double scale = 2*field.errorBound;
+            return clamp(round((values - field.offset)/scale), (double)INT32_MIN, (double)INT32_MAX)*scale + field.offset;
+        }
+        default:
+            // Native and double precision hold all values of the simulation exactly
+            return values;
+    }
+}
+
+bool StorageHelper::getQuantization(DataSet &data, double &scale, double &offset) {
+    if(!data.attrExists("Quantization scale"))
+        return false;
+    data.openAttribute("Quantization scale").read(PredType::NATIVE_DOUBLE, &scale);
+    data.openAttribute("Quantization offset").read(PredType::NATIVE_DOUBLE, &offset);
+    return true;
+}
+
+DataSet StorageHelper::createFrameDataSet(Group &group, std::string name, hsize_t rows, hsize_t columns,
+                                          const DataType *fileType) {
+    // Only the time dimension (first) will be extended, chunk shape and compression follow the storage settings
+    hsize_t max_dims[3] = {H5S_UNLIMITED, rows, columns};
+    DSetCreatPropList properties = createFrameProperties(3, max_dims);
+    bool columnMajor = storageSettings.columnMajorFrames;
+    if(columnMajor) {
+        hsize_t chunk[3];
+        properties.getChunk(3, chunk);
+        std::swap(chunk[1], chunk[2]);
+        properties.setChunk(3, chunk);
+        std::swap(max_dims[1], max_dims[2]);
+    }
+    hsize_t initial_dims[3] = {0, max_dims[1], max_dims[2]};
+    DataSpace dataSpace(3, initial_dims, max_dims);
+
+    DataSet dataset = fileType ? group.createDataSet(name, *fileType, dataSpace, properties)
+                               : createRealDataSet(group, name, dataSpace, properties);
+    if(columnMajor) {
+        dataset.createAttribute("Layout", H5VariableString, H5Scalar).write(H5VariableString, std::string("Column major"));
+        columnMajorDataSets.insert(dataset.getId());
+    } else
+        columnMajorDataSets.erase(dataset.getId());
+    return dataset;
+}
+
+bool StorageHelper::isColumnMajor(DataSet &data) {
+    if(!data.attrExists("Layout"))
+        return false;
+    std::string layout;
+    data.openAttribute("Layout").read(H5VariableString, layout);
+    return layout == "Column major";
+}
+
+bool StorageHelper::readFrameLayout(DataSet &data) {
+    bool columnMajor = isColumnMajor(data);
+    if(columnMajor)
+        columnMajorDataSets.insert(data.getId());
+    else
+        columnMajorDataSets.erase(data.getId());
+    return columnMajor;
+}
+
+const void *StorageHelper::quantize(DataSet &target, const DataType &H5MemoryType, const void *hostMem, hsize_t count,
+                                    std::vector<int> &quantized, const DataType *&memoryType) {
+    auto cached = quantizationCache.find(target.getId());
+    if(cached == quantizationCache.end()) {
+        CachedQuantization quantization {target, false, 1, 0};
+        quantization.quantized = getQuantization(target, quantization.scale, quantization.offset);
+        cached = quantizationCache.insert(std::make_pair(target.getId(), quantization)).first;
+    }
+    if(!cached->second.quantized)
+        return hostMem;
+
+    // Convert to double first, the memory type of the caller is arbitrary
+    std::vector<double> values(count);
+    std::vector<char> converted(count*std::max(H5MemoryType.getSize(), sizeof(double)));
+    memcpy(converted.data(), hostMem, count*H5MemoryType.getSize());
+    if(H5Tconvert(H5MemoryType.getId(), H5T_NATIVE_DOUBLE, count, converted.data(), NULL, H5P_DEFAULT) < 0)
+        throw Exception("StorageHelper", "Could not convert to double (quantize)");
+    memcpy(values.data(), converted.data(), count*sizeof(double));
+
+    // Infinite values saturate, NaN has no fixed point representation
+    quantized.resize(count);
+    for(hsize_t i = 0; i < count; i++) {
+        double level = std::round((values[i] - cached->second.offset)/cached->second.scale);
+        if(std::isnan(level))
+            throw Exception("StorageHelper", "NaN can not be stored in a quantized dataset (quantize)");
+        quantized[i] = static_cast<int>(std::max(std::min(level, (double)INT32_MAX), (double)INT32_MIN));
+    }
+    memoryType = &PredType::NATIVE_INT;
+    return quantized.data();
+}
+
+std::shared_ptr<std::vector<char>> StorageHelper::acquireBuffer(size_t bytes) {
+    if(asyncWriter)
+        return asyncWriter->acquireBuffer(bytes);
+    return std::make_shared<std::vector<char>>(bytes);
+}
+
+std::shared_ptr<std::vector<char>> StorageHelper::stageToHost(array data) {
+    // Copy from the device into a (recycled) staging buffer, the element type is kept as is
+    std::shared_ptr<std::vector<char>> buffer = acquireBuffer(data.bytes());
+    if(data.elements()) {
+        SyncCounter::record("StorageHelper::stageToHost");
+        data.host(buffer->data());
+    }
+    return buffer;
+}
+
+void StorageHelper::submit(DataSet &target, const DataType &H5MemoryType, std::shared_ptr<std::vector<char>> buffer,
+                           size_t offset, bool ragged, hsize_t count) {
+    if(asyncWriter) {
+        asyncWriter->enqueue(WriteJob {&target, &H5MemoryType, buffer, offset, ragged, count});
+        return;
+    }
+    if(ragged)
+        writeRows(target, H5MemoryType, buffer->data() + offset, count);
+    else
+        writeFrame(target, H5MemoryType, buffer->data() + offset);
+}
+
+void StorageHelper::beginBatch() {
+    if(activeBatch)
+        throw Exception("StorageHelper", "A storage batch is already active");
+    activeBatch.reset(new StorageBatch());
+}
+
+void StorageHelper::commitBatch() {
+    if(!activeBatch)
+        return;
+    // Reset first, so a failing write does not leave a half committed batch active
+    std::unique_ptr<StorageBatch> batch(std::move(activeBatch));
+    batch->commit();
+}
+
+void StorageHelper::StorageBatch::add(array data, DataSet &target, const DataType &H5MemoryType, bool ragged) {
+    entries.push_back(Entry {flat(data), &target, &H5MemoryType, ragged});
+}
+
+void StorageHelper::StorageBatch::commit() {
+    // Device memory can only be packed without conversion for equal element types, pack one buffer per type
+    std::map<af::dtype, std::vector<size_t>> groups;
+    for(size_t i = 0; i < entries.size(); i++)
+        groups[entries[i].data.type()].push_back(i);
+
+    for(auto &group: groups) {
+        dim_t total = 0;
+        for(auto i: group.second)
+            total += entries[i].data.elements();
+        if(total == 0)
+            continue;
+
+        array packed(total, group.first);
+        dim_t offset = 0;
+        for(auto i: group.second) {
+            dim_t n = entries[i].data.elements();
+            if(n)
+                packed(seq(offset, offset + n - 1)) = entries[i].data;
+            offset += n;
+        }
+
+        // Single download, every entry is written from its own slice of the staging buffer
+        std::shared_ptr<std::vector<char>> buffer = stageToHost(packed);
+        size_t elementSize = packed.bytes()/total;
+        offset = 0;
+        for(auto i: group.second) {
+            Entry &entry = entries[i];
+            dim_t n = entry.data.elements();
+            submit(*entry.target, *entry.memoryType, buffer, offset*elementSize, entry.ragged, n);
+            offset += n;
+        }
+    }
+    entries.clear();
+}
+
+void StorageHelper::writeFrame(DataSet &target, const DataType &memoryType, const void *frame) {
+    Tracer::Scope trace("Write frame");
+    // read dims from HDF5
+    DataSpace targetSpace = target.getSpace();
+    int ndims = targetSpace.getSimpleExtentNdims();
+    std::vector<hsize_t> dims(ndims);
+    targetSpace.getSimpleExtentDims(dims.data());
+
+    // Fixed point datasets are written from quantized values
+    hsize_t frameElements = 1;
+    for(int i = 1; i < ndims; i++)
+        frameElements *= dims[i];
+    std::vector<int> quantized;
+    const DataType *H5MemoryType = &memoryType;
+    const void *hostMem = quantize(target, memoryType, frame, frameElements, quantized, H5MemoryType);
+    Profiler::countBytesWritten(frameElements*H5MemoryType->getSize());
+    if(rawWriter) {
+        writeRaw(target, *H5MemoryType, hostMem, frameElements, false);
+        return;
+    }
+
+    // Compressed datasets are written chunk wise by the pipeline
+    if(storageSettings.deflateLevel > 0) {
+        if(!compression)
+            compression.reset(new CompressionPipeline(storageSettings.compressionThreads));
+        if(compression->appendFrame(target, *H5MemoryType, hostMem))
+            return;
+    }
+
+    // extend dims to contain another timepoint
+    std::vector<hsize_t> newdims(dims);
+    newdims[0] += 1;
+    target.extend(newdims.data());
+    targetSpace = target.getSpace();
+
+    // select region for storage
+    std::vector<hsize_t> start(ndims, 0);
+    std::vector<hsize_t> count(dims);
+    start[0] = dims[0];
+    count[0] = 1;
+    targetSpace.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+
+    // calculate source space
+    hsize_t nelements = 1;
+    for(int  i = 1; i < ndims; i++)
+        nelements *= dims[i];
+    H5::DataSpace sourceSpace(1, &nelements);
+
+    target.write(hostMem, *H5MemoryType, sourceSpace, targetSpace);
+}
+
+void StorageHelper::writeRaw(DataSet &target, const DataType &H5MemoryType, const void *hostMem, hsize_t count,
+                             bool ragged) {
+    auto cached = rawTargets.find(target.getId());
+    if(cached == rawTargets.end()) {
+        RawTarget raw {rawWriter->addDataSet(RawDataSetInfo::fromHdf5(target, ragged)), target.getDataType()};
+        cached = rawTargets.insert(std::make_pair(target.getId(), raw)).first;
+    }
+
+    // Raw trajectories store the file type of the dataset, convert like HDF5 would
+    const DataType &fileType = cached->second.fileType;
+    std::vector<char> converted(count*std::max(fileType.getSize(), H5MemoryType.getSize()));
+    if(count) {
+        memcpy(converted.data(), hostMem, count*H5MemoryType.getSize());
+        if(H5Tconvert(H5MemoryType.getId(), fileType.getId(), count, converted.data(), NULL, H5P_DEFAULT) < 0)
+            throw Exception("StorageHelper", "Could not convert to the file type (writeRaw)");
+    }
+    rawWriter->appendFrame(cached->second.index, converted.data(), count);
+}
+
+void StorageHelper::writeRows(DataSet &target, const DataType &memoryType, const void *rows, hsize_t count) {
+    Tracer::Scope trace("Write rows");
+    std::vector<int> quantized;
+    const DataType *H5MemoryType = &memoryType;
+    const void *hostMem = quantize(target, memoryType, rows, count, quantized, H5MemoryType);
+    Profiler::countBytesWritten(count*H5MemoryType->getSize());
+    if(rawWriter) {
+        writeRaw(target, *H5MemoryType, hostMem, count, true);
+        return;
+    }
+
+    DataSpace targetSpace = target.getSpace();
+    hsize_t length;
+    targetSpace.getSimpleExtentDims(&length);
+
+    hsize_t newLength = length + count;
+    target.extend(&newLength);
+    targetSpace = target.getSpace();
+    targetSpace.selectHyperslab(H5S_SELECT_SET, &count, &length);
+    DataSpace sourceSpace(1, &count);
+    target.write(hostMem, *H5MemoryType, sourceSpace, targetSpace);
+}
+
+StorageHelper::RestartReader::~RestartReader() {
+    for(auto buffer: staging)
+        if(buffer)
+            af::freePinned(buffer);
+}
+
+void StorageHelper::RestartReader::add(DataSet data, array &target, const DataType &H5MemoryType, dtype arrayfireType) {
+    DataSpace space = data.getSpace();
+    int ndims = space.getSimpleExtentNdims();
+    std::vector<hsize_t> dims(ndims);
+    space.getSimpleExtentDims(dims.data());
+    if(dims[0] == 0)
+        throw Exception("StorageHelper", "Dataset does not contain any frame (RestartReader)");
+
+    // Only select the last timepoint
+    std::vector<hsize_t> start(ndims, 0), count(dims);
+    start[0] = dims[0] - 1;
+    count[0] = 1;
+    space.selectHyperslab(H5S_SELECT_SET, count.data(), start.data());
+
+    Job job {data, space, H5MemoryType, arrayfireType, &target};
+    job.elements = space.getSelectNpoints();
+    // HDF5 is row major, the reversed dimensions describe the same memory in the column major order of ArrayFire
+    switch(ndims - 1) {
+        case 1:
+            job.dims = dim4(dims[1]);
+            break;
+        case 2:
+            job.dims = dim4(dims[2], dims[1]);
+            break;
+        case 3:
+            job.dims = dim4(dims[3], dims[2], dims[1]);
+            break;
+        default:
+            throw Exception("StorageHelper", "Unexpected number of dimensions (RestartReader)");
+    }
+    // Row major frames have to be transposed to (rows, columns) once they are on the device
+    job.transpose = ndims == 3 && !readFrameLayout(data);
+    job.quantized = getQuantization(data, job.scale, job.offset);
+    jobs.push_back(job);
+}
+
+void StorageHelper::RestartReader::addRagged(DataSet data, DataSet frameOffsets, array &target,
+                                             const DataType &H5MemoryType, dtype arrayfireType) {
+    // Ragged datasets store all frames back to back, the offsets dataset marks the first row of every frame
+    DataSpace offsetSpace = frameOffsets.getSpace();
+    hsize_t nFrames;
+    offsetSpace.getSimpleExtentDims(&nFrames);
+    if(nFrames == 0)
+        throw Exception("StorageHelper", "Ragged dataset does not contain any frame (RestartReader)");
+    hsize_t lastFrame = nFrames - 1, one = 1;
+    offsetSpace.selectHyperslab(H5S_SELECT_SET, &one, &lastFrame);
+    unsigned long long offset;
+    DataSpace scalarSpace(1, &one);
+    frameOffsets.read(&offset, PredType::NATIVE_ULLONG, scalarSpace, offsetSpace);
+
+    DataSpace space = data.getSpace();
+    hsize_t length;
+    space.getSimpleExtentDims(&length);
+    hsize_t start = offset;
+    hsize_t count = length - offset;
+    if(count == 0) {
+        target = array();
+        return;
+    }
+    space.selectHyperslab(H5S_SELECT_SET, &count, &start);
+
+    Job job {data, space, H5MemoryType, arrayfireType, &target};
+    job.elements = count;
+    job.dims = dim4(count);
+    job.transpose = false;
+    job.quantized = getQuantization(data, job.scale, job.offset);
+    jobs.push_back(job);
+}
+
+void StorageHelper::RestartReader::read(Job &job, void *buffer) {
+    DataSpace memorySpace(1, &job.elements);
+    if(!job.quantized) {
+        job.data.read(buffer, job.memoryType, memorySpace, job.fileSpace);
+        return;
+    }
+    // Fixed point values are converted on the host in double precision before casting to the target type
+    std::vector<double> values(job.elements);
+    job.data.read(values.data(), PredType::NATIVE_DOUBLE, memorySpace, job.fileSpace);
+    for(auto &value: values)
+        value = value*job.scale + job.offset;
+    if(H5Tconvert(H5T_NATIVE_DOUBLE, job.memoryType.getId(), job.elements, values.data(), NULL, H5P_DEFAULT) < 0)
+        throw Exception("StorageHelper", "Could not convert dequantized values (RestartReader)");
+    memcpy(buffer, values.data(), job.elements*job.memoryType.getSize());
+}
+
+void StorageHelper::RestartReader::upload(Job &job, const void *buffer) {
+    array output(job.dims, job.type);
+    output.write(buffer, job.elements*job.memoryType.getSize(), afHost);
+    if(job.transpose)
+        output = output.T();
+    output.eval();
+    // The staging buffer is refilled as soon as this returns
+    af::sync();
+    *job.target = output;
+}
+
+void StorageHelper::RestartReader::load() {
+    if(jobs.empty())
+        return;
+
+    // Two staging buffers: one is uploaded while the next dataset is read into the other
+    size_t bytes = 0;
+    for(auto &job: jobs)
+        bytes = std::max(bytes, (size_t)(job.elements*job.memoryType.getSize()));
+    if(bytes > stagingBytes) {
+        for(auto &buffer: staging) {
+            if(buffer)
+                af::freePinned(buffer);
+            buffer = af::pinned(bytes, u8);
+        }
+        stagingBytes = bytes;
+    }
+
+    std::future<void> reading = std::async(std::launch::async, [this] { read(jobs[0], staging[0]); });
+    for(size_t i = 0; i < jobs.size(); i++) {
+        reading.get();
+        if(i + 1 < jobs.size())
+            reading = std::async(std::launch::async, [this, i] { read(jobs[i + 1], staging[(i + 1)%2]); });
+        try {
+            upload(jobs[i], staging[i%2]);
+        } catch(...) {
+            // The read of the next dataset still uses the staging buffers
+            if(reading.valid())
+                reading.wait();
+            throw;
+        }
+    }
+    jobs.clear();
+}
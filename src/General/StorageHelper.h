@@ -7,123 +7,255 @@
 
 #include <H5Cpp.h>
 #include <arrayfire.h>
+#include <vector>
+#include <cstring>
+#include <memory>
+#include <map>
+#include <set>
+#include "AsyncWriter.h"
+#include "CompressionPipeline.h"
+#include "RawTrajectory.h"
 using namespace af;
 using namespace H5;
 
+enum StoragePrecision {
+    PRECISION_DOUBLE,       // IEEE 754 double, independent of GPU_REALTYPE
+    PRECISION_NATIVE,       // precision of GPU_REALTYPE
+    PRECISION_HALF,         // IEEE 754 half precision
+    PRECISION_QUANTIZED     // 32 bit fixed point with an absolute error bound
+};
+
+struct FieldStorage {
+    StoragePrecision precision = PRECISION_DOUBLE;
+    // Quantized fields store round((value - offset)/(2*errorBound)), the error is therefore at most errorBound
+    double errorBound = 0;
+    double offset = 0;
+};
+
+struct StorageSettings {
+    // Chunk shape of frame datasets (time, rows, columns), a spatial size of 0 uses the full extent
+    hsize_t chunkFrames = 4;
+    hsize_t chunkRows = 0;
+    hsize_t chunkColumns = 0;
+    // Chunk length of ragged population datasets in multiples of the initial population size
+    hsize_t raggedChunkFrames = 4;
+    // Tile shape (time, bacteria) of fixed size population datasets, 0 keeps chunkFrames and the full population.
+    // Tiles of many frames and few bacteria favour reading the history of single bacteria, e.g. 256 x 16. The frames
+    // of the current row of tiles are held uncompressed until the row is complete, in the chunk cache or the
+    // CompressionPipeline, i.e. tile frames x bacteria x element size bytes per field (2 GB for 256 frames of 1e6
+    // doubles). Tile frames are reduced until this stays below populationBufferBytes.
+    hsize_t populationChunkFrames = 0;
+    hsize_t populationChunkBacteria = 0;
+    hsize_t populationBufferBytes = 64 << 20;
+
+    // Lossless compression, a deflate level of 0 disables compression. Frame datasets are compressed in parallel by
+    // a CompressionPipeline with compressionThreads threads (0 uses all cores).
+    int deflateLevel = 0;
+    bool shuffle = true;
+    unsigned int compressionThreads = 0;
+
+    // Precision of real valued fields, fieldStorage overrides the default for datasets of the given name,
+    // e.g. "xpos" or the name of a ligand
+    FieldStorage defaultStorage;
+    std::map<std::string, FieldStorage> fieldStorage;
+
+    // Store two dimensional frames in the column major order of ArrayFire, i.e. as (time, columns, rows) instead of
+    // (time, rows, columns). Saving and restarting then skip all transposes, the datasets carry a "Layout" attribute.
+    bool columnMajorFrames = false;
+};
+
 class StorageHelper {
 public:
+    /**
+     * Restores device arrays from the last frame of frame and ragged datasets. Every frame is read by HDF5 directly
+     * into a reusable page-locked staging buffer, in the element type and memory order of the target array, and
+     * uploaded without conversions. Only two dimensional frames without column major layout need a transpose.
+     * While one dataset is uploaded, the next one is read by a helper thread. The reader must not be used once an
+     * AsyncWriter is active, HDF5 is not thread safe.
+     */
+    class RestartReader {
+    public:
+        ~RestartReader();
+        // The targets are assigned by load, they have to outlive the call
+        void add(DataSet data, array &target, const DataType &H5MemoryType, dtype arrayfireType);
+        void addRagged(DataSet data, DataSet frameOffsets, array &target, const DataType &H5MemoryType, dtype arrayfireType);
+        void load();
+    private:
+        struct Job {
+            DataSet data;
+            DataSpace fileSpace;
+            DataType memoryType;
+            dtype type;
+            array *target;
+            dim4 dims;
+            hsize_t elements;
+            bool transpose;
+            bool quantized;
+            double scale;
+            double offset;
+        };
+        void read(Job &job, void *buffer);
+        void upload(Job &job, const void *buffer);
+
+        std::vector<Job> jobs;
+        void *staging[2] = {nullptr, nullptr};
+        size_t stagingBytes = 0;
+    };
+
     template <class T>  static array loadLastDataToGpu(DataSet data, DataType H5MemoryType, dtype arrayfireType)
     {
-        // Determine dimensions of data
-        DataSpace inputSpace = data.getSpace();
-        hsize_t ndims = inputSpace.getSimpleExtentNdims();
-        hsize_t outputdims = ndims - 1;
-        hsize_t *dims = new hsize_t[ndims];
-        hsize_t *start = new hsize_t[ndims];
-        hsize_t *count = new hsize_t[ndims];
-        inputSpace.getSimpleExtentDims(dims);
-
-        // Only select the last timepoint
-        start[0] = dims[0]-1;
-        count[0] = 1;
-        for(int i = 1; i < ndims; i++) {
-            start[i] = 0;
-            count[i] = dims[i];
-        }
-        inputSpace.selectHyperslab(H5S_SELECT_SET, count, start);
-
-        // create temporary 1D space
-        hsize_t dataLength = 1;
-        for(int i = 1; i < ndims; i++){
-            dataLength *= dims[i];
-        }
-        T *temp = new T[dataLength];
-        DataSpace tempSpace(1, &dataLength);
-
-        // Read data to memory
-        data.read(temp, H5MemoryType, tempSpace, inputSpace);
-
-        // create GpuArray of appropriate size
         array output;
-        switch(outputdims) {
-            case 1:
-                output = array(dims[ndims-1], temp);
-                break;
-            case 2:
-                // Invert order due to col first/row first differences
-                output = array(dims[ndims-1], dims[ndims-2], temp).T();
-                break;
-            case 3:
-                // Don't know if transpose trick works that well here...
-                output = array(dims[ndims-1], dims[ndims-2], dims[ndims-3], temp).T();
-                break;
-            default:
-                throw Exception("Unexpected number of dimensions (loadLastDataToGpu)");
-        }
-
-        delete[] temp;
-        delete[] count;
-        delete[] start;
-        delete[] dims;
-
-        // Account for col first/row first differences between arrayfire and HDF5
-        if(outputdims < 3)
-            output = output.as(arrayfireType);
+        RestartReader reader;
+        reader.add(data, output, H5MemoryType, arrayfireType);
+        reader.load();
+        return output;
+    }
+
+    template <class T> static void appendDataToDataSet(array data, DataSet &target, const DataType &H5MemoryType){
+        // 2D data must be transposed due to col-major storage, transposing 1D data does not change the memory layout
+        if(data.numdims() == 2 && columnMajorDataSets.find(target.getId()) == columnMajorDataSets.end())
+            data = data.T();
+        if(activeBatch)
+            activeBatch->add(data, target, H5MemoryType, false);
         else
-            output = output.T().as(arrayfireType);
-        output.eval();
+            submit(target, H5MemoryType, stageToHost(data), 0, false, 1);
+    }
+
+    template <class T> static array loadLastRaggedDataToGpu(DataSet data, DataSet frameOffsets, DataType H5MemoryType, dtype arrayfireType)
+    {
+        array output;
+        RestartReader reader;
+        reader.addRagged(data, frameOffsets, output, H5MemoryType, arrayfireType);
+        reader.load();
         return output;
     }
 
-    template <class T> static void appendDataToDataSet(array data, DataSet target, DataType H5MemoryType){
-        // read dims from HDF5
-        DataSpace targetSpace = target.getSpace();
-        hsize_t ndims = targetSpace.getSimpleExtentNdims();
-        hsize_t *dims = new hsize_t[ndims];
-        targetSpace.getSimpleExtentDims(dims);
-
-        // extend dims to contain another timepoint
-        hsize_t *newdims = new hsize_t[ndims];
-        std::copy(dims, dims+ndims, newdims);
-        newdims[0] += 1;
-        target.extend(newdims);
-        targetSpace = target.getSpace();
-
-        // select region for storage
-        hsize_t *start = new hsize_t[ndims];
-        hsize_t *count = new hsize_t[ndims];
-        start[0] = dims[0];
-        for(int i = 1; i < ndims; i++)
-            start[i] = 0;
-        std::copy(dims, dims+ndims, count);
-        count[0] = 1;
-        targetSpace.selectHyperslab(H5S_SELECT_SET, count, start);
-
-        // calculate source space
-        hsize_t nelements = 1;
-        for(int  i = 1; i < ndims; i++)
-            nelements *= dims[i];
-        H5::DataSpace sourceSpace(1, &nelements);
-
-        // Copy data from gpu
-        T *hostMem;
-//        std::cout << ndims << std::endl;
-        if((ndims - 1) == 2) {
-            // 2D data must be transposed due to col-major storage
-            hostMem = data.T().host<T>();
-        } else
-            // 1D data, must not be transposed
-            hostMem = data.host<T>();
-
-        // Write data to Dataset
-        target.write(hostMem, H5MemoryType, sourceSpace, targetSpace);
-        af::freeHost(hostMem);
+    template <class T> static void appendRaggedDataToDataSet(array data, DataSet &target, const DataType &H5MemoryType){
+        // Ragged datasets are one dimensional, every save appends a variable number of rows
+        hsize_t count = data.elements();
+        if(count == 0)
+            return;
+        if(activeBatch)
+            activeBatch->add(data, target, H5MemoryType, true);
+        else
+            submit(target, H5MemoryType, stageToHost(data), 0, true, count);
     }
 
+    template <class T> static void appendValueToDataSet(T value, DataSet &target, const DataType &H5MemoryType){
+        // Append a single host value to a one dimensional extendable dataset
+        std::shared_ptr<std::vector<char>> buffer = acquireBuffer(sizeof(T));
+        memcpy(buffer->data(), &value, sizeof(T));
+        submit(target, H5MemoryType, buffer, 0, true, 1);
+    }
+
+    // Reads a single frame of a frame dataset in row major order, quantized datasets are dequantized
+    static std::vector<double> readFrameToHost(DataSet data, hsize_t frame);
+    static hsize_t getFrameCount(DataSet data);
+
+    // Creates a dataset for real valued data with the precision configured for its name
+    static DataSet createRealDataSet(Group &group, std::string name, const DataSpace &space, const DSetCreatPropList &properties,
+                                     const DSetAccPropList &access = DSetAccPropList::DEFAULT);
+    static bool getQuantization(DataSet &data, double &scale, double &offset);
+    // Values as a reader sees them after they are stored in a real valued dataset of the given name
+    static array toStoredPrecision(const array &values, std::string name);
+    // Creates an extendable dataset of rows x columns frames in the configured layout, real valued unless a file type
+    // is given
+    static DataSet createFrameDataSet(Group &group, std::string name, hsize_t rows, hsize_t columns,
+                                      const DataType *fileType = nullptr);
+    // Reads the layout of a reopened frame dataset, has to be called before frames are appended to it
+    static bool readFrameLayout(DataSet &data);
+
+    // Dataset creation properties following the storage settings, dims includes the time dimension
+    static DSetCreatPropList createFrameProperties(int ndims, const hsize_t *dims);
+    static DSetCreatPropList createRaggedProperties(hsize_t rowsPerFrame);
+    static DSetCreatPropList createPopulationProperties(hsize_t bacteria);
+    // Chunk cache large enough to keep all tiles of the current frames, properties are those of the dataset.
+    // createRealDataSet resizes the cache for the element size of the field.
+    static DSetAccPropList createPopulationAccess(const DSetCreatPropList &properties, hsize_t bacteria,
+                                                  size_t elementSize = sizeof(double));
+    static void setStorageSettings(StorageSettings settings) { storageSettings = settings; }
+    static StorageSettings getStorageSettings() { return storageSettings; }
+    // Writes incomplete compressed chunks, has to be called before compressed datasets are closed
+    static void flushCompression();
+    // Forgets cached dataset properties, has to be called once the datasets of a simulation are closed
+    static void releaseDataSets();
+
+    // Write functions operating on host memory, used directly or by the writer thread of an AsyncWriter
+    static void writeFrame(DataSet &target, const DataType &H5MemoryType, const void *hostMem);
+    static void writeRows(DataSet &target, const DataType &H5MemoryType, const void *hostMem, hsize_t count);
+
+    // Once a writer is set, all appends are written asynchronously by its thread
+    static void setAsyncWriter(AsyncWriter *writer) { asyncWriter = writer; }
+    static AsyncWriter *getAsyncWriter() { return asyncWriter; }
+    // Runs an HDF5 task in order with the appends, on the writer thread if one is set
+    static void submitTask(std::function<void()> task) {
+        if(asyncWriter)
+            asyncWriter->enqueueTask(task);
+        else
+            task();
+    }
+
+    // Once a raw writer is set, frames are appended to the raw trajectory instead of the HDF5 datasets, which keep
+    // their attributes but no frames. Has to be set before the first save.
+    static void setRawWriter(RawTrajectoryWriter *writer) { rawWriter = writer; }
+
+    // Appends between beginBatch and commitBatch are packed into one device buffer per element type and
+    // downloaded with a single copy when the batch is committed
+    static void beginBatch();
+    static void commitBatch();
+
     static H5::DataSpace H5Scalar;
     static H5::StrType H5VariableString;
 private:
+    static FieldStorage getFieldStorage(std::string name);
+    static bool isColumnMajor(DataSet &data);
+    static void setFilters(DSetCreatPropList &properties);
+
+    struct CachedQuantization {
+        DataSet dataset;
+        bool quantized;
+        double scale;
+        double offset;
+    };
+    struct RawTarget {
+        size_t index;
+        DataType fileType;
+    };
+    static void writeRaw(DataSet &target, const DataType &H5MemoryType, const void *hostMem, hsize_t count, bool ragged);
+
+    static const void *quantize(DataSet &target, const DataType &H5MemoryType, const void *hostMem, hsize_t count,
+                                std::vector<int> &quantized, const DataType *&memoryType);
+
+    class StorageBatch {
+    public:
+        void add(array data, DataSet &target, const DataType &H5MemoryType, bool ragged);
+        void commit();
+    private:
+        struct Entry {
+            array data;
+            DataSet *target;
+            const DataType *memoryType;
+            bool ragged;
+        };
+        std::vector<Entry> entries;
+    };
+
+    static std::shared_ptr<std::vector<char>> acquireBuffer(size_t bytes);
+    static std::shared_ptr<std::vector<char>> stageToHost(array data);
+    static void submit(DataSet &target, const DataType &H5MemoryType, std::shared_ptr<std::vector<char>> buffer,
+                       size_t offset, bool ragged, hsize_t count);
 
+    static AsyncWriter *asyncWriter;
+    static RawTrajectoryWriter *rawWriter;
+    static std::unique_ptr<StorageBatch> activeBatch;
+    static StorageSettings storageSettings;
+    static std::unique_ptr<CompressionPipeline> compression;
+    // Only accessed by the thread performing the writes
+    static std::map<hid_t, CachedQuantization> quantizationCache;
+    // Frame datasets stored in column major order, only accessed by the simulation thread
+    static std::set<hid_t> columnMajorDataSets;
+    // Only accessed by the thread performing the writes
+    static std::map<hid_t, RawTarget> rawTargets;
 };
 
 
@@ -0,0 +1,36 @@
+//
+// Debugging aid counting the host synchronisations of a running simulation per phase
+//
+
+#include "SyncCounter.h"
+
+bool SyncCounter::enabled = false;
+thread_local const char *SyncCounter::current = "Other";
+std::mutex SyncCounter::mutex;
+std::map<std::string, std::map<std::string, unsigned long long>> SyncCounter::counts;
+
+void SyncCounter::add(const char *site) {
+    // Pipelined populations record from their worker thread
+    std::lock_guard<std::mutex> lock(mutex);
+    counts[current][site]++;
+}
+
+void SyncCounter::report(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "Host synchronisations per phase:" << std::endl;
+    if(counts.empty())
+        out << "  none" << std::endl;
+    for(auto &phase: counts) {
+        unsigned long long total = 0;
+        for(auto &site: phase.second)
+            total += site.second;
+        out << "  " << phase.first << ": " << total << std::endl;
+        for(auto &site: phase.second)
+            out << "    " << site.first << ": " << site.second << std::endl;
+    }
+}
+
+void SyncCounter::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    counts.clear();
+}
@@ -0,0 +1,50 @@
+//
+// Debugging aid counting the host synchronisations of a running simulation per phase
+//
+
+#ifndef BACTSIM_GPU_SYNCCOUNTER_H
+#define BACTSIM_GPU_SYNCCOUNTER_H
+
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+/**
+ * Every call that waits for the device (downloads, scalar reductions, where followed by elements, explicit syncs) is
+ * recorded with its site when counting is enabled. Synchronisations are attributed to the phase set on the calling
+ * thread, e.g. "Interaction" or "Populations", by a Phase scope. Counting is disabled by default and then costs a
+ * single branch per site.
+ */
+class SyncCounter {
+public:
+    static void setEnabled(bool enabled) { SyncCounter::enabled = enabled; }
+    static bool isEnabled() { return enabled; }
+    static void record(const char *site) {
+        if(enabled)
+            add(site);
+    }
+    // Counts per phase and site since the last reset
+    static void report(std::ostream &out);
+    static void reset();
+
+    // Attributes the synchronisations of the current thread to name until the scope ends
+    class Phase {
+    public:
+        Phase(const char *name) : previous(current) { current = name; }
+        ~Phase() { current = previous; }
+    private:
+        const char *previous;
+    };
+
+private:
+    static void add(const char *site);
+
+    static bool enabled;
+    static thread_local const char *current;
+    static std::mutex mutex;
+    static std::map<std::string, std::map<std::string, unsigned long long>> counts;
+};
+
+
+#endif //BACTSIM_GPU_SYNCCOUNTER_H
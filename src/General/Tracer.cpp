@@ -0,0 +1,97 @@
+//
+// Timeline of the simulation threads written in the Chrome trace event format
+//
+
+#include "Tracer.h"
+#include <H5Cpp.h>
+#include <fstream>
+
+std::atomic<bool> Tracer::enabled(false);
+std::chrono::steady_clock::time_point Tracer::start = std::chrono::steady_clock::now();
+thread_local Tracer::Buffer *Tracer::buffer = nullptr;
+std::mutex Tracer::mutex;
+std::vector<std::unique_ptr<Tracer::Buffer>> Tracer::buffers;
+
+namespace {
+    std::string escapeJson(const std::string &value) {
+        std::string escaped;
+        for(char c: value) {
+            if(c == '"' || c == '\\')
+                escaped += '\\';
+            if((unsigned char)c < 0x20)
+                continue;
+            escaped += c;
+        }
+        return escaped;
+    }
+}
+
+void Tracer::setEnabled(bool enabled) {
+    if(enabled && !isEnabled())
+        start = std::chrono::steady_clock::now();
+    Tracer::enabled = enabled;
+}
+
+Tracer::Buffer &Tracer::getBuffer() {
+    if(!buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        buffers.emplace_back(new Buffer {(unsigned int)buffers.size() + 1, "", {}});
+        buffer = buffers.back().get();
+        // Frequent reallocations would show up as gaps in the trace
+        buffer->events.reserve(4096);
+    }
+    return *buffer;
+}
+
+double Tracer::now() {
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Tracer::setThreadName(std::string name) {
+    getBuffer().name = name;
+}
+
+void Tracer::begin(const char *name) {
+    getBuffer().events.push_back(Event {name, true, now()});
+}
+
+void Tracer::begin(const std::string &name) {
+    getBuffer().events.push_back(Event {name, true, now()});
+}
+
+void Tracer::end() {
+    getBuffer().events.push_back(Event {"", false, now()});
+}
+
+void Tracer::writeJson(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    bool first = true;
+    auto separator = [&]() {
+        out << (first ? "" : ",") << std::endl;
+        first = false;
+    };
+    for(auto &thread: buffers) {
+        if(!thread->name.empty()) {
+            separator();
+            out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread->thread
+                << ", \"args\": {\"name\": \"" << escapeJson(thread->name) << "\"}}";
+        }
+        for(auto &event: thread->events) {
+            separator();
+            out << "{";
+            if(event.begin)
+                out << "\"name\": \"" << escapeJson(event.name) << "\", \"cat\": \"bactSim\", ";
+            out << "\"ph\": \"" << (event.begin ? "B" : "E") << "\", \"ts\": " << std::fixed << event.timestamp
+                << std::defaultfloat << ", \"pid\": 1, \"tid\": " << thread->thread << "}";
+        }
+    }
+    out << std::endl << "]}" << std::endl;
+}
+
+void Tracer::writeJson(std::string path) {
+    std::ofstream out(path);
+    if(!out)
+        throw H5::Exception("Tracer", "Could not open the trace " + path);
+    writeJson(out);
+}
@@ -0,0 +1,81 @@
+//
+// Timeline of the simulation threads written in the Chrome trace event format
+//
+
+#ifndef BACTSIM_GPU_TRACER_H
+#define BACTSIM_GPU_TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * Spans are recorded as begin and end events with the id of the recording thread. Every thread appends to its own
+ * buffer without locking, the buffer is registered once when the thread records its first event or names itself.
+ * The trace is written as JSON, which chrome://tracing and Perfetto open, when no thread records anymore, i.e. at
+ * shutdown. Timestamps are microseconds since tracing was enabled.
+ *
+ * ArrayFire runs asynchronously, spans show when the host issued the work unless the phases are synchronised by
+ * the Profiler. Disabled tracing costs a single branch per span.
+ */
+class Tracer {
+public:
+    static void setEnabled(bool enabled);
+    static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+    // Name of the calling thread in the trace
+    static void setThreadName(std::string name);
+
+    static void begin(const char *name);
+    static void begin(const std::string &name);
+    static void end();
+
+    static void writeJson(std::ostream &out);
+    static void writeJson(std::string path);
+
+    class Scope {
+    public:
+        Scope(const char *name) : active(isEnabled()) {
+            if(active)
+                begin(name);
+        }
+        Scope(const std::string &name) : active(isEnabled()) {
+            if(active)
+                begin(name);
+        }
+        ~Scope() {
+            if(active)
+                end();
+        }
+    private:
+        bool active;
+    };
+
+private:
+    struct Event {
+        std::string name;
+        bool begin;
+        double timestamp;
+    };
+    struct Buffer {
+        unsigned int thread;
+        std::string name;
+        std::vector<Event> events;
+    };
+
+    static Buffer &getBuffer();
+    static double now();
+
+    static std::atomic<bool> enabled;
+    static std::chrono::steady_clock::time_point start;
+    static thread_local Buffer *buffer;
+    // Only used to register the buffer of a new thread and to write the trace
+    static std::mutex mutex;
+    static std::vector<std::unique_ptr<Buffer>> buffers;
+};
+
+
+#endif //BACTSIM_GPU_TRACER_H
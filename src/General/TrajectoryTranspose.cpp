@@ -0,0 +1,210 @@
+//
+// Rewrites population trajectories in tiles suited for reading the history of single bacteria
+//
+
+#include "TrajectoryTranspose.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <map>
+
+void TrajectoryTranspose::transpose(std::string inputPath, std::string outputPath, hsize_t chunkFrames,
+                                    hsize_t chunkBacteria) {
+    if(chunkFrames == 0 || chunkBacteria == 0)
+        throw H5::Exception("TrajectoryTranspose", "Tiles need at least one frame and one bacterium");
+    H5::H5File input(inputPath, H5F_ACC_RDONLY);
+    H5::H5File output(outputPath, H5F_ACC_TRUNC);
+    H5::Group populations = input.openGroup("Populations");
+    H5::Group outputPopulations = output.createGroup("Populations");
+    for(hsize_t i = 0; i < populations.getNumObjs(); i++) {
+        std::string name = populations.getObjnameByIdx(i);
+        H5::Group population = populations.openGroup(name);
+        H5::Group outputPopulation = outputPopulations.createGroup(name);
+        if(population.nameExists("Frame offsets"))
+            transposeRagged(population, outputPopulation, chunkFrames, chunkBacteria);
+        else
+            transposeFixed(population, outputPopulation, chunkFrames, chunkBacteria);
+    }
+}
+
+H5::DataSet TrajectoryTranspose::createTiled(H5::Group output, std::string name, const H5::DataType &type,
+                                             hsize_t frames, hsize_t bacteria, hsize_t chunkFrames,
+                                             hsize_t chunkBacteria) {
+    // Unlimited maximum dimensions allow tiles larger than short or empty trajectories
+    hsize_t dims[2] = {frames, bacteria};
+    hsize_t maxDims[2] = {H5S_UNLIMITED, H5S_UNLIMITED};
+    hsize_t chunk[2] = {chunkFrames, std::max(std::min(chunkBacteria, bacteria), (hsize_t)1)};
+    H5::DSetCreatPropList properties;
+    properties.setChunk(2, chunk);
+    properties.setShuffle();
+    properties.setDeflate(4);
+    return output.createDataSet(name, type, H5::DataSpace(2, dims, maxDims), properties);
+}
+
+std::vector<char> TrajectoryTranspose::getFillValue(const H5::DataType &type) {
+    std::vector<char> fill(std::max(type.getSize(), sizeof(double)), 0);
+    if(type.getClass() == H5T_FLOAT) {
+        double nan = std::numeric_limits<double>::quiet_NaN();
+        memcpy(fill.data(), &nan, sizeof(double));
+        if(H5Tconvert(H5T_NATIVE_DOUBLE, type.getId(), 1, fill.data(), NULL, H5P_DEFAULT) < 0)
+            throw H5::Exception("TrajectoryTranspose", "Could not convert the fill value");
+    }
+    fill.resize(type.getSize());
+    return fill;
+}
+
+void TrajectoryTranspose::copyQuantization(H5::DataSet &source, H5::DataSet &target) {
+    H5::DataSpace scalar(H5S_SCALAR);
+    for(std::string name: {"Quantization scale", "Quantization offset"}) {
+        if(!source.attrExists(name))
+            continue;
+        double value;
+        source.openAttribute(name).read(H5::PredType::NATIVE_DOUBLE, &value);
+        target.createAttribute(name, H5::PredType::IEEE_F64LE, scalar).write(H5::PredType::NATIVE_DOUBLE, &value);
+    }
+}
+
+void TrajectoryTranspose::writeIndex(H5::Group output, const std::vector<Column> &columns) {
+    hsize_t dims[2] = {columns.size(), 3};
+    H5::DataSet index = output.createDataSet("Index", H5::PredType::STD_U64LE, H5::DataSpace(2, dims));
+    if(!columns.empty())
+        index.write(columns.data(), H5::PredType::NATIVE_ULLONG);
+}
+
+void TrajectoryTranspose::transposeFixed(H5::Group input, H5::Group output, hsize_t chunkFrames,
+                                         hsize_t chunkBacteria) {
+    // Fields with a step only hold every step-th save, the index counts saves
+    hsize_t lastSave = 0, bacteria = 0;
+    for(hsize_t i = 0; i < input.getNumObjs(); i++) {
+        if(input.childObjType(i) != H5O_TYPE_DATASET)
+            continue;
+        std::string name = input.getObjnameByIdx(i);
+        H5::DataSet data = input.openDataSet(name);
+        H5::DataSpace space = data.getSpace();
+        if(space.getSimpleExtentType() != H5S_SIMPLE || space.getSimpleExtentNdims() != 2)
+            continue;
+        hsize_t dims[2];
+        space.getSimpleExtentDims(dims);
+        hsize_t frames = dims[0];
+        bacteria = dims[1];
+        unsigned int step = 1;
+        if(data.attrExists("Step"))
+            data.openAttribute("Step").read(H5::PredType::NATIVE_UINT, &step);
+        if(frames)
+            lastSave = std::max(lastSave, (frames - 1)*step);
+
+        // Whole blocks of frames are copied, every block completes a row of tiles in the output
+        H5::DataType type = data.getDataType();
+        H5::DataSet target = createTiled(output, name, type, frames, bacteria, chunkFrames, chunkBacteria);
+        copyQuantization(data, target);
+        if(step > 1)
+            target.createAttribute("Step", H5::PredType::STD_U32LE, H5::DataSpace(H5S_SCALAR))
+                    .write(H5::PredType::NATIVE_UINT, &step);
+        std::vector<char> block(chunkFrames*bacteria*type.getSize());
+        for(hsize_t first = 0; first < frames; first += chunkFrames) {
+            hsize_t start[2] = {first, 0};
+            hsize_t count[2] = {std::min(chunkFrames, frames - first), bacteria};
+            space.selectHyperslab(H5S_SELECT_SET, count, start);
+            H5::DataSpace memorySpace(2, count);
+            data.read(block.data(), type, memorySpace, space);
+            H5::DataSpace targetSpace = target.getSpace();
+            targetSpace.selectHyperslab(H5S_SELECT_SET, count, start);
+            target.write(block.data(), type, memorySpace, targetSpace);
+        }
+    }
+
+    // Columns are the bacteria in storage order, all of them exist in every frame. With a tracked subset the columns
+    // hold the tracked slots.
+    std::vector<unsigned int> slots(bacteria);
+    for(hsize_t b = 0; b < bacteria; b++)
+        slots[b] = (unsigned int)b;
+    if(input.nameExists("Tracked") && bacteria)
+        input.openDataSet("Tracked").read(slots.data(), H5::PredType::NATIVE_UINT);
+    std::vector<Column> columns(bacteria);
+    for(hsize_t b = 0; b < bacteria; b++)
+        columns[b] = Column {slots[b], 0, lastSave};
+    writeIndex(output, columns);
+}
+
+void TrajectoryTranspose::transposeRagged(H5::Group input, H5::Group output, hsize_t chunkFrames,
+                                          hsize_t chunkBacteria) {
+    H5::DataSet offsetData = input.openDataSet("Frame offsets");
+    std::vector<unsigned long long> offsets(offsetData.getSpace().getSimpleExtentNpoints());
+    if(!offsets.empty())
+        offsetData.read(offsets.data(), H5::PredType::NATIVE_ULLONG);
+    H5::DataSet idData = input.openDataSet("id");
+    hsize_t rows = idData.getSpace().getSimpleExtentNpoints();
+    hsize_t frames = offsets.size();
+    auto frameEnd = [&](hsize_t frame) { return frame + 1 < frames ? offsets[frame + 1] : rows; };
+    auto readRows = [](H5::DataSet &data, const H5::DataType &type, hsize_t first, hsize_t count, void *target) {
+        if(count == 0)
+            return;
+        H5::DataSpace space = data.getSpace();
+        space.selectHyperslab(H5S_SELECT_SET, &count, &first);
+        H5::DataSpace memorySpace(1, &count);
+        data.read(target, type, memorySpace, space);
+    };
+
+    // First pass: one column per id in order of appearance
+    std::map<unsigned long long, size_t> columnOf;
+    std::vector<Column> columns;
+    std::vector<unsigned long long> ids;
+    for(hsize_t f = 0; f < frames; f++) {
+        ids.resize(frameEnd(f) - offsets[f]);
+        readRows(idData, H5::PredType::NATIVE_ULLONG, offsets[f], ids.size(), ids.data());
+        for(auto id: ids) {
+            auto column = columnOf.find(id);
+            if(column == columnOf.end()) {
+                columnOf[id] = columns.size();
+                columns.push_back(Column {id, f, f});
+            } else
+                columns[column->second].lastFrame = f;
+        }
+    }
+    writeIndex(output, columns);
+
+    // Second pass per field: scatter the rows of a block of frames into their columns
+    hsize_t bacteria = columns.size();
+    for(hsize_t i = 0; i < input.getNumObjs(); i++) {
+        if(input.childObjType(i) != H5O_TYPE_DATASET)
+            continue;
+        std::string name = input.getObjnameByIdx(i);
+        if(name == "Frame offsets" || name == "id")
+            continue;
+        H5::DataSet data = input.openDataSet(name);
+        H5::DataSpace space = data.getSpace();
+        if(space.getSimpleExtentType() != H5S_SIMPLE || space.getSimpleExtentNdims() != 1 ||
+           (hsize_t)space.getSimpleExtentNpoints() != rows)
+            continue;
+
+        H5::DataType type = data.getDataType();
+        size_t elementSize = type.getSize();
+        std::vector<char> fill = getFillValue(type);
+        H5::DataSet target = createTiled(output, name, type, frames, bacteria, chunkFrames, chunkBacteria);
+        copyQuantization(data, target);
+        std::vector<char> block(chunkFrames*bacteria*elementSize);
+        std::vector<char> values;
+        for(hsize_t first = 0; first < frames; first += chunkFrames) {
+            hsize_t count[2] = {std::min(chunkFrames, frames - first), bacteria};
+            for(hsize_t e = 0; e < count[0]*bacteria; e++)
+                memcpy(block.data() + e*elementSize, fill.data(), elementSize);
+            for(hsize_t f = first; f < first + count[0]; f++) {
+                hsize_t frameRows = frameEnd(f) - offsets[f];
+                ids.resize(frameRows);
+                values.resize(frameRows*elementSize);
+                readRows(idData, H5::PredType::NATIVE_ULLONG, offsets[f], frameRows, ids.data());
+                readRows(data, type, offsets[f], frameRows, values.data());
+                for(hsize_t r = 0; r < frameRows; r++)
+                    memcpy(block.data() + ((f - first)*bacteria + columnOf[ids[r]])*elementSize,
+                           values.data() + r*elementSize, elementSize);
+            }
+            if(bacteria == 0)
+                continue;
+            hsize_t start[2] = {first, 0};
+            H5::DataSpace memorySpace(2, count);
+            H5::DataSpace targetSpace = target.getSpace();
+            targetSpace.selectHyperslab(H5S_SELECT_SET, count, start);
+            target.write(block.data(), type, memorySpace, targetSpace);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+//
+// Rewrites population trajectories in tiles suited for reading the history of single bacteria
+//
+
+#ifndef BACTSIM_GPU_TRAJECTORYTRANSPOSE_H
+#define BACTSIM_GPU_TRAJECTORYTRANSPOSE_H
+
+#include <H5Cpp.h>
+#include <string>
+#include <vector>
+
+/**
+ * Snapshot oriented files store the bacteria of a save step together, fixed size populations as (time, bacteria)
+ * chunked over all bacteria and dynamic populations as ragged rows. The transpose writes every per bacterium field of
+ * every population into a (time, bacteria) dataset chunked in compressed chunkFrames x chunkBacteria tiles, the
+ * history of a bacterium then touches frames/chunkFrames tiles. Bacteria of dynamic populations get a column each,
+ * frames in which a bacterium does not exist hold NaN (integer fields 0). Quantization attributes are copied.
+ *
+ * The output contains "/Populations/<name>/<field>" and an "Index" dataset per population with one row
+ * (id, first frame, last frame) per column, the id of a tracked subset is its slot. Fields stored with a "Step"
+ * attribute keep it, their frame k is save k*step, the frames of the index count saves. The input is processed in blocks of chunkFrames frames, memory use is
+ * bounded by chunkFrames x bacteria elements independent of the length of the trajectory.
+ */
+class TrajectoryTranspose {
+public:
+    static void transpose(std::string inputPath, std::string outputPath, hsize_t chunkFrames = 256,
+                          hsize_t chunkBacteria = 16);
+
+private:
+    struct Column {
+        unsigned long long id;
+        unsigned long long firstFrame;
+        unsigned long long lastFrame;
+    };
+
+    static void transposeFixed(H5::Group input, H5::Group output, hsize_t chunkFrames, hsize_t chunkBacteria);
+    static void transposeRagged(H5::Group input, H5::Group output, hsize_t chunkFrames, hsize_t chunkBacteria);
+    static H5::DataSet createTiled(H5::Group output, std::string name, const H5::DataType &type, hsize_t frames,
+                                   hsize_t bacteria, hsize_t chunkFrames, hsize_t chunkBacteria);
+    static void copyQuantization(H5::DataSet &source, H5::DataSet &target);
+    static void writeIndex(H5::Group output, const std::vector<Column> &columns);
+    // Fill pattern of a single element in the given file type, NaN for floating point types
+    static std::vector<char> getFillValue(const H5::DataType &type);
+};
+
+
+#endif //BACTSIM_GPU_TRAJECTORYTRANSPOSE_H
@@ -0,0 +1,70 @@
+//
+// Persistent thread running one task at a time next to the simulation thread
+//
+
+#include "WorkerThread.h"
+#include "Tracer.h"
+#include <arrayfire.h>
+
+WorkerThread::WorkerThread() : device(af::getDevice()) {
+    thread = std::thread(&WorkerThread::run, this);
+}
+
+WorkerThread::~WorkerThread() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        taskDone.wait(lock, [this] { return !busy; });
+        stopping = true;
+    }
+    taskAvailable.notify_all();
+    thread.join();
+}
+
+void WorkerThread::start(std::function<void()> task) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        taskDone.wait(lock, [this] { return !busy; });
+        this->task = task;
+        busy = true;
+    }
+    taskAvailable.notify_one();
+}
+
+void WorkerThread::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    taskDone.wait(lock, [this] { return !busy; });
+    if(error) {
+        std::exception_ptr taskError = error;
+        error = nullptr;
+        std::rethrow_exception(taskError);
+    }
+}
+
+void WorkerThread::run() {
+    Tracer::setThreadName("Worker");
+    af::setDevice(device);
+    while(true) {
+        std::function<void()> current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            taskAvailable.wait(lock, [this] { return busy || stopping; });
+            if(!busy)
+                return;
+            current = std::move(task);
+        }
+
+        std::exception_ptr taskError;
+        try {
+            current();
+        } catch(...) {
+            taskError = std::current_exception();
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            error = taskError;
+            busy = false;
+        }
+        taskDone.notify_all();
+    }
+}
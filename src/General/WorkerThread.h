@@ -0,0 +1,45 @@
+//
+// Persistent thread running one task at a time next to the simulation thread
+//
+
+#ifndef BACTSIM_GPU_WORKERTHREAD_H
+#define BACTSIM_GPU_WORKERTHREAD_H
+
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+/**
+ * Tasks are issued to the ArrayFire device that is active when the worker is constructed, the device selection of
+ * ArrayFire is per thread. The thread is kept for the lifetime of the worker, so per thread state of ArrayFire (e.g.
+ * the random engine) continues from task to task.
+ */
+class WorkerThread {
+public:
+    WorkerThread();
+    ~WorkerThread();
+
+    // Starts task, the previous task has to be waited for
+    void start(std::function<void()> task);
+    // Blocks until the task has finished, rethrows its exception
+    void wait();
+
+private:
+    void run();
+
+    int device;
+    std::function<void()> task;
+    bool busy = false;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    std::mutex mutex;
+    std::condition_variable taskAvailable;
+    std::condition_variable taskDone;
+    std::thread thread;
+};
+
+
+#endif //BACTSIM_GPU_WORKERTHREAD_H
@@ -4,9 +4,14 @@
 
 #include "Model2D.h"
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <H5Cpp.h>
 #include <General/StorageHelper.h>
 #include <General/ArrayFireHelper.h>
+#include <General/SyncCounter.h>
+#include <General/Profiler.h>
+#include <General/Tracer.h>
 
 Model2D::Model2D(shared_ptr<Environment> environment, std::vector<shared_ptr<BacterialPopulation>> populations, double dt):
         env(environment), bacterialPopulations(populations), Modeldt(dt) {
@@ -28,28 +33,82 @@ void Model2D::init() {
 void Model2D::simulateTimestep() {
 //    std::cout << simulationsSinceLastSave << std::endl;
     // Let bacteria interact with environment
+    {
+        SyncCounter::Phase phase("Interaction");
+        Profiler::Scope timer("Interaction");
 #ifdef ALL_PARALLEL
-    processAllBacteriaParallel(Modeldt);
+        processAllBacteriaParallel(Modeldt);
 #else
-    array successful = processBacteriaParallel(Modeldt);
-    array overlappingBacteria = where(!successful);
-    processOverlappingBacteria(overlappingBacteria, Modeldt);
+        array successful = processBacteriaParallel(Modeldt);
+        array overlappingBacteria = where(!successful);
+        processOverlappingBacteria(overlappingBacteria, Modeldt);
 #endif
+    }
+    bool pipelined = populationWorker && std::all_of(bacterialPopulations.begin(), bacterialPopulations.end(),
+            [](shared_ptr<BacterialPopulation> population) { return population->isIndependentOfDiffusion(); });
+    if(pipelined) {
+        // Populations sense the densities after the interaction while the environment diffuses. Deposits are
+        // logged before, so only the worker uses the storage in the meantime.
+        env->beginModelStep();
+        env->freezeDensities();
+        populationWorker->start([this]() { livePopulations(); });
+        try {
+            SyncCounter::Phase phase("Environment");
+            env->diffuseModelStep(Modeldt, EnvironmentDt);
+        } catch(...) {
+            populationWorker->wait();
+            env->releaseDensities();
+            throw;
+        }
+        populationWorker->wait();
+        env->releaseDensities();
+    } else {
+        livePopulations();
+        // Simulate environment
+        SyncCounter::Phase phase("Environment");
+        env->simulateModelStep(Modeldt, EnvironmentDt);
+    }
+    simulationsSinceLastSave++;
+    steps++;
+    Profiler::countStep();
+    if(!reducers.empty())
+        evaluateReducers();
+}
+
+void Model2D::livePopulations() {
+    // Runs on the worker thread when pipelined, the phase is set per thread
+    SyncCounter::Phase phase("Populations");
     // Simulate bacteria
     // Get Invalid Kernel when calling clCreateKernel error if this is active...
     for(auto population: bacterialPopulations) {
+        Profiler::Scope timer("Population " + population->name);
         population->liveTimestep(Modeldt);
     }
-    double ddt;
-    for(ddt = 0; ddt < Modeldt; ddt += EnvironmentDt){
-        // Simulate environment
-//        std::cout << ddt << std::endl;
-        env->simulateTimestep(EnvironmentDt);
-    }
+}
 
-    // Simulate leftover time
-    env->simulateTimestep(Modeldt - (ddt-EnvironmentDt));
-    simulationsSinceLastSave++;
+void Model2D::setPipelined(bool enabled) {
+    if(enabled && !populationWorker)
+        populationWorker.reset(new WorkerThread());
+    else if(!enabled)
+        populationWorker.reset();
+}
+
+void Model2D::evaluateReducers() {
+    SyncCounter::Phase phase("Reducers");
+    Profiler::Scope timer("Reducers");
+    bool batch = false;
+    for(auto reducer: reducers) {
+        if(steps % reducer->interval)
+            continue;
+        // The results of all reducers of this step are downloaded together
+        if(!batch) {
+            StorageHelper::beginBatch();
+            batch = true;
+        }
+        reducer->save(reducer->reduce(getTime()), getTime());
+    }
+    if(batch)
+        StorageHelper::commitBatch();
 }
 
 #ifndef NO_GRAPHICS
@@ -67,7 +126,9 @@ void Model2D::visualize() {
     if(!populationsWin)
         return;
 
-    double normalizer = max<double>(env->getAllDensities());
+    SyncCounter::Phase phase("Visualization");
+    // The maximum is not downloaded, the images are normalized on the device
+    array normalizer = max(flat(env->getAllDensities()));
     env->visualize(normalizer);
     if(bacterialPopulations.size() > 1) {
         for(size_t i = 0; i < bacterialPopulations.size(); i++)
@@ -93,21 +154,88 @@ void Model2D::setupStorage(H5::H5File &output, int saveStepsize) {
         H5::Group curPopulation = popGroup.createGroup(population->name);
         population->setupStorage(curPopulation);
     }
+    if(!reducers.empty()) {
+        H5::Group analytics = getAnalyticsGroup();
+        for(auto reducer: reducers)
+            reducer->setupStorage(analytics);
+    }
     savestep = saveStepsize;
     this->storage->createAttribute("saveStep", PredType::INTEL_I32, StorageHelper::H5Scalar).write(PredType::NATIVE_INT, &savestep);
     this->storage->createAttribute("dt", PredType::INTEL_F64, StorageHelper::H5Scalar).write(PredType::NATIVE_DOUBLE, &Modeldt);
     this->storage->createAttribute("Environment dt", PredType::INTEL_F64, StorageHelper::H5Scalar).write(PredType::NATIVE_DOUBLE, &EnvironmentDt);
 }
 
+H5::Group Model2D::getAnalyticsGroup() {
+    return this->storage->nameExists("Analytics") ? this->storage->openGroup("Analytics")
+                                                  : this->storage->createGroup("Analytics");
+}
+
+void Model2D::addReducer(shared_ptr<Reducer> reducer) {
+    for(auto other: reducers)
+        if(other->name == reducer->name)
+            throw exception(("There is already a reducer named " + reducer->name).c_str());
+    if(this->storage) {
+        // HDF5 is only used by one thread
+        if(writer)
+            writer->flush();
+        reducer->setupStorage(getAnalyticsGroup());
+    }
+    reducers.push_back(reducer);
+}
+
+void Model2D::enableAsyncStorage(size_t maxQueuedWrites) {
+    if(writer)
+        return;
+    writer.reset(new AsyncWriter(maxQueuedWrites));
+    StorageHelper::setAsyncWriter(writer.get());
+}
+
+void Model2D::enableRawStorage(std::string path) {
+    if(!this->storage)
+        throw H5::Exception("Model2D", "Raw storage requires the HDF5 file for the parameters");
+    if(writer)
+        writer->flush();
+    rawWriter.reset(new RawTrajectoryWriter(path));
+    StorageHelper::setRawWriter(rawWriter.get());
+}
+
 void Model2D::closeStorage() {
+    // Pending writes refer to the datasets of the populations and the environment
+    if(writer) {
+        writer->flush();
+        StorageHelper::setAsyncWriter(nullptr);
+        writer.reset();
+    }
+    if(Profiler::isEnabled()) {
+        // After the writer is flushed, so the bytes of the final saves are included
+        if(this->storage)
+            Profiler::writeStorage(this->storage->openGroup("/"));
+        if(!profileReportPath.empty())
+            Profiler::writeJson(profileReportPath);
+    }
+    if(rawWriter) {
+        StorageHelper::setRawWriter(nullptr);
+        rawWriter->close();
+        rawWriter.reset();
+    }
+    StorageHelper::flushCompression();
+    StorageHelper::releaseDataSets();
+
     for(auto population: this->bacterialPopulations) {
         population->closeStorage();
     }
+    for(auto reducer: reducers)
+        reducer->closeStorage();
 
     this->env->closeStorage();
 
     if(this->storage)
         this->storage.reset();
+    // The writer and the compression threads are done, no thread records anymore
+    if(!tracePath.empty()) {
+        Tracer::setEnabled(false);
+        Tracer::writeJson(tracePath);
+    }
 }
 
 void Model2D::setupStorage(std::string path, int saveStepsize) {
@@ -118,13 +246,30 @@ void Model2D::setupStorage(std::string path, int saveStepsize) {
 void Model2D::save() {
     if (!this->storage)
         return;
+    SyncCounter::Phase phase("Save");
+    Profiler::Scope timer("Save");
+    // All fields of this step are downloaded together when the batch is committed
+    StorageHelper::beginBatch();
     if(simulationsSinceLastSave % savestep == 0) {
-        this->env->save();
-        for (auto population: this->bacterialPopulations) {
-            population->save();
+        // A restart continues from the last save, the model time of later frames and analytics follows from it
+        H5::H5File *file = this->storage.get();
+        unsigned long long savedSteps = steps;
+        StorageHelper::submitTask([file, savedSteps]() {
+            H5::Attribute attribute = file->attrExists("Steps") ? file->openAttribute("Steps") :
+                    file->createAttribute("Steps", H5::PredType::STD_U64LE, StorageHelper::H5Scalar);
+            attribute.write(H5::PredType::NATIVE_ULLONG, &savedSteps);
+        });
+        this->env->save(getTime());
+        if(populationOutput) {
+            for (auto population: this->bacterialPopulations) {
+                population->save();
+            }
         }
         simulationsSinceLastSave = 0;
     }
+    // Regions and pyramid levels of the environment follow their own steps
+    this->env->saveOutputs();
+    StorageHelper::commitBatch();
 }
 
 Model2D::Model2D(H5::H5File &input) {
@@ -146,15 +291,101 @@ Model2D::Model2D(H5::H5File &input) {
     this->storage->openAttribute("dt").read(H5::PredType::NATIVE_DOUBLE, &Modeldt);
     this->storage->openAttribute("Environment dt").read(H5::PredType::NATIVE_DOUBLE, &EnvironmentDt);
     this->storage->openAttribute("saveStep").read(H5::PredType::NATIVE_INT, &savestep);
+    if(this->storage->attrExists("Steps"))
+        this->storage->openAttribute("Steps").read(H5::PredType::NATIVE_ULLONG, &steps);
+    else if(this->storage->openGroup("Environment").nameExists("Frames") &&
+            this->storage->openGroup("Environment/Frames").nameExists("Time")) {
+        // Files written before "Steps" was stored, the model time of the last environment frame is the latest known
+        H5::DataSet time = this->storage->openDataSet("Environment/Frames/Time");
+        H5::DataSpace space = time.getSpace();
+        hsize_t frames = space.getSimpleExtentNpoints();
+        if(frames > 0) {
+            hsize_t last = frames - 1, count = 1;
+            double lastTime;
+            space.selectHyperslab(H5S_SELECT_SET, &count, &last);
+            time.read(&lastTime, H5::PredType::NATIVE_DOUBLE, H5::DataSpace(1, &count), space);
+            if(std::isfinite(lastTime))
+                steps = (unsigned long long)std::llround(lastTime/Modeldt);
+        }
+    }
+    // Environments saved for recompute on demand restart from a keyframe before the last save
+    this->env->resumeFromDeposits(Modeldt, EnvironmentDt);
+
+}
+
+Model2D::Model2D(const Checkpoint &checkpoint) {
+    this->env = shared_ptr<Environment>(new Environment(checkpoint, "Environment/"));
+    for(auto name: checkpoint.getChildren("Populations")) {
+        shared_ptr<BacterialPopulation> population =
+                BacterialPopulation::createFromCheckpoint(this->env, checkpoint, "Populations/" + name + "/");
+        if(!population)
+            throw exception("Checkpoint contains a population of unknown type");
+        this->bacterialPopulations.push_back(population);
+    }
 
+    this->Modeldt = checkpoint.getValue("Model/dt");
+    init();
+    this->EnvironmentDt = checkpoint.getValue("Model/Environment dt");
+    this->savestep = (int)checkpoint.getValue("Model/Save step");
+    this->simulationsSinceLastSave = (int)checkpoint.getValue("Model/Simulations since last save");
+    this->steps = (unsigned long long)checkpoint.getValue("Model/Steps");
+    std::vector<double> seed = checkpoint.getValues("Model/Random seed");
+    af::setSeed(((unsigned long long)seed[0] << 32) | (unsigned long long)seed[1]);
+}
+
+void Model2D::writeCheckpoint(std::string path) {
+    SyncCounter::Phase phase("Checkpoint");
+    Profiler::Scope timer("Checkpoint");
+    // ArrayFire does not expose the counters of its generators, instead the generator is reseeded at every checkpoint
+    // so a restart continues with the same random numbers
+    unsigned long long seed = af::getSeed()*6364136223846793005ULL + steps + 1442695040888963407ULL;
+    af::setSeed(seed);
+
+    std::shared_ptr<Checkpoint> checkpoint(new Checkpoint());
+    checkpoint->setValue("Model/dt", Modeldt);
+    checkpoint->setValue("Model/Environment dt", EnvironmentDt);
+    checkpoint->setValue("Model/Steps", steps);
+    checkpoint->setValue("Model/Time", getTime());
+    checkpoint->setValue("Model/Save step", savestep);
+    checkpoint->setValue("Model/Simulations since last save", simulationsSinceLastSave);
+    checkpoint->setValues("Model/Random seed", {(double)(seed >> 32), (double)(seed & 0xffffffffULL)});
+    this->env->writeCheckpoint(*checkpoint, "Environment/");
+    for(auto population: this->bacterialPopulations)
+        population->writeCheckpoint(*checkpoint, "Populations/" + population->name + "/");
+
+    // All arrays are on the host now, only the file is written in the background
+    if(writer)
+        writer->enqueueTask([checkpoint, path] { checkpoint->write(path); });
+    else
+        checkpoint->write(path);
+}
+
+void Model2D::enableCheckpoints(std::string path, int interval) {
+    // HDF5 is only used by one thread, checkpoints are therefore written by the storage writer thread
+    if(!writer)
+        enableAsyncStorage();
+    checkpointPath = path;
+    checkpointInterval = interval;
+}
+
+void Model2D::enableProfiling(std::string reportPath, bool synchronized) {
+    profileReportPath = reportPath;
+    Profiler::setSynchronized(synchronized);
+    Profiler::setEnabled(true);
+}
+
+void Model2D::enableTracing(std::string path) {
+    tracePath = path;
+    Tracer::setThreadName("Simulation");
+    Tracer::setEnabled(true);
 }
 
 GPU_REALTYPE Model2D::simulateFor(GPU_REALTYPE t, bool *continueSim) {
     std::cout << "Simulating Environment with dt=" << EnvironmentDt << std::endl;
     std::cout << "Simulating Model with dt=" << Modeldt << std::endl;
     int iterations = floor(t/Modeldt);
-    time_t gtime = time(NULL);
-    time_t start = time(NULL);
+    auto gtime = std::chrono::steady_clock::now();
+    auto start = gtime;
     int i;
     for(i = 0; i < iterations; i++) {
         if (continueSim && !(*continueSim))
@@ -162,22 +393,28 @@ GPU_REALTYPE Model2D::simulateFor(GPU_REALTYPE t, bool *continueSim) {
 
         simulateTimestep();
         if (i && !(i % 100)) {
-            af::sync();
-            double seconds = difftime(time(NULL), start);
+            // No explicit sync, the queue of the device limits how far the host runs ahead
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
             std::cout << 100 / seconds << " iterations per second ("
                       << i * Modeldt << "/" << iterations * Modeldt
                       << ") ETA: " << (iterations - i) / (60 * (100 / seconds)) << " min \r";
-            time(&start);
+            start = std::chrono::steady_clock::now();
 //            bacterialPopulations[0]->printInternals();
         }
         save();
+        if(checkpointInterval > 0 && steps % checkpointInterval == 0)
+            writeCheckpoint(checkpointPath);
 #ifndef NO_GRAPHICS
         visualize();
 #endif
     }
-    double seconds_since_start = difftime(time(NULL), gtime);
+    // Pending work belongs to the simulated time
+    af::sync();
+    double seconds_since_start = std::chrono::duration<double>(std::chrono::steady_clock::now() - gtime).count();
     std::cout << std::endl;
     std::cout << "Average speed: " << (i-1)*Modeldt/seconds_since_start << " modeltime/s" << std::endl;
+    if(SyncCounter::isEnabled())
+        SyncCounter::report(std::cout);
     return (i-1)*Modeldt;
 }
 
@@ -188,6 +425,11 @@ void Model2D::processAllBacteriaParallel(double dt) {
 }
 
 array Model2D::processBacteriaParallel(double dt) {
+    // Populations may have grown since the last step
+    totalBacteria = 0;
+    for(auto population: bacterialPopulations)
+        totalBacteria += population->getSize();
+
     // Accumulate all interacting grid points from all populations
     array allPositions(totalBacteria, 4, af::dtype::u32);
     array indexes(totalBacteria, af::dtype::u32);
@@ -225,6 +467,7 @@ void Model2D::processOverlappingBacteria(array &overlappingBacteria, double dt)
     // randomly process overlapping individuals
     if(overlappingCount) {
 //        std::cout << overlappingCount << " overlaping bacteria." <<std::endl;
+        SyncCounter::record("Model2D::processOverlappingBacteria");
         unsigned int *missed = overlappingBacteria.host<unsigned int>();
         std::vector<bacteriumRef> missingBacteria;
         missingBacteria.reserve(overlappingCount);
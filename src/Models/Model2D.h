@@ -8,6 +8,10 @@
 #include <array>
 #include "Environments/Environment.h"
 #include "BacterialPopulations/BacterialPopulation.h"
+#include "General/AsyncWriter.h"
+#include "General/RawTrajectory.h"
+#include "General/WorkerThread.h"
+#include "Analytics/Reducer.h"
 
 struct bacteriumRef {
     shared_ptr<BacterialPopulation> population;
@@ -20,11 +24,17 @@ class Model2D {
 #endif
     int totalBacteria = 0;
     unique_ptr<H5::H5File> storage;
+    unique_ptr<AsyncWriter> writer;
+    unique_ptr<RawTrajectoryWriter> rawWriter;
+    unique_ptr<WorkerThread> populationWorker;
 public:
     Model2D(shared_ptr<Environment> environment, std::vector<shared_ptr<BacterialPopulation>> populations, double dt);
 
     Model2D(H5::H5File &input);
 
+    // Restarts from a checkpoint, storage has to be set up again
+    Model2D(const Checkpoint &checkpoint);
+
     shared_ptr<Environment> env;
 
     std::vector<shared_ptr<BacterialPopulation>> bacterialPopulations;
@@ -46,15 +56,56 @@ public:
 
     void closeStorage();
 
+    // Moves all HDF5 writes to a background thread, the simulation only stages device to host copies
+    void enableAsyncStorage(size_t maxQueuedWrites = 64);
+
+    // Writes all frames to a raw trajectory at path, the HDF5 file of setupStorage then only holds the parameters.
+    // Has to be called after setupStorage and before the first save.
+    void enableRawStorage(std::string path);
+
     void save();
+
+    // Runs the populations on a worker thread while the environment diffuses, saves are downloaded by the
+    // asynchronous storage. Only used if all populations are independent of the diffusion of the same timestep.
+    void setPipelined(bool enabled);
+
+    // Evaluates the reducer every reducer->interval timesteps, results are stored below "/Analytics"
+    void addReducer(shared_ptr<Reducer> reducer);
+    // Population frames can be skipped when only the analytics are of interest. Files without population frames can
+    // not be used for restarts, checkpoints can.
+    void setPopulationOutput(bool enabled) { populationOutput = enabled; }
+
+    // Writes the complete simulation state to path, on the writer thread if asynchronous storage is enabled
+    void writeCheckpoint(std::string path);
+    // Writes a checkpoint to path every interval timesteps of simulateFor
+    void enableCheckpoints(std::string path, int interval);
+
+    // Times the phases of every step, the report is written to the group "Performance" of the output by
+    // closeStorage and as JSON to reportPath if given. Synchronised phases wait for the device.
+    void enableProfiling(std::string reportPath = "", bool synchronized = false);
+    // Records a timeline of all threads, written to path in the Chrome trace event format by closeStorage
+    void enableTracing(std::string path);
+
+    double getTime() { return steps*Modeldt; }
+    int getSaveStep() { return savestep; }
 private:
     double EnvironmentDt;
 //    double PopulationDt;
     double Modeldt;
     int simulationsSinceLastSave = 0;
     int savestep = 1;
+    unsigned long long steps = 0;
+    std::string checkpointPath;
+    int checkpointInterval = 0;
+    std::string profileReportPath;
+    std::string tracePath;
+    std::vector<shared_ptr<Reducer>> reducers;
+    bool populationOutput = true;
 
     void init();
+    void livePopulations();
+    void evaluateReducers();
+    H5::Group getAnalyticsGroup();
     array processBacteriaParallel(double dt);
     void processOverlappingBacteria(array &overlaping, double dt);
 
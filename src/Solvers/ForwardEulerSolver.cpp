@@ -3,9 +3,13 @@
 //
 
 #include "ForwardEulerSolver.h"
+#include "General/Profiler.h"
+#include "General/Tracer.h"
 
 void ForwardEulerSolver::solveStep(DifferentialEquation &eq, array &inital_state, GPU_REALTYPE stepsize) const {
+    Tracer::Scope trace("ForwardEulerSolver::solveStep");
     inital_state += eq.rateofchange(inital_state)*stepsize;
+    Profiler::countEvaluations();
     eval(inital_state);
 }
 
@@ -3,9 +3,12 @@
 //
 
 #include "RungeKuttaSolver.h"
+#include "General/Profiler.h"
+#include "General/Tracer.h"
 
 
 void RungeKuttaSolver::solveStep(DifferentialEquation &eq, array &initial_state, GPU_REALTYPE stepsize) const {
+    Tracer::Scope trace("RungeKuttaSolver::solveStep");
     array dxk = eq.rateofchange(initial_state);
     array xa = initial_state + 0.5*stepsize*dxk;
     array dxa = eq.rateofchange(xa);
@@ -15,6 +18,7 @@ void RungeKuttaSolver::solveStep(DifferentialEquation &eq, array &initial_state,
     array dxc = eq.rateofchange(xc);
 
     initial_state += stepsize/6 * (dxk + 2*(dxa + dxb) + dxc);
+    Profiler::countEvaluations();
     eval(initial_state);
 }
 
@@ -0,0 +1,415 @@
+//
+// Parameter sweeps over simulations stored in HDF5 files
+//
+
+#include "ParameterSweep.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <cmath>
+#include <cerrno>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <sched.h>
+#include "Models/Model2D.h"
+#include "Analytics/Reducers.h"
+#include "General/Ligand.h"
+#include "General/StorageHelper.h"
+
+namespace {
+    std::string trim(std::string value) {
+        size_t first = value.find_first_not_of(" \t\r");
+        if(first == std::string::npos)
+            return "";
+        size_t last = value.find_last_not_of(" \t\r");
+        return value.substr(first, last - first + 1);
+    }
+
+    std::vector<double> parseValues(std::string values) {
+        std::istringstream stream(values);
+        std::vector<double> parsed;
+        std::string first;
+        stream >> first;
+        if(first == "linspace") {
+            double start, stop;
+            int count;
+            if(!(stream >> start >> stop >> count) || count < 1)
+                throw exception("linspace expects start, stop and the number of values");
+            for(int i = 0; i < count; i++)
+                parsed.push_back(count == 1 ? start : start + (stop - start)*i/(count - 1));
+            return parsed;
+        }
+
+        stream.clear();
+        stream.str(values);
+        double value;
+        while(stream >> value)
+            parsed.push_back(value);
+        if(parsed.empty())
+            throw exception("A swept parameter needs at least one value");
+        return parsed;
+    }
+
+    // Mean of the last saved frame of a ligand, keyframes and deltas are reconstructed by the environment
+    double readFinalMean(H5::Group environment, std::string ligandName, unsigned int replica, hsize_t &frames) {
+        frames = Environment::getSavedFrameCount(environment, ligandName, replica);
+        if(frames == 0)
+            return std::numeric_limits<double>::quiet_NaN();
+
+        std::vector<double> frame = Environment::readSavedFrame(environment, ligandName, frames - 1, replica);
+        double total = 0;
+        for(auto value: frame)
+            total += value;
+        return total/frame.size();
+    }
+
+    // Final mean concentration of every ligand, averaged over all replicas
+    std::map<std::string, double> readFinalConcentrations(std::string path, hsize_t &frames) {
+        H5::H5File file(path, H5F_ACC_RDONLY);
+        H5::Group environment = file.openGroup("Environment");
+        unsigned int replicas = 1;
+        H5::Group ligandGroup = environment;
+        if(environment.attrExists("Replicas")) {
+            environment.openAttribute("Replicas").read(H5::PredType::NATIVE_UINT, &replicas);
+            ligandGroup = environment.openGroup(Environment::getReplicaGroupName(0));
+        }
+
+        // Every replica stores the same ligands, the groups next to them (Deltas, Regions, ...) are skipped
+        std::vector<std::string> ligandNames;
+        for(hsize_t i = 0; i < ligandGroup.getNumObjs(); i++)
+            if(ligandGroup.childObjType(i) == H5O_TYPE_DATASET)
+                ligandNames.push_back(ligandGroup.getObjnameByIdx(i));
+
+        std::map<std::string, double> concentrations;
+        frames = 0;
+        for(unsigned int r = 0; r < replicas; r++)
+            for(auto &name: ligandNames)
+                concentrations[name] += readFinalMean(environment, name, r, frames)/replicas;
+        return concentrations;
+    }
+
+    void writeStrings(H5::H5File &file, std::string name, std::vector<std::string> values) {
+        std::vector<const char *> cstrings;
+        for(auto &value: values)
+            cstrings.push_back(value.c_str());
+        hsize_t count = values.size();
+        H5::StrType varstrtype(0, H5T_VARIABLE);
+        file.createDataSet(name, varstrtype, H5::DataSpace(1, &count)).write(cstrings.data(), varstrtype);
+    }
+}
+
+ParameterSweep::ParameterSweep(std::string specPath) {
+    std::ifstream spec(specPath);
+    if(!spec)
+        throw exception("Could not open sweep specification");
+
+    std::string line;
+    while(std::getline(spec, line)) {
+        line = trim(line.substr(0, line.find('#')));
+        if(line.empty())
+            continue;
+        size_t split = line.find_first_of(" \t");
+        std::string key = line.substr(0, split);
+        std::string value = split == std::string::npos ? "" : trim(line.substr(split));
+
+        if(key == "template")
+            templatePath = value;
+        else if(key == "output")
+            outputPath = value;
+        else if(key == "population")
+            populationName = value;
+        else if(key == "time")
+            simulationTime = atof(value.c_str());
+        else if(key == "workers")
+            workers = std::max(atoi(value.c_str()), 1);
+        else if(key == "cores")
+            coresPerWorker = std::max(atoi(value.c_str()), 0);
+        else if(key == "parameter") {
+            size_t equals = value.find('=');
+            if(equals == std::string::npos)
+                throw exception("Parameters are specified as: parameter <name> = <values>");
+            SweepParameter parameter;
+            parameter.name = trim(value.substr(0, equals));
+            parameter.values = parseValues(value.substr(equals + 1));
+            parameters.push_back(parameter);
+        } else if(key == "analytics") {
+            SweepReducer reducer;
+            reducer.name = value;
+            std::istringstream stream(value);
+            if(!(stream >> reducer.type >> reducer.interval))
+                throw exception("Analytics are specified as: analytics <reducer> <interval> <arguments>");
+            double argument;
+            while(stream >> argument)
+                reducer.arguments.push_back(argument);
+            reducers.push_back(reducer);
+        } else if(key == "trajectories")
+            trajectories = value != "off";
+        else
+            throw exception(("Unknown sweep directive " + key).c_str());
+    }
+
+    if(templatePath.empty() || outputPath.empty() || populationName.empty() || simulationTime <= 0)
+        throw exception("A sweep requires a template, an output directory, a population and a simulation time");
+
+    expandPoints();
+    if(mkdir(outputPath.c_str(), 0755) && errno != EEXIST)
+        throw exception("Could not create sweep output directory");
+    readIndex();
+}
+
+void ParameterSweep::expandPoints() {
+    // Cartesian product, the last parameter varies fastest
+    points = std::vector<std::vector<double>> {std::vector<double>()};
+    for(auto &parameter: parameters) {
+        std::vector<std::vector<double>> expanded;
+        for(auto &point: points) {
+            for(auto value: parameter.values) {
+                expanded.push_back(point);
+                expanded.back().push_back(value);
+            }
+        }
+        points = expanded;
+    }
+}
+
+std::string ParameterSweep::getPointPath(size_t point) {
+    std::ostringstream path;
+    path << outputPath << "/point_" << std::setw(5) << std::setfill('0') << point << ".h5";
+    return path.str();
+}
+
+void ParameterSweep::readIndex() {
+    // Each line holds the index of a finished point followed by its parameter values. Points are only regarded as
+    // finished if the values still match, so editing the specification never skips a changed point.
+    std::ifstream index(outputPath + "/index.txt");
+    std::string line;
+    while(std::getline(index, line)) {
+        std::istringstream stream(line);
+        size_t point;
+        if(!(stream >> point) || point >= points.size())
+            continue;
+        std::vector<double> values;
+        double value;
+        while(stream >> value)
+            values.push_back(value);
+        if(values.size() != points[point].size())
+            continue;
+        bool matches = true;
+        for(size_t i = 0; i < values.size(); i++)
+            matches &= std::abs(values[i] - points[point][i]) <= 1e-12*std::max(1.0, std::abs(points[point][i]));
+        if(matches)
+            finished.insert(point);
+    }
+}
+
+void ParameterSweep::markFinished(size_t point) {
+    std::ofstream index(outputPath + "/index.txt", std::ios::app);
+    index << point << std::setprecision(17);
+    for(auto value: points[point])
+        index << " " << value;
+    index << std::endl;
+    finished.insert(point);
+}
+
+void ParameterSweep::applyParameter(H5::Group population, std::string name, double value) {
+    // Fields of a ligand interaction, e.g. "Ligand interactions[0].uptakeRate"
+    size_t bracket = name.find('[');
+    if(bracket != std::string::npos) {
+        size_t closing = name.find("].", bracket);
+        if(closing == std::string::npos)
+            throw exception(("Invalid parameter " + name).c_str());
+        H5::Attribute attribute = population.openAttribute(name.substr(0, bracket));
+        hsize_t count;
+        attribute.getSpace().getSimpleExtentDims(&count);
+        std::vector<LigandInteraction> interactions(count);
+        attribute.read(LigandInteraction::getH5ReadType(), interactions.data());
+
+        size_t i = std::stoul(name.substr(bracket + 1, closing - bracket - 1));
+        std::string field = name.substr(closing + 2);
+        if(i >= interactions.size())
+            throw exception(("Ligand interaction out of range in " + name).c_str());
+        if(field == "productionRate")
+            interactions[i].productionRate = value;
+        else if(field == "uptakeRate")
+            interactions[i].uptakeRate = value;
+        else if(field == "Ku")
+            interactions[i].Ku = value;
+        else if(field == "Kon")
+            interactions[i].Kon = value;
+        else if(field == "Koff")
+            interactions[i].Koff = value;
+        else
+            throw exception(("Unknown ligand interaction field " + field).c_str());
+        attribute.write(LigandInteraction::getH5ReadType(), interactions.data());
+        return;
+    }
+
+    if(!population.attrExists(name))
+        throw exception(("Population has no parameter " + name).c_str());
+    // HDF5 converts to the stored type of the attribute
+    population.openAttribute(name).write(H5::PredType::NATIVE_DOUBLE, &value);
+}
+
+int ParameterSweep::runPoint(size_t point, int worker, bool *continueSweep) {
+#ifdef __linux__
+    if(coresPerWorker > 0) {
+        cpu_set_t cores;
+        CPU_ZERO(&cores);
+        for(int i = 0; i < coresPerWorker; i++)
+            CPU_SET(worker*coresPerWorker + i, &cores);
+        sched_setaffinity(0, sizeof(cores), &cores);
+    }
+#endif
+    try {
+        af::setDevice(worker % af::getDeviceCount());
+
+        // Every point starts from a fresh copy of the template
+        std::string path = getPointPath(point);
+        {
+            std::ifstream source(templatePath, std::ios::binary);
+            std::ofstream target(path, std::ios::binary | std::ios::trunc);
+            if(!source || !target)
+                throw exception("Could not copy sweep template");
+            target << source.rdbuf();
+        }
+
+        H5::H5File file(path, H5F_ACC_RDWR);
+        {
+            H5::Group population = file.openGroup("Populations").openGroup(populationName);
+            for(size_t i = 0; i < parameters.size(); i++)
+                applyParameter(population, parameters[i].name, points[point][i]);
+        }
+
+        Model2D model(file);
+        model.setPopulationOutput(trajectories);
+        for(auto &reducer: reducers) {
+            shared_ptr<BacterialPopulation> population;
+            for(auto candidate: model.bacterialPopulations)
+                if(candidate->name == populationName)
+                    population = candidate;
+            model.addReducer(createReducer(reducer.type, reducer.name, reducer.interval, reducer.arguments, model.env,
+                                           population));
+        }
+        model.enableAsyncStorage();
+        model.simulateFor(simulationTime, continueSweep);
+        model.closeStorage();
+        return (continueSweep && !*continueSweep) ? 2 : 0;
+    } catch(H5::Exception &e) {
+        std::cerr << "Point " << point << ": " << e.getDetailMsg() << std::endl;
+    } catch(std::exception &e) {
+        std::cerr << "Point " << point << ": " << e.what() << std::endl;
+    }
+    return 1;
+}
+
+bool ParameterSweep::run(bool *continueSweep) {
+    // Points run in child processes: device contexts are not shared and a crashing point does not end the sweep.
+    // The parent never initializes ArrayFire so that every child can choose its own device.
+    std::map<pid_t, std::pair<size_t, int>> running;
+    std::vector<bool> busyWorkers(workers, false);
+    size_t next = 0;
+
+    while(true) {
+        while(running.size() < (size_t)workers && (!continueSweep || *continueSweep) && next < points.size()) {
+            size_t point = next++;
+            if(finished.count(point))
+                continue;
+            int worker = 0;
+            while(busyWorkers[worker])
+                worker++;
+
+            pid_t pid = fork();
+            if(pid < 0)
+                throw exception("Could not start sweep worker");
+            if(pid == 0)
+                _exit(runPoint(point, worker, continueSweep));
+            busyWorkers[worker] = true;
+            running[pid] = std::make_pair(point, worker);
+        }
+        if(running.empty())
+            break;
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if(pid < 0) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        auto child = running.find(pid);
+        if(child == running.end())
+            continue;
+        size_t point = child->second.first;
+        busyWorkers[child->second.second] = false;
+        running.erase(child);
+
+        if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            markFinished(point);
+            std::cout << "Finished point " << point << " (" << finished.size() << "/" << points.size() << ")" << std::endl;
+        } else
+            std::cout << "Point " << point << " did not finish" << std::endl;
+    }
+    return finished.size() == points.size();
+}
+
+void ParameterSweep::writeSummary() {
+    size_t nPoints = points.size();
+    size_t nParameters = parameters.size();
+    H5::H5File summary(outputPath + "/summary.h5", H5F_ACC_TRUNC);
+    summary.createAttribute("Template", StorageHelper::H5VariableString, StorageHelper::H5Scalar)
+            .write(StorageHelper::H5VariableString, templatePath);
+    summary.createAttribute("Population", StorageHelper::H5VariableString, StorageHelper::H5Scalar)
+            .write(StorageHelper::H5VariableString, populationName);
+    summary.createAttribute("Simulation time", H5::PredType::IEEE_F64LE, StorageHelper::H5Scalar)
+            .write(H5::PredType::NATIVE_DOUBLE, &simulationTime);
+
+    std::vector<std::string> names, files;
+    for(auto &parameter: parameters)
+        names.push_back(parameter.name);
+    writeStrings(summary, "Parameter names", names);
+
+    std::vector<double> values;
+    std::vector<unsigned char> done;
+    for(size_t i = 0; i < nPoints; i++) {
+        values.insert(values.end(), points[i].begin(), points[i].end());
+        done.push_back(finished.count(i));
+        files.push_back(getPointPath(i));
+    }
+    hsize_t parameterDims[2] = {nPoints, nParameters};
+    summary.createDataSet("Parameters", H5::PredType::IEEE_F64LE, H5::DataSpace(2, parameterDims))
+            .write(values.data(), H5::PredType::NATIVE_DOUBLE);
+    hsize_t pointCount = nPoints;
+    summary.createDataSet("Finished", H5::PredType::STD_U8LE, H5::DataSpace(1, &pointCount))
+            .write(done.data(), H5::PredType::NATIVE_UCHAR);
+    writeStrings(summary, "Files", files);
+
+    // Final state of every finished point, NaN for points that did not finish
+    std::vector<std::map<std::string, double>> concentrations(nPoints);
+    std::vector<unsigned long long> frames(nPoints, 0);
+    std::vector<std::string> ligandNames;
+    for(size_t i = 0; i < nPoints; i++) {
+        if(!finished.count(i))
+            continue;
+        hsize_t pointFrames;
+        concentrations[i] = readFinalConcentrations(getPointPath(i), pointFrames);
+        frames[i] = pointFrames;
+        if(ligandNames.empty())
+            for(auto &ligand: concentrations[i])
+                ligandNames.push_back(ligand.first);
+    }
+    writeStrings(summary, "Ligand names", ligandNames);
+
+    std::vector<double> means;
+    for(size_t i = 0; i < nPoints; i++)
+        for(auto &ligand: ligandNames)
+            means.push_back(concentrations[i].count(ligand) ? concentrations[i][ligand] : std::numeric_limits<double>::quiet_NaN());
+    hsize_t meanDims[2] = {nPoints, ligandNames.size()};
+    summary.createDataSet("Final mean concentration", H5::PredType::IEEE_F64LE, H5::DataSpace(2, meanDims))
+            .write(means.data(), H5::PredType::NATIVE_DOUBLE);
+    summary.createDataSet("Saved frames", H5::PredType::STD_U64LE, H5::DataSpace(1, &pointCount))
+            .write(frames.data(), H5::PredType::NATIVE_ULLONG);
+}
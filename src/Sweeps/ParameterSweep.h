@@ -0,0 +1,84 @@
+//
+// Parameter sweeps over simulations stored in HDF5 files
+//
+
+#ifndef BACTSIM_GPU_PARAMETERSWEEP_H
+#define BACTSIM_GPU_PARAMETERSWEEP_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <H5Cpp.h>
+
+struct SweepParameter {
+    // Attribute of the population group, e.g. "Swimm speed" or "K_C", or a field of a ligand interaction
+    // written as "Ligand interactions[0].uptakeRate"
+    std::string name;
+    std::vector<double> values;
+};
+
+struct SweepReducer {
+    // Type of a built-in reducer (see createReducer) evaluated every interval timesteps, the directive is its name
+    std::string type;
+    unsigned int interval;
+    std::vector<double> arguments;
+    std::string name;
+};
+
+/**
+ * Runs all points of the cartesian product of the swept parameters. Every point starts from a copy of a template
+ * simulation file (e.g. written by one of the examples) whose population attributes are overwritten with the values
+ * of the point. Points are simulated in worker processes, each bound to a device and optionally to a set of cores.
+ *
+ * Sweep specification, one directive per line, '#' starts a comment:
+ *   template Example4.h5
+ *   output sweep
+ *   time 2400
+ *   workers 4
+ *   cores 2                                  (cores per worker, 0 disables binding)
+ *   population Population 1
+ *   parameter Swimm speed = 10 20 30
+ *   parameter K_C = linspace 2.5 3.5 5
+ *   parameter Ligand interactions[0].uptakeRate = 0.5 1
+ *   analytics ChemotacticDrift 10 250 250    (reducer of the swept population, interval, arguments)
+ *   trajectories off                         (no population frames, only environment and analytics)
+ *
+ * Finished points are appended to <output>/index.txt, restarting the sweep skips them. The final state of all
+ * finished points is aggregated into <output>/summary.h5.
+ */
+class ParameterSweep {
+public:
+    ParameterSweep(std::string specPath);
+
+    // Simulate all points not yet finished, returns false if the sweep was interrupted
+    bool run(bool *continueSweep);
+    void writeSummary();
+
+    size_t getPointCount() { return points.size(); }
+    std::vector<double> getPoint(size_t point) { return points[point]; }
+    std::string getPointPath(size_t point);
+
+    static void applyParameter(H5::Group population, std::string name, double value);
+
+private:
+    void expandPoints();
+    void readIndex();
+    void markFinished(size_t point);
+    int runPoint(size_t point, int worker, bool *continueSweep);
+
+    std::string templatePath;
+    std::string outputPath;
+    std::string populationName;
+    double simulationTime = 0;
+    int workers = 1;
+    int coresPerWorker = 0;
+    std::vector<SweepParameter> parameters;
+    std::vector<SweepReducer> reducers;
+    bool trajectories = true;
+
+    std::vector<std::vector<double>> points;
+    std::set<size_t> finished;
+};
+
+
+#endif //BACTSIM_GPU_PARAMETERSWEEP_H
@@ -0,0 +1,235 @@
+//
+// Microbenchmarks of the core primitives, swept over grid size, number of bacteria and number of ligands
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <H5Cpp.h>
+#include "Environments/Environment.h"
+#include "General/ArrayFireHelper.h"
+#include "General/StorageHelper.h"
+#include "Solvers/ForwardEulerSolver.h"
+#include "Solvers/RungeKuttaSolver.h"
+
+namespace {
+    struct Case {
+        unsigned int grid;
+        unsigned int bacteria;
+        unsigned int ligands;
+    };
+
+    // Uptake proportional to the sensed concentrations, a stand-in for the equations of the populations
+    class DecayEquation : public DifferentialEquation {
+    public:
+        array rateofchange(array &input) override { return -0.1*input; }
+    };
+
+    class Benchmark {
+    public:
+        Benchmark(std::ostream &out, unsigned int repetitions) : out(out), repetitions(std::max(repetitions, 1u)) {
+            char name[64] = {0}, platform[64] = {0}, toolkit[64] = {0}, compute[64] = {0};
+            af::deviceInfo(name, platform, toolkit, compute);
+            backend = getBackendName(af::getActiveBackend());
+            device = name;
+            out << "backend,device,benchmark,grid,bacteria,ligands,repetitions,seconds" << std::endl;
+        }
+
+        // Every call has to evaluate its results, the first call is not timed (JIT compilation, allocations)
+        void run(std::string name, Case c, std::function<void()> call) {
+            call();
+            af::sync();
+            auto start = std::chrono::steady_clock::now();
+            for(unsigned int i = 0; i < repetitions; i++)
+                call();
+            af::sync();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()/repetitions;
+            out << backend << ",\"" << device << "\"," << name << "," << c.grid << "," << c.bacteria << ","
+                << c.ligands << "," << repetitions << "," << seconds << std::endl;
+        }
+
+    private:
+        static std::string getBackendName(af_backend backend) {
+            switch(backend) {
+                case AF_BACKEND_CPU:
+                    return "cpu";
+                case AF_BACKEND_OPENCL:
+                    return "opencl";
+                case AF_BACKEND_CUDA:
+                    return "cuda";
+                default:
+                    return "default";
+            }
+        }
+
+        std::ostream &out;
+        unsigned int repetitions;
+        std::string backend;
+        std::string device;
+    };
+
+    std::vector<unsigned int> parseList(const char *list) {
+        std::vector<unsigned int> values;
+        std::stringstream stream(list);
+        std::string value;
+        while(std::getline(stream, value, ','))
+            values.push_back((unsigned int)std::strtoul(value.c_str(), nullptr, 10));
+        return values;
+    }
+
+    EnvironmentSettings getSettings(unsigned int grid, unsigned int nLigands, BoundaryConditionType boundary) {
+        EnvironmentSettings settings;
+        settings.resolution = 1;
+        settings.dimensions = std::vector<double> {(double)grid, (double)grid};
+        settings.boundaryCondition = BoundaryCondition(boundary);
+        for(unsigned int i = 0; i < nLigands; i++)
+            settings.ligands.push_back(Ligand {"Ligand " + std::to_string(i), i, 1.0, 0.01, 0.01, 10.0});
+        return settings;
+    }
+
+    void benchmarkEnvironment(Benchmark &bench, Case c) {
+        std::vector<std::pair<std::string, BoundaryConditionType>> boundaries =
+                {{"neumann", BC_NEUMANN}, {"dirichelet", BC_DIRICHELET}, {"periodic", BC_PERIODIC}};
+        for(auto &boundary: boundaries) {
+            Environment env(getSettings(c.grid, c.ligands, boundary.second));
+            double dt = env.getStabledt();
+            bench.run("boundary_" + boundary.first, c, [&]() { env.applyBoundaryConditions(); });
+            bench.run("simulateTimestep_" + boundary.first, c, [&]() { env.simulateTimestep(dt); });
+        }
+    }
+
+    void benchmarkInteraction(Benchmark &bench, Case c) {
+        Environment env(getSettings(c.grid, c.ligands, BC_NEUMANN));
+        std::vector<int> ligandIds;
+        for(unsigned int i = 0; i < c.ligands; i++)
+            ligandIds.push_back(i);
+        array ligands = env.getLigandMapping(ligandIds);
+
+        // Bacteria stay one grid point away from the border, all four surrounding grid points are inside
+        array xpos = randu(c.bacteria, AF_GPUTYPE)*(c.grid - 2);
+        array ypos = randu(c.bacteria, AF_GPUTYPE)*(c.grid - 2);
+        array positions(c.bacteria, 4, af::dtype::u32);
+        array weights(c.bacteria, 4, AF_GPUTYPE);
+        bench.run("setInterpolatedPositions", c, [&]() { env.setInterpolatedPositions(xpos, ypos, positions, weights); });
+
+        array concentrations;
+        bench.run("getLigandConcentrations", c, [&]() {
+            concentrations = env.getLigandConcentrations(positions, weights, ligands);
+        });
+        array changes = constant(1e-6, c.bacteria, c.ligands, AF_GPUTYPE);
+        bench.run("changeLigandConcentrationBy", c, [&]() {
+            env.changeLigandConcentrationBy(changes, positions, weights, ligands);
+        });
+
+        DecayEquation equation;
+        array state = randu(c.bacteria, c.ligands, AF_GPUTYPE);
+        ForwardEulerSolver euler;
+        bench.run("ForwardEulerSolver::solveStep", c, [&]() { euler.solveStep(equation, state, 0.01); });
+        RungeKuttaSolver rungeKutta;
+        bench.run("RungeKuttaSolver::solveStep", c, [&]() { rungeKutta.solveStep(equation, state, 0.01); });
+    }
+
+    void benchmarkUnique(Benchmark &bench, Case c) {
+        // Grid point indexes of a grid of c.grid x c.grid points, duplicates as with dense populations
+        array indexes = (randu(c.bacteria, AF_GPUTYPE)*(c.grid*c.grid)).as(af::dtype::u32);
+        array unique;
+        bench.run("isUnique", c, [&]() {
+            unique = ArrayFireHelper::isUnique(indexes);
+            unique.eval();
+        });
+    }
+
+    void benchmarkSampler(Benchmark &bench, Case c) {
+        array angles;
+        bench.run("gammaSampler", c, [&]() {
+            angles = ArrayFireHelper::gammaSampler(c.bacteria, 4, 18.32/360*2*Pi, -4.6/360*2*Pi);
+            angles.eval();
+        });
+    }
+
+    // Frames of the environment, appended synchronously without an AsyncWriter
+    void benchmarkFrameStorage(Benchmark &bench, Case c, std::string path) {
+        H5::H5File file(path, H5F_ACC_TRUNC);
+        H5::Group group = file.createGroup("Bench");
+        array frame = randu(c.grid, c.grid, AF_GPUTYPE);
+        H5::DataSet frames = StorageHelper::createFrameDataSet(group, "Frame", c.grid, c.grid);
+        bench.run("StorageHelper::appendDataToDataSet", c, [&]() {
+            StorageHelper::appendDataToDataSet<GPU_REALTYPE>(frame, frames, HDF5_GPUTYPE);
+        });
+        StorageHelper::flushCompression();
+
+        array loaded;
+        bench.run("StorageHelper::loadLastDataToGpu", c, [&]() {
+            loaded = StorageHelper::loadLastDataToGpu<GPU_REALTYPE>(frames, HDF5_GPUTYPE, AF_GPUTYPE);
+        });
+        bench.run("StorageHelper::readFrameToHost", c, [&]() { StorageHelper::readFrameToHost(frames, 0); });
+        StorageHelper::releaseDataSets();
+    }
+
+    // Ragged rows of dynamic populations
+    void benchmarkRowStorage(Benchmark &bench, Case c, std::string path) {
+        H5::H5File file(path, H5F_ACC_TRUNC);
+        H5::Group group = file.createGroup("Bench");
+        array rows = randu(c.bacteria, AF_GPUTYPE);
+        hsize_t dims = 0, maxDims = H5S_UNLIMITED;
+        H5::DataSet ragged = StorageHelper::createRealDataSet(group, "Rows", H5::DataSpace(1, &dims, &maxDims),
+                                                              StorageHelper::createRaggedProperties(c.bacteria));
+        bench.run("StorageHelper::appendRaggedDataToDataSet", c, [&]() {
+            StorageHelper::appendRaggedDataToDataSet<GPU_REALTYPE>(rows, ragged, HDF5_GPUTYPE);
+        });
+        StorageHelper::releaseDataSets();
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1 && std::string(argv[1]) == "--help") {
+        std::cout << "Usage: " << argv[0] << " [output.csv [repetitions [grids [bacteria [ligands]]]]]" << std::endl;
+        std::cout << "  Times the core primitives on the default device of the backend, writes CSV to output.csv or" << std::endl;
+        std::cout << "  the standard output. grids, bacteria and ligands are comma separated lists to sweep," << std::endl;
+        std::cout << "  e.g. 64,256,1024. The seconds are the mean over repetitions calls after a warm up call." << std::endl;
+        return 0;
+    }
+    std::ofstream file;
+    if(argc > 1 && std::string(argv[1]) != "-")
+        file.open(argv[1]);
+    std::ostream &out = file.is_open() ? file : std::cout;
+    unsigned int repetitions = argc > 2 ? atoi(argv[2]) : 20;
+    std::vector<unsigned int> grids = parseList(argc > 3 ? argv[3] : "64,256,1024");
+    std::vector<unsigned int> bacteria = parseList(argc > 4 ? argv[4] : "1000,10000,100000");
+    std::vector<unsigned int> ligands = parseList(argc > 5 ? argv[5] : "1,4");
+    std::string storagePath = "bench-storage.h5";
+
+    try {
+        af::setSeed(42);
+        Benchmark bench(out, repetitions);
+        // Parameters a primitive does not depend on are reported as 0
+        for(auto grid: grids) {
+            for(auto nLigands: ligands)
+                benchmarkEnvironment(bench, Case {grid, 0, nLigands});
+            benchmarkFrameStorage(bench, Case {grid, 0, 0}, storagePath);
+            for(auto nBacteria: bacteria) {
+                for(auto nLigands: ligands)
+                    benchmarkInteraction(bench, Case {grid, nBacteria, nLigands});
+                benchmarkUnique(bench, Case {grid, nBacteria, 0});
+            }
+        }
+        for(auto nBacteria: bacteria) {
+            benchmarkSampler(bench, Case {0, nBacteria, 0});
+            benchmarkRowStorage(bench, Case {0, nBacteria, 0}, storagePath);
+        }
+    } catch(H5::Exception &e) {
+        std::cerr << e.getDetailMsg() << std::endl;
+        std::remove(storagePath.c_str());
+        return 1;
+    } catch(af::exception &e) {
+        std::cerr << e.what() << std::endl;
+        std::remove(storagePath.c_str());
+        return 1;
+    }
+    std::remove(storagePath.c_str());
+    return 0;
+}
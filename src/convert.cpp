@@ -0,0 +1,28 @@
+//
+// Converts trajectories between HDF5 and the raw trajectory format
+//
+
+#include <iostream>
+#include <H5Cpp.h>
+#include "General/RawTrajectory.h"
+
+int main(int argc, char** argv) {
+    if(argc < 3 || argc > 4) {
+        std::cout << "Usage: " << argv[0] << " input.h5 output.raw" << std::endl;
+        std::cout << "       " << argv[0] << " input.raw parameters.h5 output.h5" << std::endl;
+        std::cout << "  parameters.h5 is the HDF5 file written alongside the raw trajectory, it is copied to output.h5"
+                  << " and its datasets are filled with the frames" << std::endl;
+        return 0;
+    }
+
+    try {
+        if(argc == 3)
+            RawTrajectory::fromHdf5(argv[1], argv[2]);
+        else
+            RawTrajectory::toHdf5(argv[1], argv[2], argv[3]);
+    } catch(H5::Exception &e) {
+        std::cerr << e.getDetailMsg() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+//
+// Re-simulates the environment of a simulation saved for recompute on demand at every save step
+//
+
+#include <iostream>
+#include <cstdlib>
+#include <H5Cpp.h>
+#include "Environments/Environment.h"
+
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        std::cout << "Usage: " << argv[0] << " input.h5 output.h5 [firstStep [lastStep]]" << std::endl;
+        std::cout << "  Writes the environment of every save between the model timesteps firstStep and lastStep" << std::endl;
+        return 0;
+    }
+    unsigned long long firstStep = argc > 3 ? strtoull(argv[3], nullptr, 10) : 0;
+    unsigned long long lastStep = argc > 4 ? strtoull(argv[4], nullptr, 10) : ~0ull;
+
+    try {
+        H5::H5File input(argv[1], H5F_ACC_RDONLY);
+        double modelDt, envDt;
+        input.openAttribute("dt").read(H5::PredType::NATIVE_DOUBLE, &modelDt);
+        input.openAttribute("Environment dt").read(H5::PredType::NATIVE_DOUBLE, &envDt);
+        H5::H5File output(argv[2], H5F_ACC_TRUNC);
+        Environment::recompute(input.openGroup("Environment"), output.createGroup("Environment"), modelDt, envDt,
+                               firstStep, lastStep);
+    } catch(H5::Exception &e) {
+        std::cerr << e.getDetailMsg() << std::endl;
+        return 1;
+    } catch(af::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
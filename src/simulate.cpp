@@ -3,8 +3,10 @@
 //
 
 #include <csignal>
+#include <cstdlib>
 #include <H5Cpp.h>
 #include "Models/Model2D.h"
+#include "General/SyncCounter.h"
 //#define NO_GRAPHICS
 
 namespace
@@ -19,8 +21,14 @@ void signal_handler(int signal)
 }
 
 int main(int argc, char** argv) {
-    if(argc < 2) {
-        std::cout << "Usage: " << argv[0] << " filename simulationTime" << std::endl;
+    if(argc < 3) {
+        std::cout << "Usage: " << argv[0] << " filename simulationTime [checkpointInterval [output]]" << std::endl;
+        std::cout << "  filename is a trajectory, which is continued, or a checkpoint, which is continued into output" << std::endl;
+        std::cout << "  Every checkpointInterval timesteps the state is written to the checkpoint file <output>.checkpoint" << std::endl;
+        std::cout << "  If BACTSIM_COUNT_SYNCS is set, the host synchronisations per phase are reported at the end" << std::endl;
+        std::cout << "  If BACTSIM_PROFILE is set, the phases are timed and reported to the file it names (JSON) and the" << std::endl;
+        std::cout << "  group Performance of the output, with BACTSIM_PROFILE_SYNC the phases wait for the device" << std::endl;
+        std::cout << "  If BACTSIM_TRACE is set, a timeline of all threads is written to the file it names (Chrome trace)" << std::endl;
         return 0;
     }
 
@@ -35,22 +43,49 @@ int main(int argc, char** argv) {
     printf("Toolkit: %s\n", t_device_toolkit);
     printf("Compute version: %s\n", t_device_compute);
 
-    char *filename = argv[1];
+    std::string filename = argv[1];
     double simulationTime = atof(argv[2]);
+    int checkpointInterval = argc > 3 ? atoi(argv[3]) : 0;
     printf("Running simulation from %s for %f\n", argv[1], simulationTime);
 
-    H5::H5File input(filename, H5F_ACC_RDWR);
-    Model2D mymodel(input);
+    // Checkpoints hold the complete state in a single file and do not require reading the trajectory
+    unique_ptr<Model2D> model;
+    std::string output = filename;
+    if(Checkpoint::isCheckpoint(filename)) {
+        if(argc < 5) {
+            std::cout << "Continuing a checkpoint requires an output file" << std::endl;
+            return 1;
+        }
+        output = argv[4];
+        model.reset(new Model2D(Checkpoint(filename)));
+        H5::H5File outputFile(output, H5F_ACC_TRUNC);
+        model->setupStorage(outputFile, model->getSaveStep());
+    } else {
+        H5::H5File input(filename, H5F_ACC_RDWR);
+        model.reset(new Model2D(input));
+    }
+    Model2D &mymodel = *model;
+    mymodel.enableAsyncStorage();
+    if(checkpointInterval > 0)
+        mymodel.enableCheckpoints(output + ".checkpoint", checkpointInterval);
 #ifndef NO_GRAPHICS
     Window diffusionwindow(1024, 512,"Diffusion simulation");
     diffusionwindow.setColorMap(AF_COLORMAP_HEAT);
     Window populationwindow(1024,512, "Populations");
     mymodel.setupVisualizationWindows(diffusionwindow, populationwindow);
 #endif
+    if(std::getenv("BACTSIM_COUNT_SYNCS"))
+        SyncCounter::setEnabled(true);
+    if(std::getenv("BACTSIM_PROFILE"))
+        mymodel.enableProfiling(std::getenv("BACTSIM_PROFILE"), std::getenv("BACTSIM_PROFILE_SYNC") != nullptr);
+    if(std::getenv("BACTSIM_TRACE"))
+        mymodel.enableTracing(std::getenv("BACTSIM_TRACE"));
     std::signal(SIGINT, signal_handler);
     std::signal(SIGTERM, signal_handler);
     double simulatedTime = mymodel.simulateFor(simulationTime, &continueSimulation);
     std::cout << "Simulated for " << simulatedTime << " of " << simulationTime << std::endl;
+    if(checkpointInterval > 0)
+        mymodel.writeCheckpoint(output + ".checkpoint");
     mymodel.closeStorage();
 
 }
\ No newline at end of file
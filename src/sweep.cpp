@@ -0,0 +1,36 @@
+//
+// Parameter sweep driver, see Sweeps/ParameterSweep.h for the specification format
+//
+
+#include <csignal>
+#include <iostream>
+#include "Sweeps/ParameterSweep.h"
+
+namespace
+{
+    bool continueSweep = true;
+}
+
+void signal_handler(int signal)
+{
+    std::cout << "Got signal, stopping sweep..." << std::endl;
+    continueSweep = false;
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::cout << "Usage: " << argv[0] << " sweepSpecification" << std::endl;
+        return 0;
+    }
+
+    ParameterSweep sweep(argv[1]);
+    printf("Running sweep %s with %zu points\n", argv[1], sweep.getPointCount());
+
+    std::signal(SIGINT, signal_handler);
+    std::signal(SIGTERM, signal_handler);
+    bool complete = sweep.run(&continueSweep);
+    sweep.writeSummary();
+    if(!complete)
+        std::cout << "Sweep incomplete, run again to resume" << std::endl;
+    return complete ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+//
+// Rewrites the population trajectories of a simulation in tiles suited for per bacterium time series
+//
+
+#include <iostream>
+#include <cstdlib>
+#include <H5Cpp.h>
+#include "General/TrajectoryTranspose.h"
+
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        std::cout << "Usage: " << argv[0] << " input.h5 output.h5 [chunkFrames [chunkBacteria]]" << std::endl;
+        std::cout << "  Tiles default to 256 frames x 16 bacteria, memory use is chunkFrames x bacteria per field" << std::endl;
+        return 0;
+    }
+    hsize_t chunkFrames = argc > 3 ? strtoull(argv[3], nullptr, 10) : 256;
+    hsize_t chunkBacteria = argc > 4 ? strtoull(argv[4], nullptr, 10) : 16;
+
+    try {
+        TrajectoryTranspose::transpose(argv[1], argv[2], chunkFrames, chunkBacteria);
+    } catch(H5::Exception &e) {
+        std::cerr << e.getDetailMsg() << std::endl;
+        return 1;
+    }
+    return 0;
+}